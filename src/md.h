@@ -47,6 +47,10 @@ struct md_pkey_spec_t;
 #define MD_TIME_WARN_WINDOW_DEF     (apr_time_from_sec(10 * MD_SECS_PER_DAY))
 #define MD_TIME_OCSP_KEEP_NORM      (apr_time_from_sec(7 * MD_SECS_PER_DAY))
 
+/* Requests open at the same time to an ACME server or OCSP responder */
+#define MD_REQUEST_PARALLEL_DEF     6
+#define MD_REQUEST_PARALLEL_MAX     32
+
 #define MD_OTHER                "other"
 
 typedef enum {
@@ -114,15 +118,19 @@ struct md_t {
 #define MD_KEY_ACTIVITY         "activity"
 #define MD_KEY_AGREEMENT        "agreement"
 #define MD_KEY_AUTHORIZATIONS   "authorizations"
+#define MD_KEY_AVAILABLE        "available"
 #define MD_KEY_BITS             "bits"
 #define MD_KEY_CA               "ca"
 #define MD_KEY_CA_URL           "ca-url"
 #define MD_KEY_CERT             "cert"
 #define MD_KEY_CERT_FILE        "cert-file"
 #define MD_KEY_CERTIFICATE      "certificate"
+#define MD_KEY_CERTS            "certs"
 #define MD_KEY_CHALLENGE        "challenge"
 #define MD_KEY_CHALLENGES       "challenges"
 #define MD_KEY_CMD_DNS01        "cmd-dns-01"
+#define MD_KEY_CMD_DNS01_BATCH  "cmd-dns-01-batch"
+#define MD_KEY_CMD_DNS01_HELPER "cmd-dns-01-helper"
 #define MD_KEY_COMPLETE         "complete"
 #define MD_KEY_CONTACT          "contact"
 #define MD_KEY_CONTACTS         "contacts"
@@ -141,6 +149,9 @@ struct md_t {
 #define MD_KEY_FINALIZE         "finalize"
 #define MD_KEY_FINISHED         "finished"
 #define MD_KEY_FROM             "from"
+#define MD_KEY_GENERATED        "generated"
+#define MD_KEY_GEN_MS_LAST      "last-generation-ms"
+#define MD_KEY_GEN_MS_TOTAL     "total-generation-ms"
 #define MD_KEY_GOOD             "good"
 #define MD_KEY_HTTP             "http"
 #define MD_KEY_HTTPS            "https"
@@ -148,12 +159,14 @@ struct md_t {
 #define MD_KEY_IDENTIFIER       "identifier"
 #define MD_KEY_KEY              "key"
 #define MD_KEY_KEYAUTHZ         "keyAuthorization"
+#define MD_KEY_KEY_POOL         "key-pool"
 #define MD_KEY_LAST             "last"
 #define MD_KEY_LAST_RUN         "last-run"
 #define MD_KEY_LOCATION         "location"
 #define MD_KEY_LOG              "log"
 #define MD_KEY_MDS              "managed-domains"
 #define MD_KEY_MESSAGE          "message"
+#define MD_KEY_MODIFIED         "modified"
 #define MD_KEY_MUST_STAPLE      "must-staple"
 #define MD_KEY_NAME             "name"
 #define MD_KEY_NEXT_RUN         "next-run"
@@ -171,15 +184,18 @@ struct md_t {
 #define MD_KEY_RENEW            "renew"
 #define MD_KEY_RENEW_AT         "renew-at"
 #define MD_KEY_RENEW_MODE       "renew-mode"
+#define MD_KEY_RENEW_NOWAIT     "renew-nowait"
 #define MD_KEY_RENEWAL          "renewal"
 #define MD_KEY_RENEWING         "renewing"
 #define MD_KEY_RENEW_WINDOW     "renew-window"
+#define MD_KEY_REQUEST_PARALLELISM "request-parallelism"
 #define MD_KEY_REQUIRE_HTTPS    "require-https"
 #define MD_KEY_RESOURCE         "resource"
 #define MD_KEY_RESPONSE         "response"
 #define MD_KEY_REVOKED          "revoked"
 #define MD_KEY_SERIAL           "serial"
 #define MD_KEY_SHA256_FINGERPRINT  "sha256-fingerprint"
+#define MD_KEY_SIZE             "size"
 #define MD_KEY_STAPLING         "stapling"
 #define MD_KEY_STATE            "state"
 #define MD_KEY_STATUS           "status"
@@ -254,6 +270,21 @@ md_t *md_get_by_domain(struct apr_array_header_t *mds, const char *domain);
  */
 md_t *md_get_by_dns_overlap(struct apr_array_header_t *mds, const md_t *md);
 
+typedef struct md_domain_idx_t md_domain_idx_t;
+
+/**
+ * Create an index of the DNS names in the managed domains, for lookups 
+ * without scanning them all. The mds and their domains must not change
+ * while the index is in use.
+ */
+md_domain_idx_t *md_domain_idx_make(struct apr_array_header_t *mds, apr_pool_t *p);
+
+/**
+ * Look up a managed domain by a DNS name it contains, with the same result
+ * as md_get_by_domain() on the indexed mds.
+ */
+md_t *md_domain_idx_get(const md_domain_idx_t *idx, const char *domain);
+
 /**
  * Create and empty md record, structures initialized.
  */
@@ -302,10 +333,16 @@ typedef apr_status_t md_job_notify_cb(struct md_job_t *job, const char *reason,
 
 typedef struct md_pubcert_t md_pubcert_t;
 struct md_pubcert_t {
-    struct apr_array_header_t *certs;     /* chain of const md_cert*, leaf cert first */
+    struct apr_array_header_t *certs;     /* chain of const md_cert*, leaf cert first,
+                                             NULL when taken from the startup snapshot,
+                                             until the registry is frozen */
     struct apr_array_header_t *alt_names; /* alt-names of leaf cert */
-    const char *cert_file;                /* file path of chain */
+    const char *cert_file;                /* file path of chain, NULL if chain is missing */
     const char *key_file;                 /* file path of key for leaf cert */
+    apr_time_t not_before;                /* validity of leaf cert */
+    apr_time_t not_after;
+    int must_staple;                      /* leaf cert has OCSP must-staple extension */
+    int from_snapshot;                    /* record was taken from the startup snapshot */
 };
 
 #define MD_OK(c)                    (APR_SUCCESS == (rv = c))
@@ -22,11 +22,13 @@
 #include <apr_buckets.h>
 #include <apr_hash.h>
 #include <apr_uri.h>
+#include <apr_thread_mutex.h>
 
 #include "md.h"
 #include "md_crypt.h"
 #include "md_json.h"
 #include "md_jws.h"
+#include "md_helper.h"
 #include "md_http.h"
 #include "md_log.h"
 #include "md_store.h"
@@ -106,15 +108,307 @@ int md_acme_problem_is_input_related(const char *problem) {
     return 0;
 }
 
+/**************************************************************************************************/
+/* process wide budgets and caches per CA */
+
+struct md_acme_budget_t {
+    const char *url;
+    int limited;                    /* CA with known limits, apply MD_ACME_CA_* */
+    apr_time_t paused_until;        /* CA asked us not to send anything before */
+    apr_time_t window_start;        /* start of the current orders window */
+    int orders;                     /* new orders placed in the current window */
+    apr_time_t next_req;            /* earliest time for the next request */
+    apr_pool_t *dir_pool;           /* holds dir_json, cleared on update */
+    const char *dir_json;           /* directory as last fetched, or NULL */
+    apr_time_t dir_fetched;         /* when dir_json was fetched */
+    const char *acct_id;            /* account last used successfully, or NULL */
+};
+
+static apr_pool_t *budget_pool;
+static apr_hash_t *budgets;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *budget_mutex;
+static apr_thread_mutex_t *acct_index_mutex;
+#endif
+
+static void budget_lock(void)
+{
+#if APR_HAS_THREADS
+    if (budget_mutex) apr_thread_mutex_lock(budget_mutex);
+#endif
+}
+
+static void budget_unlock(void)
+{
+#if APR_HAS_THREADS
+    if (budget_mutex) apr_thread_mutex_unlock(budget_mutex);
+#endif
+}
+
+void md_acme_acct_index_lock(void)
+{
+#if APR_HAS_THREADS
+    if (acct_index_mutex) apr_thread_mutex_lock(acct_index_mutex);
+#endif
+}
+
+void md_acme_acct_index_unlock(void)
+{
+#if APR_HAS_THREADS
+    if (acct_index_mutex) apr_thread_mutex_unlock(acct_index_mutex);
+#endif
+}
+
+static void budgets_init(void)
+{
+    if (budget_pool) return;
+    /* lives as long as the process, budgets are shared by all its threads */
+    if (APR_SUCCESS != apr_pool_create(&budget_pool, NULL)) {
+        budget_pool = NULL;
+        return;
+    }
+    apr_pool_tag(budget_pool, "md_acme_budgets");
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != apr_thread_mutex_create(&budget_mutex, APR_THREAD_MUTEX_DEFAULT, 
+                                               budget_pool)) {
+        budget_mutex = NULL;
+    }
+    if (APR_SUCCESS != apr_thread_mutex_create(&acct_index_mutex, APR_THREAD_MUTEX_DEFAULT, 
+                                               budget_pool)) {
+        acct_index_mutex = NULL;
+    }
+#endif
+    budgets = apr_hash_make(budget_pool);
+}
+
+md_acme_budget_t *md_acme_budget_get(const char *ca_url)
+{
+    md_acme_budget_t *budget;
+    
+    if (!budgets || !ca_url) return NULL;
+    budget_lock();
+    budget = apr_hash_get(budgets, ca_url, APR_HASH_KEY_STRING);
+    if (!budget) {
+        budget = apr_pcalloc(budget_pool, sizeof(*budget));
+        budget->url = apr_pstrdup(budget_pool, ca_url);
+        budget->limited = (!strcmp(LE_ACMEv2_PROD, ca_url) 
+                           || !strcmp(LE_ACMEv2_STAGING, ca_url));
+        apr_hash_set(budgets, budget->url, APR_HASH_KEY_STRING, budget);
+    }
+    budget_unlock();
+    return budget;
+}
+
+apr_time_t md_acme_budget_paused_until(md_acme_budget_t *budget)
+{
+    apr_time_t until;
+    
+    if (!budget) return 0;
+    budget_lock();
+    until = (budget->paused_until > apr_time_now())? budget->paused_until : 0;
+    budget_unlock();
+    return until;
+}
+
+apr_time_t md_acme_budget_take_order(md_acme_budget_t *budget)
+{
+    apr_time_t now, at = 0;
+    
+    if (!budget) return 0;
+    budget_lock();
+    now = apr_time_now();
+    if (budget->paused_until > now) {
+        at = budget->paused_until;
+    }
+    else if (budget->limited) {
+        if (now - budget->window_start >= MD_ACME_CA_ORDERS_WINDOW) {
+            budget->window_start = now;
+            budget->orders = 0;
+        }
+        if (budget->orders >= MD_ACME_CA_ORDERS_MAX) {
+            at = budget->window_start + MD_ACME_CA_ORDERS_WINDOW;
+        }
+        else {
+            ++budget->orders;
+        }
+    }
+    budget_unlock();
+    return at;
+}
+
+const char *md_acme_budget_acct_get(md_acme_budget_t *budget, apr_pool_t *p)
+{
+    const char *id;
+    
+    if (!budget) return NULL;
+    budget_lock();
+    id = budget->acct_id? apr_pstrdup(p, budget->acct_id) : NULL;
+    budget_unlock();
+    return id;
+}
+
+void md_acme_budget_acct_set(md_acme_budget_t *budget, const char *id)
+{
+    if (!budget) return;
+    budget_lock();
+    if (!id) {
+        budget->acct_id = NULL;
+    }
+    else if (!budget->acct_id || strcmp(id, budget->acct_id)) {
+        /* accounts change seldom, we do not bother to reclaim the old id */
+        budget->acct_id = apr_pstrdup(budget_pool, id);
+    }
+    budget_unlock();
+}
+
+static md_json_t *budget_dir_get(md_acme_budget_t *budget, apr_pool_t *p)
+{
+    md_json_t *json = NULL;
+    
+    if (!budget) return NULL;
+    budget_lock();
+    if (budget->dir_json && (apr_time_now() - budget->dir_fetched) < MD_ACME_CA_DIR_TTL) {
+        if (APR_SUCCESS != md_json_readd(&json, p, budget->dir_json, strlen(budget->dir_json))) {
+            json = NULL;
+        }
+    }
+    budget_unlock();
+    return json;
+}
+
+static void budget_dir_set(md_acme_budget_t *budget, md_json_t *json)
+{
+    if (!budget) return;
+    budget_lock();
+    if (budget->dir_pool) {
+        apr_pool_clear(budget->dir_pool);
+    }
+    else if (APR_SUCCESS != apr_pool_create(&budget->dir_pool, budget_pool)) {
+        budget->dir_pool = NULL;
+        goto leave;
+    }
+    budget->dir_json = md_json_writep(json, budget->dir_pool, MD_JSON_FMT_COMPACT);
+    budget->dir_fetched = apr_time_now();
+leave:
+    budget_unlock();
+}
+
+static void budget_pause(md_acme_budget_t *budget, const apr_table_t *hdrs, 
+                         int http_status, apr_pool_t *p)
+{
+    apr_time_t now, until;
+    
+    if (!budget) return;
+    now = apr_time_now();
+    until = md_util_parse_retry_after(hdrs? apr_table_get(hdrs, "Retry-After") : NULL, now);
+    if (until <= now) {
+        if (!budget->limited) return;
+        until = now + MD_ACME_CA_PAUSE_DEF;
+    }
+    budget_lock();
+    if (until > budget->paused_until) budget->paused_until = until;
+    budget_unlock();
+    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, p, "ACME server at <%s> answered %d, "
+                  "pausing all requests to it for %s", budget->url, http_status, 
+                  md_duration_print(p, until - now));
+}
+
+/* When the next request may be sent to the CA, 0 if right away. */
+static apr_time_t budget_next_req(md_acme_budget_t *budget)
+{
+    apr_time_t now, at = 0;
+    
+    if (!budget) return 0;
+    budget_lock();
+    now = apr_time_now();
+    if (budget->paused_until > now) {
+        at = budget->paused_until;
+    }
+    else if (budget->limited && budget->next_req > now) {
+        at = budget->next_req;
+    }
+    budget_unlock();
+    return at;
+}
+
+/* Take the slot for a request. A request rate slot is at most 
+ * 1/MD_ACME_CA_REQ_PER_SEC away and we wait for it. When the CA asked us
+ * to pause, fail with APR_EAGAIN and the end of the pause as ready_at, so
+ * the renewal yields. */
+static apr_status_t budget_admit_req(md_acme_req_t *req)
+{
+    md_acme_budget_t *budget = req->acme->budget;
+    apr_time_t now, paused_until, wait;
+    char ts[APR_RFC822_DATE_LEN];
+    
+    if (!budget) return APR_SUCCESS;
+    while (1) {
+        paused_until = wait = 0;
+        budget_lock();
+        now = apr_time_now();
+        if (budget->paused_until > now) {
+            paused_until = budget->paused_until;
+        }
+        else if (budget->limited && budget->next_req > now) {
+            wait = budget->next_req - now;
+        }
+        else if (budget->limited) {
+            budget->next_req = now + apr_time_from_sec(1) / MD_ACME_CA_REQ_PER_SEC;
+        }
+        budget_unlock();
+        
+        if (!wait) break;
+        /* another renewal took the slot, ours is next or soon after */
+        apr_sleep(wait);
+    }
+    
+    if (paused_until) {
+        apr_rfc822_date(ts, paused_until);
+        md_result_printf(req->result, APR_EAGAIN, "The ACME server at <%s> asked us "
+                         "to pause until %s", budget->url, ts);
+        md_result_yield_set(req->result, paused_until);
+        return APR_EAGAIN;
+    }
+    return APR_SUCCESS;
+}
+
 /**************************************************************************************************/
 /* acme requests */
 
+static void nonce_add(md_acme_t *acme, const char *nonce)
+{
+    if (acme->nonces->nelts >= MD_ACME_MAX_NONCES) {
+        /* drop the oldest, it is the most likely to have expired */
+        --acme->nonces->nelts;
+        memmove(acme->nonces->elts, acme->nonces->elts + sizeof(const char*), 
+                (size_t)acme->nonces->nelts * sizeof(const char*));
+    }
+    APR_ARRAY_PUSH(acme->nonces, const char*) = apr_pstrdup(acme->p, nonce);
+}
+
+static const char *nonce_take(md_acme_t *acme)
+{
+    const char **pnonce;
+    
+    /* newest first, as the server might already have forgotten the old ones */
+    pnonce = apr_array_pop(acme->nonces);
+    if (!pnonce) return NULL;
+    ++acme->nonces_used;
+    /* Keeping only the nonce of the last response, we would have had one
+     * here if it was fresh. Otherwise this one is an older one from the
+     * pool or was fetched in parallel, and spared us a blocking HEAD. */
+    if (!acme->nonce_fresh) ++acme->nonces_saved;
+    acme->nonce_fresh = 0;
+    return *pnonce;
+}
+
 static void req_update_nonce(md_acme_t *acme, apr_table_t *hdrs)
 {
     if (hdrs) {
         const char *nonce = apr_table_get(hdrs, "Replay-Nonce");
         if (nonce) {
-            acme->nonce = apr_pstrdup(acme->p, nonce);
+            nonce_add(acme, nonce);
+            acme->nonce_fresh = 1;
         }
     }
 }
@@ -159,6 +453,7 @@ static md_acme_req_t *md_acme_req_create(md_acme_t *acme, const char *method, co
  
 static apr_status_t acmev2_new_nonce(md_acme_t *acme)
 {
+    ++acme->nonce_heads;
     return md_http_HEAD_perform(acme->http, acme->api.v2.new_nonce, NULL, http_update_nonce, acme);
 }
 
@@ -166,6 +461,8 @@ static apr_status_t acmev2_new_nonce(md_acme_t *acme)
 apr_status_t md_acme_init(apr_pool_t *p, const char *base,  int init_ssl)
 {
     base_product = base;
+    budgets_init();
+    md_helper_init();
     return init_ssl? md_crypt_init(p) : APR_SUCCESS;
 }
 
@@ -227,6 +524,7 @@ static apr_status_t inspect_problem(md_acme_req_t *req, const md_http_response_t
 static apr_status_t acmev2_req_init(md_acme_req_t *req, md_json_t *jpayload)
 {
     md_data_t payload;
+    md_jws_ctx_t *jws;
     
     if (!req->acme->acct) {
         return APR_EINVAL;
@@ -244,8 +542,10 @@ static apr_status_t acmev2_req_init(md_acme_req_t *req, md_json_t *jpayload)
     payload.len = strlen(payload.data);
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, req->p, 
                   "acme payload(len=%" APR_SIZE_T_FMT "): %s", payload.len, payload.data);
-    return md_jws_sign(&req->req_json, req->p, &payload,
-                       req->prot_hdrs, req->acme->acct_key, req->acme->acct->url);
+    if (!(jws = md_acme_jws_get(req->acme))) {
+        return APR_EINVAL;
+    }
+    return md_jws_ctx_sign(&req->req_json, jws, req->p, &payload, req->prot_hdrs);
 }
 
 apr_status_t md_acme_req_body_init(md_acme_req_t *req, md_json_t *payload)
@@ -265,6 +565,9 @@ static apr_status_t md_acme_req_done(md_acme_req_t *req, apr_status_t rv)
     rv = req->result->status;
     /* transfer results into the acme's central result for longer life and later inspection */
     md_result_dup(req->acme->last, req->result);
+    if (req->on_done) {
+        req->on_done(req, rv, req->done_baton);
+    }
     if (req->p) {
         apr_pool_destroy(req->p);
     }
@@ -280,6 +583,11 @@ static apr_status_t on_response(const md_http_response_t *res, void *data)
     req_update_nonce(req->acme, res->headers);
     
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, req->p, "response: %d", res->status);
+    if (res->status == 429 || res->status == 503) {
+        /* told to slow down, everyone talking to this CA does */
+        budget_pause(req->acme->budget, res->headers, res->status, req->p);
+    }
+    
     if (res->status >= 200 && res->status < 300) {
         int processed = 0;
         
@@ -333,12 +641,13 @@ static apr_status_t acmev2_GET_as_POST_init(md_acme_req_t *req, void *baton)
     return md_acme_req_body_init(req, NULL);
 }
 
-static apr_status_t md_acme_req_send(md_acme_req_t *req)
+static apr_status_t req_prepare(md_acme_req_t *req, md_data_t **pbody)
 {
     apr_status_t rv;
     md_acme_t *acme = req->acme;
     md_data_t *body = NULL;
     md_result_t *result;
+    const char *nonce;
 
     assert(acme->url);
     
@@ -347,6 +656,8 @@ static apr_status_t md_acme_req_send(md_acme_req_t *req)
     md_result_reset(req->acme->last);
     result = md_result_make(req->p, APR_SUCCESS);
     
+    if (APR_SUCCESS != (rv = budget_admit_req(req))) goto leave;
+    
     /* Whom are we talking to? */
     if (acme->version == MD_ACME_VERSION_UNKNOWN) {
         rv = md_acme_setup(acme, result);
@@ -371,15 +682,20 @@ static apr_status_t md_acme_req_send(md_acme_req_t *req)
             rv = md_acme_setup(acme, result);
             if (APR_SUCCESS != rv) goto leave;
         }
-        if (!acme->nonce && (APR_SUCCESS != (rv = acme->new_nonce_fn(acme)))) {
+        if (!acme->nonces->nelts && (APR_SUCCESS != (rv = acme->new_nonce_fn(acme)))) {
             md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, req->p, 
                           "error retrieving new nonce from ACME server");
             goto leave;
         }
+        if (!(nonce = nonce_take(acme))) {
+            rv = APR_EINVAL;
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, req->p, 
+                          "ACME server did not send a new nonce");
+            goto leave;
+        }
         
-        apr_table_set(req->prot_hdrs, "nonce", acme->nonce);
+        apr_table_set(req->prot_hdrs, "nonce", nonce);
         apr_table_set(req->prot_hdrs, "url", req->url);
-        acme->nonce = NULL;
     }
     
     rv = req->on_init? req->on_init(req, req->baton) : APR_SUCCESS;
@@ -402,22 +718,48 @@ static apr_status_t md_acme_req_send(md_acme_req_t *req)
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, req->p, 
                       "req: %s %s", req->method, req->url);
     }
+leave:
+    *pbody = body;
+    return rv;
+}
+
+static apr_status_t req_http_create(md_http_request_t **phreq, md_acme_req_t *req, 
+                                    md_data_t *body)
+{
+    apr_status_t rv;
     
+    *phreq = NULL;
     if (!strcmp("GET", req->method)) {
-        rv = md_http_GET_perform(req->acme->http, req->url, NULL, on_response, req);
+        rv = md_http_GET_create(phreq, req->acme->http, req->url, NULL);
     }
     else if (!strcmp("POST", req->method)) {
-        rv = md_http_POSTd_perform(req->acme->http, req->url, NULL, "application/jose+json",  
-                                   body, on_response, req);
+        rv = md_http_POSTd_create(phreq, req->acme->http, req->url, NULL, 
+                                  "application/jose+json", body);
     }
     else if (!strcmp("HEAD", req->method)) {
-        rv = md_http_HEAD_perform(req->acme->http, req->url, NULL, on_response, req);
+        rv = md_http_HEAD_create(phreq, req->acme->http, req->url, NULL);
     }
     else {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, req->p, 
                       "HTTP method %s against: %s", req->method, req->url);
         rv = APR_ENOTIMPL;
     }
+    return rv;
+}
+
+static apr_status_t md_acme_req_send(md_acme_req_t *req)
+{
+    apr_status_t rv;
+    md_data_t *body;
+    md_http_request_t *hreq;
+
+    rv = req_prepare(req, &body);
+    if (APR_SUCCESS != rv) goto leave;
+    rv = req_http_create(&hreq, req, body);
+    if (APR_SUCCESS != rv) goto leave;
+    
+    md_http_set_on_response_cb(hreq, on_response, req);
+    rv = md_http_perform(hreq);
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, req->p, "req sent");
     
     if (APR_EAGAIN == rv && req->max_retries > 0) {
@@ -431,6 +773,35 @@ leave:
     return rv;
 }
 
+md_acme_req_t *md_acme_req_make(md_acme_t *acme, const char *method, const char *url,
+                                md_acme_req_init_cb *on_init,
+                                md_acme_req_json_cb *on_json,
+                                md_acme_req_res_cb *on_res,
+                                md_acme_req_err_cb *on_err,
+                                void *baton)
+{
+    md_acme_req_t *req;
+    
+    assert(url);
+    assert(on_json || on_res);
+
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, acme->p, "add acme %s: %s", method, url);
+    req = md_acme_req_create(acme, method, url);
+    if (req) {
+        req->on_init = on_init;
+        req->on_json = on_json;
+        req->on_res = on_res;
+        req->on_err = on_err;
+        req->baton = baton;
+    }
+    return req;
+}
+
+apr_status_t md_acme_req_perform(md_acme_req_t *req)
+{
+    return req? md_acme_req_send(req) : APR_ENOMEM;
+}
+
 apr_status_t md_acme_POST(md_acme_t *acme, const char *url,
                           md_acme_req_init_cb *on_init,
                           md_acme_req_json_cb *on_json,
@@ -438,20 +809,8 @@ apr_status_t md_acme_POST(md_acme_t *acme, const char *url,
                           md_acme_req_err_cb *on_err,
                           void *baton)
 {
-    md_acme_req_t *req;
-    
-    assert(url);
-    assert(on_json || on_res);
-
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, acme->p, "add acme POST: %s", url);
-    req = md_acme_req_create(acme, "POST", url);
-    req->on_init = on_init;
-    req->on_json = on_json;
-    req->on_res = on_res;
-    req->on_err = on_err;
-    req->baton = baton;
-    
-    return md_acme_req_send(req);
+    return md_acme_req_perform(md_acme_req_make(acme, "POST", url, on_init, 
+                                                on_json, on_res, on_err, baton));
 }
 
 apr_status_t md_acme_GET(md_acme_t *acme, const char *url,
@@ -461,20 +820,211 @@ apr_status_t md_acme_GET(md_acme_t *acme, const char *url,
                           md_acme_req_err_cb *on_err,
                          void *baton)
 {
+    return md_acme_req_perform(md_acme_req_make(acme, "GET", url, on_init, 
+                                                on_json, on_res, on_err, baton));
+}
+
+/**************************************************************************************************/
+/* parallel ACME requests */
+
+typedef struct {
+    md_acme_t *acme;
+    md_acme_next_req_cb *nextreq;
+    void *baton;
+    apr_array_header_t *pending;    /* requests to send, first in first out */
+    int nonce_fetches;              /* HEAD requests for nonces in flight */
+    int nonce_failed;               /* HEAD for a nonce gave none */
+} multi_ctx_t;
+
+typedef struct {
+    multi_ctx_t *ctx;
     md_acme_req_t *req;
+    int responded;
+} multi_req_t;
+
+static apr_status_t multi_on_response(const md_http_response_t *res, void *data)
+{
+    multi_req_t *mreq = data;
     
-    assert(url);
-    assert(on_json || on_res);
+    mreq->responded = 1;
+    return on_response(res, mreq->req);
+}
 
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, acme->p, "add acme GET: %s", url);
-    req = md_acme_req_create(acme, "GET", url);
-    req->on_init = on_init;
-    req->on_json = on_json;
-    req->on_res = on_res;
-    req->on_err = on_err;
-    req->baton = baton;
+static apr_status_t multi_on_status(const md_http_request_t *hreq, apr_status_t status, 
+                                    void *data)
+{
+    multi_req_t *mreq = data;
+    md_acme_req_t *req = mreq->req;
+    
+    (void)hreq;
+    if (!mreq->responded) {
+        /* never got a response, on_response did not finish the request */
+        md_acme_req_done(req, status);
+    }
+    else if (APR_EAGAIN == status) {
+        /* on_response left the request alive for a retry */
+        if (req->max_retries > 0) {
+            --req->max_retries;
+            APR_ARRAY_PUSH(mreq->ctx->pending, md_acme_req_t*) = req;
+        }
+        else {
+            md_acme_req_done(req, status);
+        }
+    }
+    return APR_SUCCESS;
+}
+
+static md_acme_req_t *pending_shift(multi_ctx_t *ctx)
+{
+    md_acme_req_t *req;
     
-    return md_acme_req_send(req);
+    req = APR_ARRAY_IDX(ctx->pending, 0, md_acme_req_t*);
+    --ctx->pending->nelts;
+    memmove(ctx->pending->elts, ctx->pending->elts + sizeof(md_acme_req_t*), 
+            (size_t)ctx->pending->nelts * sizeof(md_acme_req_t*));
+    return req;
+}
+
+static int req_needs_nonce(md_acme_req_t *req)
+{
+    /* as decided in req_prepare(): all but HEAD and explicit GETs become signed POSTs */
+    if (!strcmp("HEAD", req->method)) return 0;
+    if (!strcmp("GET", req->method)) return !req->on_init && !req->req_json;
+    return 1;
+}
+
+static apr_status_t nonce_on_response(const md_http_response_t *res, void *data)
+{
+    multi_ctx_t *ctx = data;
+    const char *nonce;
+    
+    if (!(nonce = apr_table_get(res->headers, "Replay-Nonce"))) return APR_ENOENT;
+    nonce_add(ctx->acme, nonce);
+    return APR_SUCCESS;
+}
+
+static apr_status_t nonce_on_status(const md_http_request_t *hreq, apr_status_t status, 
+                                    void *data)
+{
+    multi_ctx_t *ctx = data;
+    
+    (void)hreq;
+    --ctx->nonce_fetches;
+    if (APR_SUCCESS != status) {
+        /* let req_prepare() do the HEAD and report what goes wrong */
+        ctx->nonce_failed = 1;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t nonce_fetch_create(md_http_request_t **phreq, multi_ctx_t *ctx)
+{
+    md_acme_t *acme = ctx->acme;
+    apr_status_t rv;
+    
+    rv = md_http_HEAD_create(phreq, acme->http, acme->api.v2.new_nonce, NULL);
+    if (APR_SUCCESS == rv) {
+        md_http_set_on_response_cb(*phreq, nonce_on_response, ctx);
+        md_http_set_on_status_cb(*phreq, nonce_on_status, ctx);
+        ++ctx->nonce_fetches;
+        ++acme->nonce_heads;
+    }
+    return rv;
+}
+
+static apr_status_t multi_next_req(md_http_request_t **phreq, void *baton, 
+                                   md_http_t *http, int in_flight)
+{
+    multi_ctx_t *ctx = baton;
+    md_acme_req_t *req;
+    md_http_request_t *hreq;
+    md_data_t *body;
+    multi_req_t *mreq;
+    apr_status_t rv;
+    
+    (void)http;
+    *phreq = NULL;
+    while (in_flight < ctx->acme->max_parallel) {
+        if (!ctx->pending->nelts) {
+            rv = ctx->nextreq(&req, ctx->baton, in_flight);
+            if (APR_SUCCESS != rv) return rv;
+            APR_ARRAY_PUSH(ctx->pending, md_acme_req_t*) = req;
+        }
+        
+        req = APR_ARRAY_IDX(ctx->pending, 0, md_acme_req_t*);
+        if (req_needs_nonce(req) && !ctx->acme->nonces->nelts 
+            && !ctx->nonce_failed && ctx->acme->api.v2.new_nonce) {
+            /* Instead of blocking on a HEAD for each, get nonces for all
+             * pending requests in parallel and send them when they arrive. */
+            if (ctx->nonce_fetches < ctx->pending->nelts) {
+                if (APR_SUCCESS == nonce_fetch_create(phreq, ctx)) return APR_SUCCESS;
+                ctx->nonce_failed = 1;
+                continue;
+            }
+            rv = ctx->nextreq(&req, ctx->baton, in_flight);
+            if (APR_SUCCESS != rv) return rv;
+            APR_ARRAY_PUSH(ctx->pending, md_acme_req_t*) = req;
+            continue;
+        }
+        
+        if (in_flight > 0 && budget_next_req(ctx->acme->budget)) {
+            /* Leave it queued, we are asked again when a response arrives
+             * or the poll times out. With nothing in flight, req_prepare()
+             * waits for the slot or, if the CA asked for a pause, fails it
+             * with APR_EAGAIN and the renewal yields instead. */
+            return APR_ENOENT;
+        }
+        req = pending_shift(ctx);
+        rv = req_prepare(req, &body);
+        if (APR_SUCCESS == rv) rv = req_http_create(&hreq, req, body);
+        if (APR_SUCCESS != rv) {
+            /* this one is finished, its on_done knows why. Try the next. */
+            md_acme_req_done(req, rv);
+            continue;
+        }
+        
+        mreq = apr_pcalloc(hreq->pool, sizeof(*mreq));
+        mreq->ctx = ctx;
+        mreq->req = req;
+        md_http_set_on_response_cb(hreq, multi_on_response, mreq);
+        md_http_set_on_status_cb(hreq, multi_on_status, mreq);
+        *phreq = hreq;
+        return APR_SUCCESS;
+    }
+    return APR_ENOENT;
+}
+
+apr_status_t md_acme_multi_perform(md_acme_t *acme, md_acme_next_req_cb *nextreq, void *baton)
+{
+    multi_ctx_t ctx;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, acme->p))) goto leave;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.acme = acme;
+    ctx.nextreq = nextreq;
+    ctx.baton = baton;
+    ctx.pending = apr_array_make(ptemp, 5, sizeof(md_acme_req_t*));
+    
+    if (acme->version == MD_ACME_VERSION_UNKNOWN) {
+        /* do this once before going parallel */
+        rv = md_acme_setup(acme, md_result_make(ptemp, APR_SUCCESS));
+        if (APR_SUCCESS != rv) goto cleanup;
+    }
+    rv = md_http_multi_perform(acme->http, multi_next_req, &ctx);
+    
+cleanup:
+    while (ctx.pending->nelts > 0) {
+        /* aborted before all requests could be made */
+        md_acme_req_done(pending_shift(&ctx), (APR_SUCCESS == rv)? APR_EGENERAL : rv);
+    }
+    apr_pool_destroy(ptemp);
+leave:
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, acme->p, "acme multi perform done, "
+                  "%d nonces used, %d without blocking HEAD, %d HEAD requests for nonces", 
+                  acme->nonces_used, acme->nonces_saved, acme->nonce_heads);
+    return rv;
 }
 
 void md_acme_report_result(md_acme_t *acme, apr_status_t rv, struct md_result_t *result)
@@ -485,6 +1035,7 @@ void md_acme_report_result(md_acme_t *acme, apr_status_t rv, struct md_result_t
     else {
         md_result_problem_set(result, acme->last->status, acme->last->problem, 
                               acme->last->detail, acme->last->subproblems);
+        if (acme->last->yielded) md_result_yield_set(result, acme->last->ready_at);
     }
 }
 
@@ -542,6 +1093,20 @@ const char *md_acme_acct_url_get(md_acme_t *acme)
     return acme->acct? acme->acct->url : NULL;
 }
 
+md_jws_ctx_t *md_acme_jws_get(md_acme_t *acme)
+{
+    const char *key_id = md_acme_acct_url_get(acme);
+    
+    if (!acme->acct_key) return NULL;
+    if (!acme->jws || !md_jws_ctx_is_for(acme->jws, acme->acct_key, key_id)) {
+        /* changes seldom, e.g. once when a new account gets its url */
+        if (APR_SUCCESS != md_jws_ctx_create(&acme->jws, acme->p, acme->acct_key, key_id)) {
+            acme->jws = NULL;
+        }
+    }
+    return acme->jws;
+}
+
 apr_status_t md_acme_use_acct(md_acme_t *acme, md_store_t *store,
                               apr_pool_t *p, const char *acct_id)
 {
@@ -620,6 +1185,9 @@ apr_status_t md_acme_create(md_acme_t **pacme, apr_pool_t *p, const char *url,
                                     base_product, MOD_MD_VERSION);
     acme->proxy_url = proxy_url? apr_pstrdup(p, proxy_url) : NULL;
     acme->max_retries = 99;
+    acme->max_parallel = MD_REQUEST_PARALLEL_DEF;
+    acme->nonces = apr_array_make(p, MD_ACME_MAX_NONCES, sizeof(const char*));
+    acme->budget = md_acme_budget_get(url);
     acme->ca_file = ca_file;
 
     if (APR_SUCCESS != (rv = apr_uri_parse(p, url, &uri_parsed))) {
@@ -641,46 +1209,11 @@ typedef struct {
     md_result_t *result;
 } update_dir_ctx;
 
-static apr_status_t update_directory(const md_http_response_t *res, void *data)
+static apr_status_t directory_apply(md_acme_t *acme, md_json_t *json, md_result_t *result)
 {
-    md_http_request_t *req = res->req;
-    md_acme_t *acme = ((update_dir_ctx *)data)->acme;
-    md_result_t *result = ((update_dir_ctx *)data)->result;
-    apr_status_t rv;
-    md_json_t *json;
+    apr_status_t rv = APR_SUCCESS;
     const char *s;
     
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, req->pool, "directory lookup response: %d", res->status);
-    if (res->status == 503) {
-        md_result_printf(result, APR_EAGAIN,
-            "The ACME server at <%s> reports that Service is Unavailable (503). This "
-            "may happen during maintenance for short periods of time.", acme->url); 
-        md_result_log(result, MD_LOG_INFO);
-        rv = result->status;
-        goto leave;
-    }
-    else if (res->status < 200 || res->status >= 300) {
-        md_result_printf(result, APR_EAGAIN,
-            "The ACME server at <%s> responded with HTTP status %d. This "
-            "is unusual. Please verify that the URL is correct and that you can indeed "
-            "make request from the server to it by other means, e.g. invoking curl/wget.", 
-            acme->url, res->status);
-        rv = result->status;
-        goto leave;
-    }
-    
-    rv = md_json_read_http(&json, req->pool, res);
-    if (APR_SUCCESS != rv) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, req->pool, "reading JSON body");
-        goto leave;
-    }
-    
-    if (md_log_is_level(acme->p, MD_LOG_TRACE2)) {
-        s = md_json_writep(json, req->pool, MD_JSON_FMT_INDENT);
-        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, rv, req->pool,
-                      "response: %s", s ? s : "<failed to serialize!>");
-    }
-    
     /* What have we got? */
     if ((s = md_json_dups(acme->p, json, "newAccount", NULL))) {
         acme->api.v2.new_account = s;
@@ -725,6 +1258,53 @@ static apr_status_t update_directory(const md_http_response_t *res, void *data)
         md_result_log(result, MD_LOG_WARNING);
         rv = result->status;
     }
+    return rv;
+}
+
+static apr_status_t update_directory(const md_http_response_t *res, void *data)
+{
+    md_http_request_t *req = res->req;
+    md_acme_t *acme = ((update_dir_ctx *)data)->acme;
+    md_result_t *result = ((update_dir_ctx *)data)->result;
+    apr_status_t rv;
+    md_json_t *json;
+    const char *s;
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, req->pool, "directory lookup response: %d", res->status);
+    if (res->status == 503) {
+        budget_pause(acme->budget, res->headers, res->status, req->pool);
+        md_result_printf(result, APR_EAGAIN,
+            "The ACME server at <%s> reports that Service is Unavailable (503). This "
+            "may happen during maintenance for short periods of time.", acme->url); 
+        md_result_log(result, MD_LOG_INFO);
+        rv = result->status;
+        goto leave;
+    }
+    else if (res->status < 200 || res->status >= 300) {
+        md_result_printf(result, APR_EAGAIN,
+            "The ACME server at <%s> responded with HTTP status %d. This "
+            "is unusual. Please verify that the URL is correct and that you can indeed "
+            "make request from the server to it by other means, e.g. invoking curl/wget.", 
+            acme->url, res->status);
+        rv = result->status;
+        goto leave;
+    }
+    
+    rv = md_json_read_http(&json, req->pool, res);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, req->pool, "reading JSON body");
+        goto leave;
+    }
+    
+    if (md_log_is_level(acme->p, MD_LOG_TRACE2)) {
+        s = md_json_writep(json, req->pool, MD_JSON_FMT_INDENT);
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, rv, req->pool,
+                      "response: %s", s ? s : "<failed to serialize!>");
+    }
+    
+    if (APR_SUCCESS == (rv = directory_apply(acme, json, result))) {
+        budget_dir_set(acme->budget, json);
+    }
 leave:
     return rv;
 }
@@ -733,6 +1313,7 @@ apr_status_t md_acme_setup(md_acme_t *acme, md_result_t *result)
 {
     apr_status_t rv;
     update_dir_ctx ctx;
+    md_json_t *json;
    
     assert(acme->url);
     acme->version = MD_ACME_VERSION_UNKNOWN;
@@ -749,6 +1330,13 @@ apr_status_t md_acme_setup(md_acme_t *acme, md_result_t *result)
     md_http_set_stalling_default(acme->http, 10, apr_time_from_sec(30));
     md_http_set_ca_file(acme->http, acme->ca_file);
     
+    if ((json = budget_dir_get(acme->budget, acme->p))
+        && APR_SUCCESS == directory_apply(acme, json, result)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, 
+                      "using cached directory of %s", acme->url);
+        return APR_SUCCESS;
+    }
+    
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, "get directory from %s", acme->url);
     
     ctx.acme = acme;
@@ -54,6 +54,7 @@ typedef enum {
 typedef struct md_acme_t md_acme_t;
 
 typedef struct md_acme_req_t md_acme_req_t;
+typedef struct md_acme_budget_t md_acme_budget_t;
 /**
  * Request callback on a successful HTTP response (status 2xx).
  */
@@ -81,6 +82,11 @@ typedef apr_status_t md_acme_req_err_cb(md_acme_req_t *req,
                                         const struct md_result_t *result, void *baton);
 
 
+/**
+ * Request callback when the request is done, successful or not, with its final status.
+ */
+typedef void md_acme_req_done_cb(md_acme_req_t *req, apr_status_t rv, void *baton);
+
 typedef apr_status_t md_acme_new_nonce_fn(md_acme_t *acme);
 typedef apr_status_t md_acme_req_init_fn(md_acme_req_t *req, struct md_json_t *jpayload);
 
@@ -102,6 +108,7 @@ struct md_acme_t {
     const char *acct_id;            /* local storage id account was loaded from or NULL */
     struct md_acme_acct_t *acct;    /* account at ACME server to use for requests */
     struct md_pkey_t *acct_key;     /* private RSA key belonging to account */
+    struct md_jws_ctx_t *jws;       /* signing context for acct_key, see md_acme_jws_get() */
     
     int version;                    /* as detected from the server */
     union {
@@ -129,11 +136,29 @@ struct md_acme_t {
     
     struct md_http_t *http;
     
-    const char *nonce;
+    apr_array_header_t *nonces;     /* unused nonces from responses, newest last */
+    int nonces_used;                /* number of nonces used in requests */
+    int nonces_saved;               /* used ones a single nonce slot would not have had */
+    int nonce_heads;                /* number of HEAD requests made for a nonce */
+    int nonce_fresh;                /* newest nonce came from a response or blocking HEAD */
     int max_retries;
+    int max_parallel;               /* max number of requests in md_acme_multi_perform() */
+    md_acme_budget_t *budget;       /* shared with all instances for this CA, may be NULL */
     struct md_result_t *last;      /* result of last request */
 };
 
+#define MD_ACME_MAX_NONCES      16
+
+/* Let's Encrypt's published limits on new orders and on requests per second.
+ * Only applied to its CA urls, other CAs are trusted to tell us via 429/503. */
+#define MD_ACME_CA_ORDERS_MAX       300
+#define MD_ACME_CA_ORDERS_WINDOW    apr_time_from_sec(3 * 60 * 60)
+#define MD_ACME_CA_REQ_PER_SEC      20
+/* How long to stay away from Let's Encrypt after a 429 or 503 without 'Retry-After' */
+#define MD_ACME_CA_PAUSE_DEF        apr_time_from_sec(60)
+/* How long a fetched CA directory is used before asking again */
+#define MD_ACME_CA_DIR_TTL          apr_time_from_sec(60 * 60)
+
 /**
  * Global init, call once at start up.
  */
@@ -161,6 +186,45 @@ apr_status_t md_acme_setup(md_acme_t *acme, struct md_result_t *result);
 
 void md_acme_report_result(md_acme_t *acme, apr_status_t rv, struct md_result_t *result);
 
+/**************************************************************************************************/
+/* process wide budgets and caches per CA */
+
+/**
+ * Get the budget for the CA at url, shared by everyone in the process
+ * talking to it. All requests are paced by it, a 429 or 503 response
+ * pauses all of them. NULL if md_acme_init() was not called.
+ */
+md_acme_budget_t *md_acme_budget_get(const char *ca_url);
+
+/**
+ * Return the time until which the CA asked us to stay away, 0 if none.
+ */
+apr_time_t md_acme_budget_paused_until(md_acme_budget_t *budget);
+
+/**
+ * Take a new order from the budget. Returns 0 on success or the time when the
+ * next order may be placed.
+ */
+apr_time_t md_acme_budget_take_order(md_acme_budget_t *budget);
+
+/**
+ * Get the id of the account last used successfully at the CA in this process,
+ * allocated from p, or NULL if there is none.
+ */
+const char *md_acme_budget_acct_get(md_acme_budget_t *budget, apr_pool_t *p);
+
+/**
+ * Remember the id of the account to use at the CA. NULL forgets it.
+ */
+void md_acme_budget_acct_set(md_acme_budget_t *budget, const char *id);
+
+/**
+ * Serialize changes to the account index in the store between the threads
+ * of the process. Renewals run in one process only, so this is sufficient.
+ */
+void md_acme_acct_index_lock(void);
+void md_acme_acct_index_unlock(void);
+
 /**************************************************************************************************/
 /* account handling */
 
@@ -183,6 +247,12 @@ apr_status_t md_acme_POST_new_account(md_acme_t *acme,
 const char *md_acme_acct_id_get(md_acme_t *acme);
 const char *md_acme_acct_url_get(md_acme_t *acme);
 
+/**
+ * Get the context to sign requests with the current account key, created 
+ * anew when the account key or url changed. NULL if there is no account key.
+ */
+struct md_jws_ctx_t *md_acme_jws_get(md_acme_t *acme);
+
 /** 
  * Specify the account to use by name in local store. On success, the account
  * the "current" one used by the acme instance.
@@ -247,6 +317,8 @@ struct md_acme_req_t {
     int max_retries;               /* how often this might be retried */
     void *baton;                   /* userdata for callbacks */
     struct md_result_t *result;    /* result of this request */
+    md_acme_req_done_cb *on_done;  /* callback when request is done, optional */
+    void *done_baton;              /* userdata for on_done */
 };
 
 apr_status_t md_acme_req_body_init(md_acme_req_t *req, struct md_json_t *payload);
@@ -278,6 +350,36 @@ apr_status_t md_acme_POST(md_acme_t *acme, const char *url,
                           md_acme_req_err_cb *on_err,
                           void *baton);
 
+/**
+ * Create a request like md_acme_GET()/md_acme_POST() do, but do not perform it.
+ * The request is either handed to md_acme_req_perform() or to a 
+ * md_acme_multi_perform() and is destroyed by it.
+ */
+md_acme_req_t *md_acme_req_make(md_acme_t *acme, const char *method, const char *url,
+                                md_acme_req_init_cb *on_init,
+                                md_acme_req_json_cb *on_json,
+                                md_acme_req_res_cb *on_res,
+                                md_acme_req_err_cb *on_err,
+                                void *baton);
+
+/**
+ * Perform the request and wait for it to be done.
+ */
+apr_status_t md_acme_req_perform(md_acme_req_t *req);
+
+/**
+ * Return the next request to perform on APR_SUCCESS or APR_ENOENT if there
+ * is none (at the moment). Anything else is an error.
+ */
+typedef apr_status_t md_acme_next_req_cb(md_acme_req_t **preq, void *baton, int in_flight);
+
+/**
+ * Perform the requests nextreq gives in parallel, at most acme->max_parallel at
+ * a time. Each request reports its outcome to its on_done callback. Returns
+ * when nextreq has nothing more and all requests are done.
+ */
+apr_status_t md_acme_multi_perform(md_acme_t *acme, md_acme_next_req_cb *nextreq, void *baton);
+
 /**
  * Retrieve a JSON resource from the ACME server 
  */
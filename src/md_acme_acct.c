@@ -29,6 +29,7 @@
 #include "md_crypt.h"
 #include "md_json.h"
 #include "md_jws.h"
+#include "md_keypool.h"
 #include "md_log.h"
 #include "md_store.h"
 #include "md_util.h"
@@ -67,6 +68,70 @@ static const char *mk_acct_pattern(apr_pool_t *p, md_acme_t *acme)
     return apr_psprintf(p, "ACME-%s-*", acme->sname);
 }
  
+/**************************************************************************************************/
+/* account index */
+
+/* The index remembers, per CA url, the account that was last saved as valid,
+ * in the process and in the store. It is only a hint: an account found there
+ * is verified before use, a stale entry is removed. Failing to save it only
+ * means the next lookup scans the store again. */
+
+static const char *acct_index_get(md_store_t *store, const char *ca_url, apr_pool_t *p)
+{
+    md_acme_budget_t *budget = md_acme_budget_get(ca_url);
+    md_json_t *json;
+    const char *id;
+    
+    if ((id = md_acme_budget_acct_get(budget, p))) return id;
+    if (APR_SUCCESS == md_store_load_json(store, MD_SG_ACCOUNTS, MD_ACCT_INDEX_NAME, 
+                                          MD_FN_ACCT_INDEX, &json, p)
+        && (id = md_json_dups(p, json, ca_url, NULL))) {
+        md_acme_budget_acct_set(budget, id);
+    }
+    return id;
+}
+
+static void acct_index_update(md_store_t *store, const char *ca_url, const char *id, 
+                              int valid, apr_pool_t *p)
+{
+    md_acme_budget_t *budget = md_acme_budget_get(ca_url);
+    md_json_t *json;
+    const char *current;
+    apr_status_t rv;
+    
+    if (!ca_url || !id) return;
+    current = md_acme_budget_acct_get(budget, p);
+    if (valid) {
+        md_acme_budget_acct_set(budget, id);
+    }
+    else if (current && !strcmp(id, current)) {
+        md_acme_budget_acct_set(budget, NULL);
+    }
+    
+    md_acme_acct_index_lock();
+    if (APR_SUCCESS != md_store_load_json(store, MD_SG_ACCOUNTS, MD_ACCT_INDEX_NAME, 
+                                          MD_FN_ACCT_INDEX, &json, p)) {
+        json = md_json_create(p);
+    }
+    current = md_json_gets(json, ca_url, NULL);
+    if (valid) {
+        if (current && !strcmp(id, current)) goto leave;
+        md_json_sets(id, json, ca_url, NULL);
+    }
+    else {
+        if (!current || strcmp(id, current)) goto leave;
+        md_json_del(json, ca_url, NULL);
+    }
+    rv = md_store_save_json(store, p, MD_SG_ACCOUNTS, MD_ACCT_INDEX_NAME, 
+                            MD_FN_ACCT_INDEX, json, 0);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "saving account index for %s", ca_url);
+    }
+leave:
+    md_acme_acct_index_unlock();
+}
+
 /**************************************************************************************************/
 /* json load/save */
 
@@ -190,6 +255,9 @@ apr_status_t md_acme_acct_save(md_store_t *store, apr_pool_t *p, md_acme_t *acme
         if (pid) *pid = id;
         rv = md_store_save(store, p, MD_SG_ACCOUNTS, id, MD_FN_ACCT_KEY, MD_SV_PKEY, acct_key, 0);
     }
+    if (APR_SUCCESS == rv) {
+        acct_index_update(store, acct->ca_url, id, MD_ACME_ACCT_ST_VALID == acct->status, p);
+    }
     return rv;
 }
 
@@ -320,17 +388,59 @@ static apr_status_t acct_find_and_verify(md_store_t *store, md_store_group_t gro
     return rv;
 }
 
+static apr_status_t acct_find_indexed(md_store_t *store, md_acme_t *acme)
+{
+    md_acme_acct_t *acct;
+    md_pkey_t *pkey;
+    const char *id;
+    apr_status_t rv;
+    
+    if (!(id = acct_index_get(store, acme->url, acme->p))) return APR_ENOENT;
+    
+    rv = md_acme_acct_load(&acct, &pkey, store, MD_SG_ACCOUNTS, id, acme->p);
+    if (APR_SUCCESS == rv 
+        && (MD_ACME_ACCT_ST_VALID != acct->status || strcmp(acme->url, acct->ca_url))) {
+        rv = APR_ENOENT;
+    }
+    if (APR_SUCCESS == rv) {
+        acme->acct_id = id;
+        acme->acct = acct;
+        acme->acct_key = pkey;
+        if (APR_SUCCESS != (rv = md_acme_acct_validate(acme, NULL, acme->p))) {
+            acme->acct_id = NULL;
+            acme->acct = NULL;
+            acme->acct_key = NULL;
+        }
+    }
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, 
+                      "indexed account %s not usable for %s", id, acme->url);
+        acct_index_update(store, acme->url, id, 0, acme->p);
+    }
+    else {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, acme->p, 
+                      "indexed account %s for %s", id, acme->url);
+    }
+    return rv;
+}
+
 apr_status_t md_acme_find_acct(md_acme_t *acme, md_store_t *store)
 {
     apr_status_t rv;
     
+    /* The index spares us scanning and verifying all accounts in the store */
+    rv = acct_find_indexed(store, acme);
+    if (!APR_STATUS_IS_ENOENT(rv)) return rv;
+    
     while (APR_EAGAIN == (rv = acct_find_and_verify(store, MD_SG_ACCOUNTS, 
                                                     mk_acct_pattern(acme->p, acme), 
                                                     acme, acme->p))) {
         /* nop */
     }
-    
-    if (APR_STATUS_IS_ENOENT(rv)) {
+    if (APR_SUCCESS == rv) {
+        acct_index_update(store, acme->url, acme->acct_id, 1, acme->p);
+    }
+    else if (APR_STATUS_IS_ENOENT(rv)) {
         /* No suitable account found in MD_SG_ACCOUNTS. Maybe a new account
          * can already be found in MD_SG_STAGING? */
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, 
@@ -560,12 +670,13 @@ apr_status_t md_acme_acct_register(md_acme_t *acme, md_store_t *store, apr_pool_
         }
     }
     
-    /* If we still have no key, generate a new one */
+    /* If we still have no key, get a new one. The pool only has keys of
+     * the types the MDs use, we do not keep any just for accounts. */
     if (!acme->acct_key) {
         spec.type = MD_PKEY_TYPE_RSA;
         spec.params.rsa.bits = MD_ACME_ACCT_PKEY_BITS;
         
-        if (APR_SUCCESS != (rv = md_pkey_gen(&pkey, acme->p, &spec))) goto out;
+        if (APR_SUCCESS != (rv = md_keypool_take(&pkey, store, &spec, acme->p))) goto out;
         acme->acct_key = pkey;
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "created new account key");
     }
@@ -49,6 +49,10 @@ struct md_acme_acct_t {
 
 #define MD_FN_ACCOUNT           "account.json"
 #define MD_FN_ACCT_KEY          "account.pem"
+/* Maps CA urls to the id of the account to use. Kept in MD_SG_ACCOUNTS under
+ * a name no account id has, so it is readable by whoever uses the accounts. */
+#define MD_ACCT_INDEX_NAME      "index"
+#define MD_FN_ACCT_INDEX        "accounts.json"
 
 /* ACME account private keys are always RSA and have that many bits. Since accounts
  * are expected to live long, better err on the safe side. */
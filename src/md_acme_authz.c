@@ -28,6 +28,8 @@
 
 #include "md.h"
 #include "md_crypt.h"
+#include "md_helper.h"
+#include "md_http01.h"
 #include "md_json.h"
 #include "md_http.h"
 #include "md_log.h"
@@ -93,6 +95,28 @@ apr_status_t md_acme_authz_retrieve(md_acme_t *acme, apr_pool_t *p, const char *
     return rv;
 }
 
+static apr_status_t on_init_authz_resp(md_acme_req_t *req, void *baton)
+{
+    md_json_t *jpayload;
+
+    (void)baton;
+    jpayload = md_json_create(req->p);
+    return md_acme_req_body_init(req, jpayload);
+} 
+
+static apr_status_t authz_http_set(md_acme_t *acme, apr_pool_t *p, const apr_table_t *hdrs, 
+                                   md_json_t *body, void *baton)
+{
+    authz_req_ctx *ctx = baton;
+    
+    (void)acme;
+    (void)p;
+    (void)hdrs;
+    (void)body;
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, ctx->p, "updated authz %s", ctx->authz->url);
+    return APR_SUCCESS;
+}
+
 typedef struct {
     apr_pool_t *p;
     md_acme_authz_t *authz;
@@ -111,29 +135,17 @@ static int copy_challenge_error(void *baton, size_t index, md_json_t *json)
     return 1;
 }
 
-apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_pool_t *p)
+static apr_status_t authz_update(md_acme_authz_t *authz, md_json_t *json, apr_pool_t *p)
 {
-    md_json_t *json;
     const char *s, *err;
     md_log_level_t log_level;
-    apr_status_t rv;
+    apr_status_t rv = APR_SUCCESS;
     error_ctx_t ctx;
     
-    assert(acme);
-    assert(acme->http);
-    assert(authz);
-    assert(authz->url);
-
-    authz->state = MD_ACME_AUTHZ_S_UNKNOWN;
-    json = NULL;
-    authz->error_type = authz->error_detail = NULL;
-    authz->error_subproblems = NULL;
     err = "unable to parse response";
     log_level = MD_LOG_ERR;
     
-    if (APR_SUCCESS == (rv = md_acme_get_json(&json, acme, authz->url, p))
-        && (s = md_json_gets(json, MD_KEY_STATUS, NULL))) {
-            
+    if ((s = md_json_gets(json, MD_KEY_STATUS, NULL))) {
         authz->domain = md_json_gets(json, MD_KEY_IDENTIFIER, MD_KEY_VALUE, NULL); 
         authz->resource = json;
         if (!strcmp(s, "pending")) {
@@ -155,7 +167,7 @@ apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_p
         }
     }
 
-    if (json && authz->state == MD_ACME_AUTHZ_S_UNKNOWN) {
+    if (authz->state == MD_ACME_AUTHZ_S_UNKNOWN) {
         err = "unable to understand response";
         rv = APR_EINVAL;
     }
@@ -163,12 +175,72 @@ apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_p
     if (md_log_is_level(p, log_level)) {
         md_log_perror(MD_LOG_MARK, log_level, rv, p, "ACME server authz: %s for %s at %s. "
                       "Exact response was: %s", err, authz->domain, authz->url,
-                      json? md_json_writep(json, p, MD_JSON_FMT_COMPACT) : "not available");
+                      md_json_writep(json, p, MD_JSON_FMT_COMPACT));
     }
+    return rv;
+}
+
+typedef struct {
+    apr_pool_t *p;
+    md_acme_authz_t *authz;
+} update_ctx_t;
+
+static apr_status_t on_authz_json(md_acme_t *acme, apr_pool_t *p, const apr_table_t *hdrs, 
+                                  md_json_t *body, void *baton)
+{
+    update_ctx_t *ctx = baton;
+    
+    (void)acme;
+    (void)p;
+    ctx->authz->retry_after = md_util_parse_retry_after(apr_table_get(hdrs, "retry-after"),
+                                                        apr_time_now());
+    return authz_update(ctx->authz, md_json_clone(ctx->p, body), ctx->p);
+}
+
+md_acme_req_t *md_acme_authz_update_req(md_acme_authz_t *authz, md_acme_t *acme, apr_pool_t *p)
+{
+    update_ctx_t *ctx;
+    
+    assert(acme);
+    assert(acme->http);
+    assert(authz);
+    assert(authz->url);
+
+    authz->state = MD_ACME_AUTHZ_S_UNKNOWN;
+    authz->error_type = authz->error_detail = NULL;
+    authz->error_subproblems = NULL;
+    authz->resource = NULL;
+    authz->retry_after = 0;
     
+    ctx = apr_pcalloc(p, sizeof(*ctx));
+    ctx->p = p;
+    ctx->authz = authz;
+    return md_acme_req_make(acme, "GET", authz->url, NULL, on_authz_json, NULL, NULL, ctx);
+}
+
+apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_pool_t *p)
+{
+    apr_status_t rv;
+    
+    rv = md_acme_req_perform(md_acme_authz_update_req(authz, acme, p));
+    if (APR_SUCCESS != rv && !authz->resource) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "ACME server authz: unable to "
+                      "retrieve %s. Exact response was: not available", authz->url);
+    }
     return rv;
 }
 
+md_acme_req_t *md_acme_authz_notify_req(md_acme_authz_t *authz, md_acme_t *acme, apr_pool_t *p)
+{
+    authz_req_ctx *ctx;
+    
+    if (!authz->notify_url) return NULL;
+    ctx = apr_pcalloc(p, sizeof(*ctx));
+    authz_req_ctx_init(ctx, acme, NULL, authz, p);
+    return md_acme_req_make(acme, "POST", authz->notify_url, on_init_authz_resp, 
+                            authz_http_set, NULL, NULL, ctx);
+}
+
 /**************************************************************************************************/
 /* response to a challenge */
 
@@ -191,40 +263,21 @@ static md_acme_authz_cha_t *cha_from_json(apr_pool_t *p, size_t index, md_json_t
     return cha;
 }
 
-static apr_status_t on_init_authz_resp(md_acme_req_t *req, void *baton)
-{
-    md_json_t *jpayload;
-
-    (void)baton;
-    jpayload = md_json_create(req->p);
-    return md_acme_req_body_init(req, jpayload);
-} 
-
-static apr_status_t authz_http_set(md_acme_t *acme, apr_pool_t *p, const apr_table_t *hdrs, 
-                                   md_json_t *body, void *baton)
-{
-    authz_req_ctx *ctx = baton;
-    
-    (void)acme;
-    (void)p;
-    (void)hdrs;
-    (void)body;
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, ctx->p, "updated authz %s", ctx->authz->url);
-    return APR_SUCCESS;
-}
-
 static apr_status_t setup_key_authz(md_acme_authz_cha_t *cha, md_acme_authz_t *authz,
                                     md_acme_t *acme, apr_pool_t *p, int *pchanged)
 {
     const char *thumb64, *key_authz;
-    apr_status_t rv;
+    md_jws_ctx_t *jws;
+    apr_status_t rv = APR_EINVAL;
     
     (void)authz;
     assert(cha);
     assert(cha->token);
     
     *pchanged = 0;
-    if (APR_SUCCESS == (rv = md_jws_pkey_thumb(&thumb64, p, acme->acct_key))) {
+    if ((jws = md_acme_jws_get(acme))) {
+        rv = APR_SUCCESS;
+        thumb64 = md_jws_ctx_thumb(jws);
         key_authz = apr_psprintf(p, "%s.%s", cha->token, thumb64);
         if (cha->key_authz) {
             if (strcmp(key_authz, cha->key_authz)) {
@@ -247,7 +300,8 @@ static apr_array_header_t *dns_cmd_env(apr_pool_t *p, md_store_t *store, const c
     env = apr_array_make(p, 5, sizeof(char*));
     if (APR_SUCCESS == store->get_fname( &s, store, MD_SG_NONE, NULL, NULL, p))
         APR_ARRAY_PUSH(env, const char*) = apr_psprintf(p, "MD_STORE=%s", s);
-    APR_ARRAY_PUSH(env, const char*) = apr_psprintf(p, "MD_MDOMAIN=%s", mdomain);
+    if (mdomain)
+        APR_ARRAY_PUSH(env, const char*) = apr_psprintf(p, "MD_MDOMAIN=%s", mdomain);
     APR_ARRAY_PUSH(env, const char*) = apr_psprintf(p, "MD_VERSION=%s", MOD_MD_VERSION);
     return env;
 }
@@ -256,7 +310,7 @@ static apr_status_t cha_http_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t
                                       md_acme_t *acme, md_store_t *store, 
                                       md_pkeys_spec_t *key_specs,
                                       apr_array_header_t *acme_tls_1_domains, const char *mdomain,
-                                      apr_table_t *env, apr_pool_t *p)
+                                      apr_table_t *env, apr_pool_t *p, int *pnotify)
 {
     const char *data;
     apr_status_t rv;
@@ -279,16 +333,13 @@ static apr_status_t cha_http_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t
                            MD_SV_TEXT, (void*)content, 0);
         notify_server = 1;
     }
-    
-    if (APR_SUCCESS == rv && notify_server) {
-        authz_req_ctx ctx;
-
-        /* challenge is setup or was changed from previous data, tell ACME server
-         * so it may (re)try verification */        
-        authz_req_ctx_init(&ctx, acme, NULL, authz, p);
-        ctx.challenge = cha;
-        rv = md_acme_POST(acme, cha->uri, on_init_authz_resp, authz_http_set, NULL, NULL, &ctx);
+    if (APR_SUCCESS == rv) {
+        md_http01_publish(authz->domain, cha->token, apr_psprintf(p, "%s\n", cha->key_authz));
     }
+    
+    /* challenge is setup or was changed from previous data, tell ACME server
+     * so it may (re)try verification */        
+    *pnotify = (APR_SUCCESS == rv && notify_server);
 out:
     return rv;
 }
@@ -303,7 +354,7 @@ static apr_status_t cha_tls_alpn_01_setup(md_acme_authz_cha_t *cha, md_acme_auth
                                           md_acme_t *acme, md_store_t *store, 
                                           md_pkeys_spec_t *key_specs,
                                           apr_array_header_t *acme_tls_1_domains, const char *mdomain,
-                                          apr_table_t *env, apr_pool_t *p)
+                                          apr_table_t *env, apr_pool_t *p, int *pnotify)
 {
     const char *acme_id, *token;
     apr_status_t rv;
@@ -369,6 +420,7 @@ static apr_status_t cha_tls_alpn_01_setup(md_acme_authz_cha_t *cha, md_acme_auth
                 goto out;
             }
         
+            /* key first: servers take a changed cert file as a changed pair */
             if (APR_SUCCESS == (rv = md_store_save(store, p, MD_SG_CHALLENGES, authz->domain, kfn,
                                                    MD_SV_PKEY, (void*)cha_key, 0))) {
                 rv = md_store_save(store, p, MD_SG_CHALLENGES, authz->domain, cfn,
@@ -378,16 +430,63 @@ static apr_status_t cha_tls_alpn_01_setup(md_acme_authz_cha_t *cha, md_acme_auth
         }
     }
     
-    if (APR_SUCCESS == rv && notify_server) {
-        authz_req_ctx ctx;
+    /* challenge is setup or was changed from previous data, tell ACME server
+     * so it may (re)try verification */        
+    *pnotify = (APR_SUCCESS == rv && notify_server);
+out:    
+    return rv;
+}
+
+static int dns01_available(apr_table_t *env)
+{
+    return apr_table_get(env, MD_KEY_CMD_DNS01_HELPER) || apr_table_get(env, MD_KEY_CMD_DNS01);
+}
 
-        /* challenge is setup or was changed from previous data, tell ACME server
-         * so it may (re)try verification */        
-        authz_req_ctx_init(&ctx, acme, NULL, authz, p);
-        ctx.challenge = cha;
-        rv = md_acme_POST(acme, cha->uri, on_init_authz_resp, authz_http_set, NULL, NULL, &ctx);
+static apr_status_t dns01_run(md_store_t *store, const char *mdomain, apr_table_t *env,
+                              apr_array_header_t *args, apr_pool_t *p)
+{
+    const char * const *argv;
+    const char *cmdline, *dns01_cmd, *response;
+    apr_status_t rv;
+    int i, exit_code = 0;
+    
+    if ((dns01_cmd = apr_table_get(env, MD_KEY_CMD_DNS01_HELPER))) {
+        /* the helper lives on, so the managed domain is part of each request */
+        cmdline = apr_psprintf(p, "%s %s", APR_ARRAY_IDX(args, 0, const char*), mdomain);
+        for (i = 1; i < args->nelts; ++i) {
+            cmdline = apr_pstrcat(p, cmdline, " ", APR_ARRAY_IDX(args, i, const char*), NULL);
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: dns-01 helper request: %s", 
+                      mdomain, cmdline);
+        rv = md_helper_call(&response, dns01_cmd, dns_cmd_env(p, store, NULL), cmdline, p);
+        if (APR_SUCCESS != rv) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "%s: dns-01 helper %s failed: %s",
+                          mdomain, APR_ARRAY_IDX(args, 0, const char*), 
+                          response? response : "no answer");
+        }
+        goto out;
     }
-out:    
+    
+    dns01_cmd = apr_table_get(env, MD_KEY_CMD_DNS01);
+    if (!dns01_cmd) {
+        rv = APR_ENOTIMPL;
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: dns-01 command not set", mdomain);
+        goto out;
+    }
+    
+    cmdline = apr_psprintf(p, "%s %s", dns01_cmd, apr_array_pstrcat(p, args, ' ')); 
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: dns-01 command: %s", mdomain, cmdline);
+    apr_tokenize_to_argv(cmdline, (char***)&argv, p);
+    rv = md_util_exec(p, argv[0], argv, dns_cmd_env(p, store, mdomain), &exit_code);
+    if (APR_SUCCESS == rv && exit_code) {
+        rv = APR_EGENERAL;
+    }
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "%s: dns-01 %s command failed (exit code=%d)",
+                      mdomain, APR_ARRAY_IDX(args, 0, const char*), exit_code);
+    }
+out:
     return rv;
 }
 
@@ -395,22 +494,18 @@ static apr_status_t cha_dns_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *
                                      md_acme_t *acme, md_store_t *store, 
                                      md_pkeys_spec_t *key_specs,
                                      apr_array_header_t *acme_tls_1_domains, const char *mdomain,
-                                     apr_table_t *env, apr_pool_t *p)
+                                     apr_table_t *env, apr_pool_t *p, int *pnotify)
 {
     const char *token;
-    const char * const *argv;
-    const char *cmdline, *dns01_cmd;
+    apr_array_header_t *args;
     apr_status_t rv;
-    int exit_code, notify_server;
-    authz_req_ctx ctx;
+    int notify_server;
     md_data_t data;
 
-    (void)store;
     (void)key_specs;
     (void)acme_tls_1_domains;
     
-    dns01_cmd = apr_table_get(env, MD_KEY_CMD_DNS01);
-    if (!dns01_cmd) {
+    if (!dns01_available(env)) {
         rv = APR_ENOTIMPL;
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: dns-01 command not set", 
                       authz->domain);
@@ -429,28 +524,24 @@ static apr_status_t cha_dns_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *
         goto out;
     }
 
-    cmdline = apr_psprintf(p, "%s setup %s %s", dns01_cmd, authz->domain, token); 
-    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
-                  "%s: dns-01 setup command: %s", authz->domain, cmdline);
-
-    apr_tokenize_to_argv(cmdline, (char***)&argv, p);
-    if (APR_SUCCESS != (rv = md_util_exec(p, argv[0], argv, dns_cmd_env(p,store,mdomain), &exit_code))) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
-                      "%s: dns-01 setup command failed to execute", authz->domain);
+    if (apr_table_get(env, MD_KEY_CMD_DNS01_BATCH)) {
+        /* set up later for all domains at once, see md_acme_authz_dns01_batch_setup() */
+        authz->dns01_txt = token;
+        *pnotify = 1;
         goto out;
     }
-    if (exit_code) {
-        rv = APR_EGENERAL;
-        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, 
-                      "%s: dns-01 setup command returns %d", authz->domain, exit_code);
+    
+    args = apr_array_make(p, 3, sizeof(const char*));
+    APR_ARRAY_PUSH(args, const char*) = "setup";
+    APR_ARRAY_PUSH(args, const char*) = authz->domain;
+    APR_ARRAY_PUSH(args, const char*) = token;
+    if (APR_SUCCESS != (rv = dns01_run(store, mdomain, env, args, p))) {
         goto out;
     }
     
     /* challenge is setup, tell ACME server so it may (re)try verification */        
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: dns-01 setup succeeded", authz->domain);
-    authz_req_ctx_init(&ctx, acme, NULL, authz, p);
-    ctx.challenge = cha;
-    rv = md_acme_POST(acme, cha->uri, on_init_authz_resp, authz_http_set, NULL, NULL, &ctx);
+    *pnotify = 1;
     
 out:    
     return rv;
@@ -459,28 +550,43 @@ out:
 static apr_status_t cha_dns_01_teardown(md_store_t *store, const char *domain, const char *mdomain,
                                         apr_table_t *env, apr_pool_t *p)
 {
-    const char * const *argv;
-    const char *cmdline, *dns01_cmd;
-    apr_status_t rv;
-    int exit_code;
-    
-    (void)store;
+    apr_array_header_t *args;
     
-    dns01_cmd = apr_table_get(env, MD_KEY_CMD_DNS01);
-    if (!dns01_cmd) {
-        rv = APR_ENOTIMPL;
+    if (!dns01_available(env)) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: dns-01 command not set", domain);
-        goto out;
+        return APR_ENOTIMPL;
+    }
+    args = apr_array_make(p, 2, sizeof(const char*));
+    APR_ARRAY_PUSH(args, const char*) = "teardown";
+    APR_ARRAY_PUSH(args, const char*) = domain;
+    return dns01_run(store, mdomain, env, args, p);
+}
+
+apr_status_t md_acme_authz_dns01_batch_setup(apr_array_header_t *authzs, 
+                                             md_store_t *store, const char *mdomain, 
+                                             apr_table_t *env, apr_pool_t *p)
+{
+    md_acme_authz_t *authz;
+    apr_array_header_t *args;
+    apr_status_t rv;
+    int i;
+    
+    args = apr_array_make(p, authzs->nelts * 2 + 1, sizeof(const char*));
+    APR_ARRAY_PUSH(args, const char*) = "setup-batch";
+    for (i = 0; i < authzs->nelts; ++i) {
+        authz = APR_ARRAY_IDX(authzs, i, md_acme_authz_t*);
+        if (!authz->dns01_txt) continue;
+        APR_ARRAY_PUSH(args, const char*) = authz->domain;
+        APR_ARRAY_PUSH(args, const char*) = authz->dns01_txt;
     }
+    if (args->nelts == 1) return APR_SUCCESS;
     
-    cmdline = apr_psprintf(p, "%s teardown %s", dns01_cmd, domain); 
-    apr_tokenize_to_argv(cmdline, (char***)&argv, p);
-    if (APR_SUCCESS != (rv = md_util_exec(p, argv[0], argv, dns_cmd_env(p,store,mdomain), &exit_code)) || exit_code) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
-                      "%s: dns-01 teardown command failed (exit code=%d)",
-                      domain, exit_code);
+    /* The command returns when all records are visible, we wait for
+     * propagation only once. */
+    if (APR_SUCCESS == (rv = dns01_run(store, mdomain, env, args, p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: dns-01 batch setup of %d "
+                      "records succeeded", mdomain, (args->nelts - 1) / 2);
     }
-out:    
     return rv;
 }
 
@@ -492,11 +598,18 @@ static apr_status_t cha_teardown_dir(md_store_t *store, const char *domain, cons
     return md_store_purge(store, p, MD_SG_CHALLENGES, domain);
 }
 
+static apr_status_t cha_http_01_teardown(md_store_t *store, const char *domain, 
+                                         const char *mdomain, apr_table_t *env, apr_pool_t *p)
+{
+    md_http01_withdraw(domain);
+    return cha_teardown_dir(store, domain, mdomain, env, p);
+}
+
 typedef apr_status_t cha_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *authz, 
                                md_acme_t *acme, md_store_t *store, 
                                md_pkeys_spec_t *key_specs,
                                apr_array_header_t *acme_tls_1_domains, const char *mdomain,
-                               apr_table_t *env, apr_pool_t *p);
+                               apr_table_t *env, apr_pool_t *p, int *pnotify);
                                
 typedef apr_status_t cha_teardown(md_store_t *store, const char *domain, const char *mdomain,
                                   apr_table_t *env, apr_pool_t *p);
@@ -508,7 +621,7 @@ typedef struct {
 } cha_type;
 
 static const cha_type CHA_TYPES[] = {
-    { MD_AUTHZ_TYPE_HTTP01,     cha_http_01_setup,      cha_teardown_dir },
+    { MD_AUTHZ_TYPE_HTTP01,     cha_http_01_setup,      cha_http_01_teardown },
     { MD_AUTHZ_TYPE_TLSALPN01,  cha_tls_alpn_01_setup,  cha_teardown_dir },
     { MD_AUTHZ_TYPE_DNS01,      cha_dns_01_setup,       cha_dns_01_teardown },
 };
@@ -552,7 +665,7 @@ apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, md_acme_t *acme, md_s
                                    md_result_t *result)
 {
     apr_status_t rv;
-    int i;
+    int i, notify;
     cha_find_ctx fctx;
     const char *challenge_setup;
     
@@ -562,6 +675,7 @@ apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, md_acme_t *acme, md_s
 
     fctx.p = p;
     fctx.accepted = NULL;
+    authz->notify_url = NULL;
     
     /* Look in the order challenge types are defined:
      * - if they are offered by the CA, try to set it up
@@ -584,9 +698,11 @@ apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, md_acme_t *acme, md_s
                 if (!apr_strnatcasecmp(CHA_TYPES[i].name, fctx.accepted->type)) {
                     md_result_activity_printf(result, "Setting up challenge '%s' for domain %s", 
                                               fctx.accepted->type, authz->domain);
+                    notify = 0;
                     rv = CHA_TYPES[i].setup(fctx.accepted, authz, acme, store, key_specs,
-                                            acme_tls_1_domains, mdomain, env, p);
+                                            acme_tls_1_domains, mdomain, env, p, &notify);
                     if (APR_SUCCESS == rv) {
+                        authz->notify_url = notify? fctx.accepted->uri : NULL;
                         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
                                       "%s: set up challenge '%s' for %s", 
                                       authz->domain, fctx.accepted->type, mdomain);
@@ -629,6 +745,60 @@ out:
     return rv;
 }
 
+static int find_processing(void *baton, size_t index, md_json_t *json)
+{
+    int *pprocessing = baton;
+    const char *s;
+    
+    (void)index;
+    s = md_json_gets(json, MD_KEY_STATUS, NULL);
+    if (s && !strcmp("processing", s)) {
+        *pprocessing = 1;
+        return 0;
+    }
+    return 1;
+}
+
+int md_acme_authz_is_processing(const md_acme_authz_t *authz)
+{
+    int processing = 0;
+    
+    if (MD_ACME_AUTHZ_S_PENDING == authz->state && authz->resource) {
+        md_json_itera(find_processing, &processing, authz->resource, MD_KEY_CHALLENGES, NULL);
+    }
+    return processing;
+}
+
+apr_status_t md_acme_authz_teardown_all(md_store_t *store, apr_array_header_t *setup_tokens, 
+                                        const char *mdomain, apr_table_t *env, apr_pool_t *p)
+{
+    apr_array_header_t *args;
+    const char *token, *prefix, *domain;
+    apr_size_t plen;
+    int i, batch;
+    
+    batch = (apr_table_get(env, MD_KEY_CMD_DNS01_BATCH) != NULL);
+    prefix = MD_AUTHZ_TYPE_DNS01 ":";
+    plen = strlen(prefix);
+    args = apr_array_make(p, setup_tokens->nelts + 1, sizeof(const char*));
+    APR_ARRAY_PUSH(args, const char*) = "teardown-batch";
+    
+    for (i = 0; i < setup_tokens->nelts; ++i) {
+        token = APR_ARRAY_IDX(setup_tokens, i, const char*);
+        if (!token) continue;
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "order teardown setup %s", token);
+        if (batch && !strncmp(prefix, token, plen)) {
+            domain = token + plen;
+            if (md_array_str_index(args, domain, 1, 0) < 0) {
+                APR_ARRAY_PUSH(args, const char*) = domain;
+            }
+            continue;
+        }
+        md_acme_authz_teardown(store, token, mdomain, env, p);
+    }
+    return (args->nelts > 1)? dns01_run(store, mdomain, env, args, p) : APR_SUCCESS;
+}
+
 apr_status_t md_acme_authz_teardown(struct md_store_t *store, const char *token,
                                     const char *mdomain, apr_table_t *env, apr_pool_t *p)
 {
@@ -20,6 +20,7 @@
 struct apr_array_header_t;
 struct apr_table_t;
 struct md_acme_t;
+struct md_acme_req_t;
 struct md_acme_acct_t;
 struct md_json_t;
 struct md_store_t;
@@ -53,6 +54,9 @@ struct md_acme_authz_t {
     const char *error_detail;
     const struct md_json_t *error_subproblems;
     struct md_json_t *resource;
+    const char *notify_url;         /* challenge to POST to after respond, or NULL */
+    apr_time_t retry_after;         /* from the last update, 0 if not given */
+    const char *dns01_txt;          /* dns-01 record awaiting the batch setup, or NULL */
 };
 
 #define MD_FN_HTTP01            "acme-http-01.txt"
@@ -65,6 +69,20 @@ apr_status_t md_acme_authz_retrieve(md_acme_t *acme, apr_pool_t *p, const char *
                                     md_acme_authz_t **pauthz);
 apr_status_t md_acme_authz_update(md_acme_authz_t *authz, struct md_acme_t *acme, apr_pool_t *p);
 
+/**
+ * Make the request md_acme_authz_update() performs, for use in md_acme_multi_perform().
+ */
+struct md_acme_req_t *md_acme_authz_update_req(md_acme_authz_t *authz, 
+                                               struct md_acme_t *acme, apr_pool_t *p);
+
+/**
+ * Make the request that tells the ACME server the challenge set up by 
+ * md_acme_authz_respond() is ready for verification. NULL if the server
+ * does not need to be told again.
+ */
+struct md_acme_req_t *md_acme_authz_notify_req(md_acme_authz_t *authz, 
+                                               struct md_acme_t *acme, apr_pool_t *p);
+
 apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, struct md_acme_t *acme, 
                                    struct md_store_t *store, apr_array_header_t *challenges, 
                                    struct md_pkeys_spec_t *key_spec,
@@ -73,7 +91,32 @@ apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, struct md_acme_t *acm
                                    apr_pool_t *p, const char **setup_token,
                                    struct md_result_t *result);
 
+/**
+ * Return != 0 if a challenge of the pending authz is being validated by
+ * the CA, e.g. after we responded in an earlier run. Responding again is
+ * then not necessary.
+ */
+int md_acme_authz_is_processing(const md_acme_authz_t *authz);
+
 apr_status_t md_acme_authz_teardown(struct md_store_t *store, const char *setup_token, 
                                     const char *mdomain, struct apr_table_t *env, apr_pool_t *p);
 
+/**
+ * In dns-01 batch mode, md_acme_authz_respond() only prepares the dns-01 records.
+ * Invoke the command once to set up all of them for the md_acme_authz_t* in authzs.
+ * Does nothing if none was prepared.
+ */
+apr_status_t md_acme_authz_dns01_batch_setup(apr_array_header_t *authzs, 
+                                             struct md_store_t *store, const char *mdomain, 
+                                             struct apr_table_t *env, apr_pool_t *p);
+
+/**
+ * Tear down all challenges for the setup tokens. In dns-01 batch mode, the
+ * command is invoked once for all dns-01 domains.
+ */
+apr_status_t md_acme_authz_teardown_all(struct md_store_t *store, 
+                                        apr_array_header_t *setup_tokens, 
+                                        const char *mdomain, struct apr_table_t *env, 
+                                        apr_pool_t *p);
+
 #endif /* md_acme_authz_h */
@@ -27,6 +27,7 @@
 #include "md_crypt.h"
 #include "md_json.h"
 #include "md_jws.h"
+#include "md_keypool.h"
 #include "md_http.h"
 #include "md_log.h"
 #include "md_result.h"
@@ -351,7 +352,7 @@ apr_status_t md_acme_drive_setup_cred_chain(md_proto_driver_t *d, md_result_t *r
         
     rv = md_pkey_load(d->store, MD_SG_STAGING, d->md->name, spec, &privkey, d->p);
     if (APR_STATUS_IS_ENOENT(rv)) {
-        if (APR_SUCCESS == (rv = md_pkey_gen(&privkey, d->p, spec))) {
+        if (APR_SUCCESS == (rv = md_keypool_take(&privkey, d->store, spec, d->p))) {
             rv = md_pkey_save(d->store, d->p, MD_SG_STAGING, d->md->name, spec, privkey, 1);
         }
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, 
@@ -534,6 +535,12 @@ static apr_status_t acme_driver_init(md_proto_driver_t *d, md_result_t *result)
     /* We can only support challenges if the server is reachable from the outside
      * via port 80 and/or 443. These ports might be mapped for httpd to something
      * else, but a mapping needs to exist. */
+    if (apr_table_get(d->env, MD_KEY_RENEW_NOWAIT)) {
+        /* check once and yield instead of sleeping, the scheduler wakes us again */
+        ad->authz_monitor_timeout = 0;
+        ad->cert_poll_timeout = 0;
+    }
+    
     challenge = apr_table_get(d->env, MD_KEY_CHALLENGE); 
     if (challenge) {
         APR_ARRAY_PUSH(ad->ca_challenges, const char*) = apr_pstrdup(d->p, challenge);
@@ -573,7 +580,9 @@ static apr_status_t acme_driver_init(md_proto_driver_t *d, md_result_t *result)
             ad->ca_challenges = md_array_str_remove(d->p, ad->ca_challenges, MD_AUTHZ_TYPE_TLSALPN01, 0);
             dis_alpn_acme = 1;
         }
-        if (!apr_table_get(d->env, MD_KEY_CMD_DNS01) && md_array_str_index(ad->ca_challenges, MD_AUTHZ_TYPE_DNS01, 0, 1) >= 0) {
+        if (!apr_table_get(d->env, MD_KEY_CMD_DNS01) 
+            && !apr_table_get(d->env, MD_KEY_CMD_DNS01_HELPER)
+            && md_array_str_index(ad->ca_challenges, MD_AUTHZ_TYPE_DNS01, 0, 1) >= 0) {
             ad->ca_challenges = md_array_str_remove(d->p, ad->ca_challenges, MD_AUTHZ_TYPE_DNS01, 0);
             dis_dns = 1;
         }
@@ -638,6 +647,7 @@ static apr_status_t acme_renew(md_proto_driver_t *d, md_result_t *result)
     apr_time_t now, t, t2;
     md_credentials_t *cred;
     char ts[APR_RFC822_DATE_LEN];
+    const char *s;
     int i, first = 0;
     
     if (md_log_is_level(d->p, MD_LOG_DEBUG)) {
@@ -699,6 +709,9 @@ static apr_status_t acme_renew(md_proto_driver_t *d, md_result_t *result)
         md_result_log(result, MD_LOG_ERR);
         goto out;
     } 
+    if ((s = apr_table_get(d->env, MD_KEY_REQUEST_PARALLELISM))) {
+        ad->acme->max_parallel = (int)apr_atoi64(s);
+    }
     if (APR_SUCCESS != (rv = md_acme_setup(ad->acme, result))) {
         md_result_log(result, MD_LOG_ERR);
         goto out;
@@ -843,6 +856,12 @@ ready:
     }
 
 out:
+    if (ad->acme) {
+        /* every run, also those that yield or fail, shows what the nonce pool did */
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, d->p, "%s: ACME nonces used: %d, "
+                      "without blocking HEAD: %d, HEAD requests: %d", d->md->name, 
+                      ad->acme->nonces_used, ad->acme->nonces_saved, ad->acme->nonce_heads);
+    }
     return rv;
 }
 
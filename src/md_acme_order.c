@@ -57,6 +57,7 @@ md_acme_order_t *md_acme_order_create(apr_pool_t *p)
 /* order conversion */
 
 #define MD_KEY_CHALLENGE_SETUPS   "challenge-setups"
+#define MD_KEY_CREATED            "created"
 
 static md_acme_order_st order_st_from_str(const char *s) 
 {
@@ -114,6 +115,9 @@ md_json_t *md_acme_order_to_json(md_acme_order_t *order, apr_pool_t *p)
     if (order->certificate) {
         md_json_sets(order->certificate, json, MD_KEY_CERTIFICATE, NULL);
     }
+    if (order->created) {
+        md_json_set_time(order->created, json, MD_KEY_CREATED, NULL);
+    }
     return json;
 }
 
@@ -135,6 +139,9 @@ static void order_update_from_json(md_acme_order_t *order, md_json_t *json, apr_
     if (md_json_has_key(json, MD_KEY_CERTIFICATE, NULL)) {
         order->certificate = md_json_dups(p, json, MD_KEY_CERTIFICATE, NULL);
     }
+    if (md_json_has_key(json, MD_KEY_CREATED, NULL)) {
+        order->created = md_json_get_time(json, MD_KEY_CREATED, NULL);
+    }
 }
 
 md_acme_order_t *md_acme_order_from_json(md_json_t *json, apr_pool_t *p)
@@ -226,9 +233,8 @@ static apr_status_t p_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_li
     md_store_t *store = baton;
     md_acme_order_t *order;
     md_store_group_t group;
-    const char *md_name, *setup_token;
+    const char *md_name;
     apr_table_t *env;
-    int i;
 
     group = (md_store_group_t)va_arg(ap, int);
     md_name = va_arg(ap, const char *);
@@ -236,14 +242,7 @@ static apr_status_t p_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_li
 
     if (APR_SUCCESS == md_acme_order_load(store, group, md_name, &order, p)) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "order loaded for %s", md_name);
-        for (i = 0; i < order->challenge_setups->nelts; ++i) {
-            setup_token = APR_ARRAY_IDX(order->challenge_setups, i, const char*);
-            if (setup_token) {
-                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
-                              "order teardown setup %s", setup_token);
-                md_acme_authz_teardown(store, setup_token, md_name, env, p);
-            }
-        }
+        md_acme_authz_teardown_all(store, order->challenge_setups, md_name, env, p);
     }
     return md_store_remove(store, group, md_name, MD_FN_ORDER, ptemp, 1);
 }
@@ -305,6 +304,7 @@ static apr_status_t on_order_upd(md_acme_t *acme, apr_pool_t *p, const apr_table
         if (location) {
             ctx->order = md_acme_order_create(ctx->p);
             ctx->order->url = apr_pstrdup(ctx->p, location);
+            ctx->order->created = apr_time_now();
             md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, ctx->p, "new order at %s", location);
         }
         else {
@@ -315,6 +315,8 @@ static apr_status_t on_order_upd(md_acme_t *acme, apr_pool_t *p, const apr_table
     }
     
     order_update_from_json(ctx->order, body, ctx->p);
+    ctx->order->retry_after = md_util_parse_retry_after(apr_table_get(hdrs, "retry-after"),
+                                                        apr_time_now());
 out:
     return rv;
 }
@@ -428,6 +430,83 @@ apr_status_t md_acme_order_await_valid(md_acme_order_t *order, md_acme_t *acme,
 /**************************************************************************************************/
 /* processing */
 
+typedef struct {
+    md_acme_authz_t *authz;
+    apr_status_t rv;
+    int skip;
+} authz_item_t;
+
+typedef struct {
+    order_ctx_t *ctx;
+    apr_array_header_t *items;
+    int next;
+    int notify;
+} authz_batch_t;
+
+static void authz_batch_init(authz_batch_t *batch, order_ctx_t *ctx)
+{
+    authz_item_t *item;
+    int i;
+    
+    batch->ctx = ctx;
+    batch->items = apr_array_make(ctx->p, ctx->order->authz_urls->nelts, sizeof(authz_item_t*));
+    for (i = 0; i < ctx->order->authz_urls->nelts; ++i) {
+        item = apr_pcalloc(ctx->p, sizeof(*item));
+        item->authz = md_acme_authz_create(ctx->p);
+        item->authz->url = APR_ARRAY_IDX(ctx->order->authz_urls, i, const char*);
+        APR_ARRAY_PUSH(batch->items, authz_item_t*) = item;
+    }
+}
+
+static void authz_item_done(md_acme_req_t *req, apr_status_t rv, void *baton)
+{
+    authz_item_t *item = baton;
+    
+    (void)req;
+    item->rv = rv;
+}
+
+static apr_status_t authz_next_req(md_acme_req_t **preq, void *baton, int in_flight)
+{
+    authz_batch_t *batch = baton;
+    authz_item_t *item;
+    md_acme_req_t *req;
+    
+    (void)in_flight;
+    while (batch->next < batch->items->nelts) {
+        item = APR_ARRAY_IDX(batch->items, batch->next++, authz_item_t*);
+        if (item->skip) continue;
+        
+        item->rv = APR_SUCCESS;
+        if (batch->notify) {
+            if (!item->authz->notify_url) continue;
+            req = md_acme_authz_notify_req(item->authz, batch->ctx->acme, batch->ctx->p);
+        }
+        else {
+            req = md_acme_authz_update_req(item->authz, batch->ctx->acme, batch->ctx->p);
+        }
+        if (!req) {
+            item->rv = APR_ENOMEM;
+            continue;
+        }
+        req->on_done = authz_item_done;
+        req->done_baton = item;
+        *preq = req;
+        return APR_SUCCESS;
+    }
+    return APR_ENOENT;
+}
+
+/* Either update all authorizations not skipped or notify the ACME server 
+ * about all challenges that have been set up, in parallel. The outcome for
+ * each is in its item. */
+static apr_status_t authz_batch_perform(authz_batch_t *batch, int notify)
+{
+    batch->next = 0;
+    batch->notify = notify;
+    return md_acme_multi_perform(batch->ctx->acme, authz_next_req, batch);
+}
+
 apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *acme, 
                                             apr_array_header_t *challenge_types,
                                             md_store_t *store, const md_t *md, 
@@ -435,18 +514,29 @@ apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *a
                                             apr_pool_t *p)
 {
     apr_status_t rv = APR_SUCCESS;
+    order_ctx_t ctx;
+    authz_batch_t batch;
+    authz_item_t *item;
     md_acme_authz_t *authz;
-    const char *url, *setup_token;
+    apr_array_header_t *authzs;
+    const char *setup_token;
     int i;
     
+    ORDER_CTX_INIT(&ctx, p, order, acme, md->name, NULL, result);
+    authz_batch_init(&batch, &ctx);
+    
     md_result_activity_printf(result, "Starting challenges for domains");
-    for (i = 0; i < order->authz_urls->nelts; ++i) {
-        url = APR_ARRAY_IDX(order->authz_urls, i, const char*);
-        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: check AUTHZ at %s", md->name, url);
+    if (APR_SUCCESS != (rv = authz_batch_perform(&batch, 0))) goto leave;
+    
+    for (i = 0; i < batch.items->nelts; ++i) {
+        item = APR_ARRAY_IDX(batch.items, i, authz_item_t*);
+        authz = item->authz;
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, item->rv, p, "%s: check AUTHZ at %s", 
+                      md->name, authz->url);
         
-        if (APR_SUCCESS != (rv = md_acme_authz_retrieve(acme, p, url, &authz))) {
+        if (APR_SUCCESS != (rv = item->rv)) {
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: check authz for %s",
-                          md->name, authz->domain);
+                          md->name, authz->url);
             goto leave;
         }
 
@@ -455,6 +545,12 @@ apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *a
                 break;
                 
             case MD_ACME_AUTHZ_S_PENDING:
+                if (md_acme_authz_is_processing(authz)) {
+                    /* responded in an earlier run, CA is still validating */
+                    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: challenge for %s "
+                                  "is being processed", md->name, authz->domain);
+                    break;
+                }
                 rv = md_acme_authz_respond(authz, acme, store, challenge_types, 
                                            md->pks,
                                            md->acme_tls_1_domains, md->name,
@@ -481,59 +577,97 @@ apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *a
                 goto leave;
         }
     }
+    
+    /* in dns-01 batch mode, the records of all domains are set up together now */
+    authzs = apr_array_make(p, batch.items->nelts, sizeof(md_acme_authz_t*));
+    for (i = 0; i < batch.items->nelts; ++i) {
+        item = APR_ARRAY_IDX(batch.items, i, authz_item_t*);
+        APR_ARRAY_PUSH(authzs, md_acme_authz_t*) = item->authz;
+    }
+    rv = md_acme_authz_dns01_batch_setup(authzs, store, md->name, env, p);
+    if (APR_SUCCESS != rv) {
+        md_result_printf(result, rv, "The dns-01 command failed to set up the challenges "
+                         "for %s. Please check the log for errors.", md->name);
+        result->problem = "challenge-setup-failure";
+        md_result_log(result, MD_LOG_ERR);
+        goto leave;
+    }
+    
+    /* all challenges are set up, tell the ACME server so it may (re)try verification */
+    if (APR_SUCCESS != (rv = authz_batch_perform(&batch, 1))) goto leave;
+    for (i = 0; i < batch.items->nelts; ++i) {
+        item = APR_ARRAY_IDX(batch.items, i, authz_item_t*);
+        if (APR_SUCCESS != (rv = item->rv)) {
+            md_result_printf(result, rv, "error telling the ACME server that the challenge "
+                             "for domain %s is set up", item->authz->domain);
+            md_result_log(result, MD_LOG_ERR);
+            goto leave;
+        }
+    }
 leave:    
     return rv;
 }
 
 static apr_status_t check_challenges(void *baton, int attempt)
 {
-    order_ctx_t *ctx = baton;
-    const char *url;
+    authz_batch_t *batch = baton;
+    order_ctx_t *ctx = batch->ctx;
+    authz_item_t *item;
     md_acme_authz_t *authz;
-    apr_status_t rv = APR_SUCCESS;
-    int i;
+    apr_status_t rv;
+    int i, pending = 0;
     
-    for (i = 0; i < ctx->order->authz_urls->nelts; ++i) {
-        url = APR_ARRAY_IDX(ctx->order->authz_urls, i, const char*);
-        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ctx->p, "%s: check AUTHZ at %s (attempt %d)", 
-                      ctx->name, url, attempt);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ctx->p, "%s: check AUTHZs (attempt %d)", 
+                  ctx->name, attempt);
+    ctx->order->retry_after = 0;
+    if (APR_SUCCESS != (rv = authz_batch_perform(batch, 0))) goto leave;
+    
+    for (i = 0; i < batch->items->nelts; ++i) {
+        item = APR_ARRAY_IDX(batch->items, i, authz_item_t*);
+        authz = item->authz;
+        if (item->skip) continue;
         
-        rv = md_acme_authz_retrieve(ctx->acme, ctx->p, url, &authz);
-        if (APR_SUCCESS == rv) {
-            switch (authz->state) {
-                case MD_ACME_AUTHZ_S_VALID:
-                    md_result_printf(ctx->result, rv, 
-                                     "domain authorization for %s is valid", authz->domain);
-                    break;
-                case MD_ACME_AUTHZ_S_PENDING:
-                    rv = APR_EAGAIN;
-                    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ctx->p, 
-                                  "%s: status pending at %s", authz->domain, authz->url);
-                    goto leave;
-                case MD_ACME_AUTHZ_S_INVALID:
-                    rv = APR_EINVAL;
-                    if (!authz->error_type) {
-                        md_result_printf(ctx->result, rv, 
-                                         "domain authorization for %s failed, CA considers "
-                                         "answer to challenge invalid, no error given", 
-                                         authz->domain);
-                    } 
-                    md_result_log(ctx->result, MD_LOG_ERR);
-                    goto leave;
-                default:
-                    rv = APR_EINVAL;
-                    md_result_printf(ctx->result, rv, 
-                                     "domain authorization for %s failed with state %d", 
-                                     authz->domain, authz->state);
-                    md_result_log(ctx->result, MD_LOG_ERR);
-                    goto leave;
-            }
-        }
-        else {
+        if (APR_SUCCESS != item->rv) {
+            rv = item->rv;
             md_result_printf(ctx->result, rv, "authorization retrieval failed for domain %s", 
-                             authz->domain);
+                             authz->domain? authz->domain : authz->url);
+            continue;
+        }
+        switch (authz->state) {
+            case MD_ACME_AUTHZ_S_VALID:
+                md_result_printf(ctx->result, rv, 
+                                 "domain authorization for %s is valid", authz->domain);
+                /* no need to ask again */
+                item->skip = 1;
+                break;
+            case MD_ACME_AUTHZ_S_PENDING:
+                ++pending;
+                if (authz->retry_after > ctx->order->retry_after) {
+                    ctx->order->retry_after = authz->retry_after;
+                }
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, APR_EAGAIN, ctx->p, 
+                              "%s: status pending at %s", authz->domain, authz->url);
+                break;
+            case MD_ACME_AUTHZ_S_INVALID:
+                rv = APR_EINVAL;
+                if (!authz->error_type) {
+                    md_result_printf(ctx->result, rv, 
+                                     "domain authorization for %s failed, CA considers "
+                                     "answer to challenge invalid, no error given", 
+                                     authz->domain);
+                } 
+                md_result_log(ctx->result, MD_LOG_ERR);
+                goto leave;
+            default:
+                rv = APR_EINVAL;
+                md_result_printf(ctx->result, rv, 
+                                 "domain authorization for %s failed with state %d", 
+                                 authz->domain, authz->state);
+                md_result_log(ctx->result, MD_LOG_ERR);
+                goto leave;
         }
     }
+    if (APR_SUCCESS == rv && pending) rv = APR_EAGAIN;
 leave:
     return rv;
 }
@@ -543,12 +677,14 @@ apr_status_t md_acme_order_monitor_authzs(md_acme_order_t *order, md_acme_t *acm
                                           md_result_t *result, apr_pool_t *p)
 {
     order_ctx_t ctx;
+    authz_batch_t batch;
     apr_status_t rv;
     
     ORDER_CTX_INIT(&ctx, p, order, acme, md->name, NULL, result);
+    authz_batch_init(&batch, &ctx);
     
     md_result_activity_printf(result, "Monitoring challenge status for %s", md->name);
-    rv = md_util_try(check_challenges, &ctx, 0, timeout, 0, 0, 1);
+    rv = md_util_try(check_challenges, &batch, 0, timeout, 0, 0, 1);
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: checked authorizations", md->name);
     return rv;
 }
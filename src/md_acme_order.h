@@ -38,6 +38,8 @@ struct md_acme_order_t {
     struct md_json_t *json;
     const char *finalize;
     const char *certificate;
+    apr_time_t created;             /* when we registered the order at the CA */
+    apr_time_t retry_after;         /* when the CA wants us to look again, not persisted */
 };
 
 #define MD_FN_ORDER             "order.json"
@@ -32,6 +32,7 @@
 #include "md_result.h"
 #include "md_reg.h"
 #include "md_store.h"
+#include "md_time.h"
 #include "md_util.h"
 
 #include "md_acme.h"
@@ -56,6 +57,8 @@ static apr_status_t ad_setup_order(md_proto_driver_t *d, md_result_t *result)
     md_acme_driver_t *ad = d->baton;
     apr_status_t rv;
     md_t *md = ad->md;
+    apr_time_t at;
+    char ts[APR_RFC822_DATE_LEN];
     
     assert(ad->md);
     assert(ad->acme);
@@ -75,6 +78,15 @@ static apr_status_t ad_setup_order(md_proto_driver_t *d, md_result_t *result)
         md_acme_order_purge(d->store, d->p, MD_SG_STAGING, md->name, d->env);
     }
     
+    if ((at = md_acme_budget_take_order(ad->acme->budget))) {
+        /* all MDs together have placed as many orders at this CA as it allows */
+        apr_rfc822_date(ts, at);
+        md_result_printf(result, APR_EAGAIN, "No new orders at the CA possible "
+                         "before %s", ts);
+        md_result_yield_set(result, at);
+        return result->status;
+    }
+    
     md_result_activity_setn(result, "Creating new order");
     rv = md_acme_order_register(&ad->order, ad->acme, d->p, d->md->name, ad->domains);
     if (APR_SUCCESS !=rv) goto leave;
@@ -91,6 +103,48 @@ leave:
 /**************************************************************************************************/
 /* ACMEv2 renewal */
 
+/* How long to wait before looking at the order again when the CA does not say */
+#define MD_ACME_POLL_DELAY      apr_time_from_sec(5)
+/* How long we wait on the CA for an order in total before we give up on it */
+#define MD_ACME_ORDER_TIMEOUT   apr_time_from_sec(30 * 60)
+
+/**
+ * The order is waiting on the CA. Instead of sleeping, the order's state is 
+ * left in STAGING and we ask to be run again at the time the CA gave us in
+ * a 'Retry-After' header or a little later.
+ * An order that the CA has not moved along in MD_ACME_ORDER_TIMEOUT is 
+ * dropped and the renewal fails, so the next attempt starts over.
+ */
+static apr_status_t ad_yield(md_proto_driver_t *d, const char *waiting_for, md_result_t *result)
+{
+    md_acme_driver_t *ad = d->baton;
+    apr_time_t now, at;
+    
+    now = apr_time_now();
+    if (ad->order && !ad->order->created) {
+        /* order from an older version, start its clock now */
+        ad->order->created = now;
+        md_acme_order_save(d->store, d->p, MD_SG_STAGING, d->md->name, ad->order, 0);
+    }
+    else if (ad->order && now - ad->order->created > MD_ACME_ORDER_TIMEOUT) {
+        md_result_printf(result, APR_TIMEUP, "Gave up waiting for %s after %s", waiting_for,
+                         md_duration_print(d->p, now - ad->order->created));
+        md_result_log(result, MD_LOG_WARNING);
+        md_acme_order_purge(d->store, d->p, MD_SG_STAGING, d->md->name, d->env);
+        ad->order = NULL;
+        return APR_TIMEUP;
+    }
+    
+    at = ad->order? ad->order->retry_after : 0;
+    if (at <= now) at = now + MD_ACME_POLL_DELAY;
+    
+    md_result_printf(result, APR_EAGAIN, "Waiting for %s", waiting_for);
+    md_result_yield_set(result, at);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, "%s: waiting for %s, check again in %s", 
+                  d->md->name, waiting_for, md_duration_print(d->p, at - now));
+    return APR_EAGAIN;
+}
+
 apr_status_t md_acmev2_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d, md_result_t *result)
 {
     apr_status_t rv = APR_SUCCESS;
@@ -114,6 +168,8 @@ apr_status_t md_acmev2_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d, m
      *   * VALID: retrieve certificate
      *   * COMPLETE: all done, return success
      *   * INVALID and otherwise: fail renewal, delete local order
+     * When not allowed to wait, any state the CA has not moved on from yet
+     * returns APR_EAGAIN and we start again at 1. when run the next time.
      */
     if (APR_SUCCESS != (rv = ad_setup_order(d, result))) {
         goto leave;
@@ -140,11 +196,19 @@ apr_status_t md_acmev2_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d, m
     
     rv = md_acme_order_monitor_authzs(ad->order, ad->acme, d->md,
                                       ad->authz_monitor_timeout, result, d->p);
-    if (APR_SUCCESS != rv) goto leave;
+    if (APR_STATUS_IS_EAGAIN(rv)) {
+        rv = ad_yield(d, "domain authorizations", result);
+        goto leave;
+    }
+    else if (APR_SUCCESS != rv) goto leave;
 
     rv = md_acme_order_await_ready(ad->order, ad->acme, d->md,
                                    ad->authz_monitor_timeout, result, d->p);
-    if (APR_SUCCESS != rv) goto leave;
+    if (APR_STATUS_IS_EAGAIN(rv)) {
+        rv = ad_yield(d, "order to become ready", result);
+        goto leave;
+    }
+    else if (APR_SUCCESS != rv) goto leave;
 
     if (MD_ACME_ORDER_ST_READY == ad->order->status) {
         rv = md_acme_drive_setup_cred_chain(d, result);
@@ -154,7 +218,11 @@ apr_status_t md_acmev2_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d, m
 
     rv = md_acme_order_await_valid(ad->order, ad->acme, d->md, 
                                    ad->authz_monitor_timeout, result, d->p);
-    if (APR_SUCCESS != rv) goto leave;
+    if (APR_STATUS_IS_EAGAIN(rv)) {
+        rv = ad_yield(d, "finalized order to become valid", result);
+        goto leave;
+    }
+    else if (APR_SUCCESS != rv) goto leave;
     
     if (!ad->order->certificate) {
         md_result_set(result, APR_EINVAL, "Order valid, but certifiate url is missing.");
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 
 #include <apr_lib.h>
+#include <apr_hash.h>
 #include <apr_strings.h>
 #include <apr_tables.h>
 #include <apr_time.h>
@@ -168,6 +169,49 @@ md_t *md_get_by_domain(struct apr_array_header_t *mds, const char *domain)
     return NULL;
 }
 
+/* DNS names are at most 253 characters, longer ones are looked up the slow way */
+#define DOMAIN_IDX_KEY_MAX      256
+
+struct md_domain_idx_t {
+    struct apr_array_header_t *mds;
+    apr_hash_t *names;                  /* lower case name -> first md_t containing it */
+};
+
+md_domain_idx_t *md_domain_idx_make(struct apr_array_header_t *mds, apr_pool_t *p)
+{
+    md_domain_idx_t *idx;
+    const char *name;
+    md_t *md;
+    int i, j;
+    
+    idx = apr_pcalloc(p, sizeof(*idx));
+    idx->mds = mds;
+    idx->names = apr_hash_make(p);
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, md_t *);
+        for (j = 0; j < md->domains->nelts; ++j) {
+            name = md_util_str_tolower(apr_pstrdup(p, APR_ARRAY_IDX(md->domains, j, const char*)));
+            if (!apr_hash_get(idx->names, name, APR_HASH_KEY_STRING)) {
+                apr_hash_set(idx->names, name, APR_HASH_KEY_STRING, md);
+            }
+        }
+    }
+    return idx;
+}
+
+md_t *md_domain_idx_get(const md_domain_idx_t *idx, const char *domain)
+{
+    char key[DOMAIN_IDX_KEY_MAX];
+    apr_size_t i;
+    
+    for (i = 0; domain[i]; ++i) {
+        if (i + 1 >= sizeof(key)) return md_get_by_domain(idx->mds, domain);
+        key[i] = (char)apr_tolower(domain[i]);
+    }
+    key[i] = '\0';
+    return apr_hash_get(idx->names, key, APR_HASH_KEY_STRING);
+}
+
 md_t *md_get_by_dns_overlap(struct apr_array_header_t *mds, const md_t *md)
 {
     int i;
@@ -600,6 +600,20 @@ void *md_pkey_get_EVP_PKEY(struct md_pkey_t *pkey)
     return pkey->pkey;
 }
 
+md_pkey_t *md_pkey_share(md_pkey_t *pkey, apr_pool_t *p)
+{
+    md_pkey_t *shared = make_pkey(p);
+    
+#if MD_USE_OPENSSL_PRE_1_1_API
+    CRYPTO_add(&pkey->pkey->references, 1, CRYPTO_LOCK_EVP_PKEY);
+#else
+    EVP_PKEY_up_ref(pkey->pkey);
+#endif
+    shared->pkey = pkey->pkey;
+    apr_pool_cleanup_register(p, shared, pkey_cleanup, apr_pool_cleanup_null);
+    return shared;
+}
+
 apr_status_t md_pkey_fload(md_pkey_t **ppkey, apr_pool_t *p, 
                            const char *key, apr_size_t key_len,
                            const char *fname)
@@ -978,6 +992,77 @@ apr_status_t md_crypt_sign64(const char **psign64, md_pkey_t *pkey, apr_pool_t *
     return rv;
 }
 
+struct md_signer_t {
+    md_pkey_t *pkey;
+    EVP_MD_CTX *proto;              /* initialized for key and digest, copied for each use */
+};
+
+static apr_status_t signer_cleanup(void *data)
+{
+    md_signer_t *signer = data;
+    if (signer->proto) {
+        EVP_MD_CTX_destroy(signer->proto);
+        signer->proto = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+apr_status_t md_crypt_signer_create(md_signer_t **psigner, md_pkey_t *pkey, apr_pool_t *p)
+{
+    md_signer_t *signer;
+    apr_status_t rv = APR_ENOMEM;
+    
+    signer = apr_pcalloc(p, sizeof(*signer));
+    signer->pkey = pkey;
+    if ((signer->proto = EVP_MD_CTX_create())) {
+        apr_pool_cleanup_register(p, signer, signer_cleanup, apr_pool_cleanup_null);
+        rv = APR_ENOTIMPL;
+        if (EVP_DigestSignInit(signer->proto, NULL, EVP_sha256(), NULL, pkey->pkey)) {
+            rv = APR_SUCCESS;
+        }
+    }
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "creating signer"); 
+    }
+    *psigner = (APR_SUCCESS == rv)? signer : NULL;
+    return rv;
+}
+
+apr_status_t md_crypt_signer_sign64(const char **psign64, md_signer_t *signer, apr_pool_t *p, 
+                                    const char *d, size_t dlen)
+{
+    EVP_MD_CTX *ctx = NULL;
+    md_data_t buffer;
+    size_t blen;
+    const char *sign64 = NULL;
+    apr_status_t rv = APR_ENOMEM;
+    
+    buffer.len = (apr_size_t)EVP_PKEY_size(signer->pkey->pkey);
+    buffer.data = apr_pcalloc(p, buffer.len);
+    if (buffer.data && (ctx = EVP_MD_CTX_create())) {
+        rv = APR_EGENERAL;
+        blen = buffer.len;
+        if (EVP_MD_CTX_copy_ex(ctx, signer->proto)
+            && EVP_DigestSignUpdate(ctx, d, dlen)
+            && EVP_DigestSignFinal(ctx, (unsigned char*)buffer.data, &blen)) {
+            buffer.len = blen;
+            sign64 = md_util_base64url_encode(&buffer, p);
+            if (sign64) {
+                rv = APR_SUCCESS;
+            }
+        }
+    }
+    if (ctx) {
+        EVP_MD_CTX_destroy(ctx);
+    }
+    
+    if (rv != APR_SUCCESS) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "signing"); 
+    }
+    *psign64 = sign64;
+    return rv;
+}
+
 static apr_status_t sha256_digest(md_data_t **pdigest, apr_pool_t *p, const md_data_t *buf)
 {
     EVP_MD_CTX *ctx = NULL;
@@ -1073,6 +1158,16 @@ md_cert_t *md_cert_make(apr_pool_t *p, void *x509)
     return cert;
 }
 
+md_cert_t *md_cert_share(const md_cert_t *cert, apr_pool_t *p)
+{
+#if MD_USE_OPENSSL_PRE_1_1_API
+    CRYPTO_add(&cert->x509->references, 1, CRYPTO_LOCK_X509);
+#else
+    X509_up_ref(cert->x509);
+#endif
+    return md_cert_make(p, cert->x509);
+}
+
 void *md_cert_get_X509(const md_cert_t *cert)
 {
     return cert->x509;
@@ -114,8 +114,25 @@ apr_status_t md_pkey_fsave(md_pkey_t *pkey, apr_pool_t *p,
 apr_status_t md_crypt_sign64(const char **psign64, md_pkey_t *pkey, apr_pool_t *p, 
                              const char *d, size_t dlen);
 
+/**
+ * A SHA256 signing context, set up once for a key. Signing many messages
+ * with it spares the setup that md_crypt_sign64() does on every call. 
+ * Lives as long as the pool it was created from.
+ */
+typedef struct md_signer_t md_signer_t;
+
+apr_status_t md_crypt_signer_create(md_signer_t **psigner, md_pkey_t *pkey, apr_pool_t *p);
+apr_status_t md_crypt_signer_sign64(const char **psign64, md_signer_t *signer, apr_pool_t *p, 
+                                    const char *d, size_t dlen);
+
 void *md_pkey_get_EVP_PKEY(struct md_pkey_t *pkey);
 
+/**
+ * Get another holder of the same key that keeps it alive until the pool
+ * is destroyed, independent of the original holder.
+ */
+md_pkey_t *md_pkey_share(md_pkey_t *pkey, apr_pool_t *p);
+
 /**************************************************************************************************/
 /* X509 certificates */
 
@@ -139,6 +156,12 @@ md_cert_t *md_cert_make(apr_pool_t *p, void *x509);
  */
 md_cert_t *md_cert_wrap(apr_pool_t *p, void *x509);
 
+/**
+ * Get another holder of the same certificate that keeps it alive until the 
+ * pool is destroyed, independent of the original holder.
+ */
+md_cert_t *md_cert_share(const md_cert_t *cert, apr_pool_t *p);
+
 void *md_cert_get_X509(const md_cert_t *cert);
 
 apr_status_t md_cert_fload(md_cert_t **pcert, apr_pool_t *p, const char *fname);
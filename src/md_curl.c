@@ -19,8 +19,13 @@
 #include <curl/curl.h>
 
 #include <apr_lib.h>
+#include <apr_atomic.h>
 #include <apr_strings.h>
 #include <apr_buckets.h>
+#include <apr_poll.h>
+#include <apr_portable.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
 
 #include "md_http.h"
 #include "md_log.h"
@@ -50,6 +55,102 @@ static apr_status_t curl_status(unsigned int curl_code)
     }
 }
 
+/**************************************************************************************************/
+/* process wide sharing of DNS lookups, TLS sessions and connections */
+
+typedef struct {
+    CURLSH *curlsh;
+    apr_thread_mutex_t *locks[CURL_LOCK_DATA_LAST];
+    volatile apr_uint32_t requests;    /* transfers done */
+    volatile apr_uint32_t connects;    /* new connections these transfers needed */
+} md_curl_share_t;
+
+static apr_pool_t *share_pool;
+static apr_thread_once_t *share_once;
+static md_curl_share_t *share;
+static apr_threadkey_t *multi_key;     /* the thread's md_curl_multi_t */
+
+static void share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *baton)
+{
+    md_curl_share_t *sh = baton;
+    
+    (void)curl;
+    (void)access;
+    if (data < CURL_LOCK_DATA_LAST && sh->locks[data]) {
+        apr_thread_mutex_lock(sh->locks[data]);
+    }
+}
+
+static void share_unlock(CURL *curl, curl_lock_data data, void *baton)
+{
+    md_curl_share_t *sh = baton;
+    
+    (void)curl;
+    if (data < CURL_LOCK_DATA_LAST && sh->locks[data]) {
+        apr_thread_mutex_unlock(sh->locks[data]);
+    }
+}
+
+static void share_create(void)
+{
+    md_curl_share_t *sh;
+    apr_pool_t *p;
+    int i;
+    
+    /* Created lazily on first use in the process where the transfers happen,
+     * so that no connection is ever inherited by a forked child. */
+    if (APR_SUCCESS != apr_pool_create(&p, share_pool)) return;
+    sh = apr_pcalloc(p, sizeof(*sh));
+    sh->curlsh = curl_share_init();
+    if (!sh->curlsh) goto fail;
+    for (i = 0; i < CURL_LOCK_DATA_LAST; ++i) {
+        if (APR_SUCCESS != apr_thread_mutex_create(&sh->locks[i], 
+                                                   APR_THREAD_MUTEX_DEFAULT, p)) goto fail;
+    }
+    curl_share_setopt(sh->curlsh, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(sh->curlsh, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(sh->curlsh, CURLSHOPT_USERDATA, sh);
+    /* Not the connection cache, libcurl does not support sharing that between
+     * threads. Connections are reused by the per thread multi handle. */
+    curl_share_setopt(sh->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(sh->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    share = sh;
+    return;
+fail:
+    if (sh->curlsh) curl_share_cleanup(sh->curlsh);
+    apr_pool_destroy(p);
+}
+
+static md_curl_share_t *share_get(void)
+{
+    if (share_once) apr_thread_once(share_once, share_create);
+    return share;
+}
+
+void md_curl_get_stats(md_curl_stats_t *stats)
+{
+    md_curl_share_t *sh = share;
+    
+    stats->requests = sh? apr_atomic_read32(&sh->requests) : 0;
+    stats->connects = sh? apr_atomic_read32(&sh->connects) : 0;
+}
+
+/* Count a finished transfer and whether it could reuse a connection */
+static void share_count(CURL *curl)
+{
+    md_curl_share_t *sh = share;
+    long connects = 0;
+    
+    if (!sh) return;
+    apr_atomic_inc32(&sh->requests);
+    if (CURLE_OK == curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) && connects > 0) {
+        apr_atomic_add32(&sh->connects, (apr_uint32_t)connects);
+    }
+}
+
+/**************************************************************************************************/
+/* md_http requests */
+
 typedef struct {
     CURL *curl;
     CURLM *curlm;
@@ -243,25 +344,31 @@ static apr_status_t internals_setup(md_http_request_t *req)
 {
     md_curl_internals_t *internals;
     CURL *curl;
+    md_curl_share_t *sh;
     apr_status_t rv = APR_SUCCESS;
 
     curl = md_http_get_impl_data(req->http);
-    if (!curl) {
+    if (curl) {
+        /* take it, so that concurrent requests do not get the same instance */
+        md_http_set_impl_data(req->http, NULL);
+        /* Forget the options of the previous request, e.g. its method and
+         * headers. Connections, DNS and TLS session caches are kept. */
+        curl_easy_reset(curl);
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, req->pool, "reusing curl instance from http");
+    }
+    else {
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, req->pool, "creating curl instance");
         curl = curl_easy_init();
         if (!curl) {
             rv = APR_EGENERAL;
             goto leave;
         }
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
-        curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
-        curl_easy_setopt(curl, CURLOPT_READFUNCTION, req_data_cb);
-        curl_easy_setopt(curl, CURLOPT_READDATA, NULL);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, resp_data_cb);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
     }
-    else {
-        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, req->pool, "reusing curl instance from http");
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, req_data_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, resp_data_cb);
+    if ((sh = share_get())) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, sh->curlsh);
     }
 
     internals = apr_pcalloc(req->pool, sizeof(*internals));
@@ -354,6 +461,7 @@ static apr_status_t update_status(md_http_request_t *req)
         if (APR_SUCCESS == rv) {
             internals->response->status = (int)l;
         }
+        share_count(internals->curl);
     }
     return rv;
 }
@@ -401,6 +509,7 @@ static apr_status_t md_curl_perform(md_http_request_t *req)
     if (APR_SUCCESS == rv) {
         internals->response->status = (int)l;
     }
+    share_count(internals->curl);
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, req->pool, "request <-- %d", 
                   internals->response->status);
     
@@ -451,26 +560,189 @@ static void remove_from_curlm(md_http_request_t *req, CURLM *curlm)
     }
 }
     
+/* Longest time we wait for socket events, even when curl has no timer running */
+#define MD_CURL_POLL_MAX     (apr_time_from_sec(1))
+#define MD_CURL_POLL_SIZE    256
+
+typedef struct md_curl_sock_t md_curl_sock_t;
+struct md_curl_sock_t {
+    curl_socket_t s;
+    apr_pollfd_t pfd;
+    md_curl_sock_t *next;        /* in free list */
+};
+
+/* A multi handle lives as long as its thread. Its connection cache keeps
+ * connections open from one multi perform to the next. */
+typedef struct {
+    apr_pool_t *p;
+    CURLM *curlm;
+    apr_pollset_t *pollset;
+    apr_time_t timeout;          /* when curl wants to be called for timeouts or -1 */
+    md_curl_sock_t *free_socks;  /* removed by curl, to be used again */
+    int in_use;                  /* a multi perform is running on it */
+    int broken;                  /* failed, do not use again */
+} md_curl_multi_t;
+
+/* curl tells us which sockets to watch for which events */
+static int multi_socket_cb(CURL *curl, curl_socket_t s, int what, void *baton, void *sockp)
+{
+    md_curl_multi_t *multi = baton;
+    md_curl_sock_t *sock = sockp;
+    apr_os_sock_t fd = s;
+    
+    (void)curl;
+    if (sock && sock->pfd.reqevents) {
+        apr_pollset_remove(multi->pollset, &sock->pfd);
+        sock->pfd.reqevents = 0;
+    }
+    if (CURL_POLL_REMOVE == what) {
+        if (sock) {
+            curl_multi_assign(multi->curlm, s, NULL);
+            sock->next = multi->free_socks;
+            multi->free_socks = sock;
+        }
+        return 0;
+    }
+    if (!sock) {
+        if (multi->free_socks) {
+            sock = multi->free_socks;
+            multi->free_socks = sock->next;
+            sock->next = NULL;
+        }
+        else {
+            sock = apr_pcalloc(multi->p, sizeof(*sock));
+        }
+        sock->s = s;
+        /* reuses the apr_socket_t of a recycled sock */
+        if (APR_SUCCESS != apr_os_sock_put(&sock->pfd.desc.s, &fd, multi->p)) return -1;
+        sock->pfd.p = multi->p;
+        sock->pfd.desc_type = APR_POLL_SOCKET;
+        sock->pfd.client_data = sock;
+        curl_multi_assign(multi->curlm, s, sock);
+    }
+    if (what & CURL_POLL_IN) sock->pfd.reqevents |= APR_POLLIN;
+    if (what & CURL_POLL_OUT) sock->pfd.reqevents |= APR_POLLOUT;
+    if (sock->pfd.reqevents 
+        && APR_SUCCESS != apr_pollset_add(multi->pollset, &sock->pfd)) {
+        sock->pfd.reqevents = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* curl tells us when it needs to be called, even without socket events */
+static int multi_timer_cb(CURLM *curlm, long timeout_ms, void *baton)
+{
+    md_curl_multi_t *multi = baton;
+    
+    (void)curlm;
+    multi->timeout = (timeout_ms < 0)? -1 : apr_time_now() + apr_time_from_msec(timeout_ms);
+    return 0;
+}
+
+static void multi_destroy(void *data)
+{
+    md_curl_multi_t *multi = data;
+    
+    /* curl may still tell us about sockets, the pollset goes with the pool */
+    if (multi->curlm) curl_multi_cleanup(multi->curlm);
+    apr_pool_destroy(multi->p);
+}
+
+static apr_status_t multi_create(md_curl_multi_t **pmulti)
+{
+    md_curl_multi_t *multi = NULL;
+    apr_allocator_t *allocator;
+    apr_pool_t *p;
+    apr_status_t rv;
+    
+    /* With own allocator, as it lives and dies with its thread */
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) goto leave;
+    if (APR_SUCCESS != (rv = apr_pool_create_ex(&p, NULL, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        goto leave;
+    }
+    apr_allocator_owner_set(allocator, p);
+    apr_pool_tag(p, "md_curl_multi");
+    multi = apr_pcalloc(p, sizeof(*multi));
+    multi->p = p;
+    multi->timeout = -1;
+    if (APR_SUCCESS != (rv = apr_pollset_create(&multi->pollset, MD_CURL_POLL_SIZE, p, 0))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "multi_perform: create pollset");
+        goto leave;
+    }
+    if (!(multi->curlm = curl_multi_init())) {
+        rv = APR_ENOMEM;
+        goto leave;
+    }
+    curl_multi_setopt(multi->curlm, CURLMOPT_SOCKETFUNCTION, multi_socket_cb);
+    curl_multi_setopt(multi->curlm, CURLMOPT_SOCKETDATA, multi);
+    curl_multi_setopt(multi->curlm, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
+    curl_multi_setopt(multi->curlm, CURLMOPT_TIMERDATA, multi);
+leave:
+    if (APR_SUCCESS != rv && multi) {
+        multi_destroy(multi);
+        multi = NULL;
+    }
+    *pmulti = multi;
+    return rv;
+}
+
+/* Get the multi handle of the calling thread, creating it on first use.
+ * When the thread's handle is busy, e.g. for a nested call, or cannot be
+ * kept, the caller gets one of its own and has to destroy it. */
+static apr_status_t multi_get(md_curl_multi_t **pmulti, int *pown)
+{
+    md_curl_multi_t *current = NULL, *multi = NULL;
+    apr_status_t rv = APR_SUCCESS;
+    
+    *pown = 1;
+    if (multi_key && APR_SUCCESS != apr_threadkey_private_get((void**)&current, multi_key)) {
+        current = NULL;
+    }
+    if (current && !current->in_use) {
+        multi = current;
+        *pown = 0;
+    }
+    else if (APR_SUCCESS == (rv = multi_create(&multi)) && !current && multi_key
+             && APR_SUCCESS == apr_threadkey_private_set(multi, multi_key)) {
+        *pown = 0;
+    }
+    if (multi) multi->in_use = 1;
+    *pmulti = multi;
+    return rv;
+}
+
+static void multi_release(md_curl_multi_t *multi, int own)
+{
+    multi->in_use = 0;
+    if (!own && multi->broken) {
+        /* the thread gets a new one next time */
+        apr_threadkey_private_set(NULL, multi_key);
+        own = 1;
+    }
+    if (own) multi_destroy(multi);
+}
+
 static apr_status_t md_curl_multi_perform(md_http_t *http, apr_pool_t *p,
                                           md_http_next_req *nextreq, void *baton)
 {
     md_http_request_t *req;
-    CURLM *curlm = NULL;
+    md_curl_multi_t *multi = NULL;
+    md_curl_sock_t *sock;
     CURLMcode mc;
     struct CURLMsg *curlmsg;
     apr_array_header_t *requests;
-    int i, running, numfds, slowdown, msgcount;
+    const apr_pollfd_t *pfds;
+    apr_interval_time_t wait;
+    apr_int32_t npfds;
+    int i, running, msgcount, what, own = 1;
     apr_status_t rv;
     
     requests = apr_array_make(p, 10, sizeof(md_http_request_t*));
-    curlm = curl_multi_init();
-    if (!curlm) {
-        rv = APR_ENOMEM;
-        goto leave;
-    }
+    running = 0;
+    if (APR_SUCCESS != (rv = multi_get(&multi, &own))) goto leave;
     
-    running = 1;
-    slowdown = 0;
     while(1) {
         while (1) {
             /* fetch as many requests as nextreq gives us */
@@ -484,7 +756,7 @@ static apr_status_t md_curl_multi_perform(md_http_t *http, apr_pool_t *p,
                 }
                 else {
                     APR_ARRAY_PUSH(requests, md_http_request_t*) = req;
-                    add_to_curlm(req, curlm);
+                    add_to_curlm(req, multi->curlm);
                     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, p, 
                                   "multi_perform[%d reqs]: added request", requests->nelts);
                 }
@@ -493,7 +765,7 @@ static apr_status_t md_curl_multi_perform(md_http_t *http, apr_pool_t *p,
             else if (APR_STATUS_IS_ENOENT(rv)) {
                 md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, 
                               "multi_perform[%d reqs]: no more requests", requests->nelts);
-                if (!running) {
+                if (!requests->nelts) {
                     goto leave;
                 }
                 break;
@@ -505,29 +777,50 @@ static apr_status_t md_curl_multi_perform(md_http_t *http, apr_pool_t *p,
             }
         }
     
-        mc = curl_multi_perform(curlm, &running);
-        if (CURLM_OK == mc) {
-            mc = curl_multi_wait(curlm, NULL, 0, 1000, &numfds);
-            if (numfds) slowdown = 0;
+        /* wait for socket events or until curl's timer expires */
+        wait = MD_CURL_POLL_MAX;
+        if (multi->timeout >= 0) {
+            wait = multi->timeout - apr_time_now();
+            if (wait < 0) wait = 0;
+            else if (wait > MD_CURL_POLL_MAX) wait = MD_CURL_POLL_MAX;
+        }
+        mc = CURLM_OK;
+        npfds = 0;
+        rv = (wait > 0)? apr_pollset_poll(multi->pollset, wait, &npfds, &pfds) : APR_TIMEUP;
+        if (APR_SUCCESS == rv) {
+            for (i = 0; i < npfds && CURLM_OK == mc; ++i) {
+                sock = pfds[i].client_data;
+                what = 0;
+                if (pfds[i].rtnevents & APR_POLLIN) what |= CURL_CSELECT_IN;
+                if (pfds[i].rtnevents & APR_POLLOUT) what |= CURL_CSELECT_OUT;
+                if (pfds[i].rtnevents & (APR_POLLERR|APR_POLLHUP|APR_POLLNVAL)) {
+                    what |= CURL_CSELECT_ERR;
+                }
+                mc = curl_multi_socket_action(multi->curlm, sock->s, what, &running);
+            }
+        }
+        else if (!APR_STATUS_IS_TIMEUP(rv) && !APR_STATUS_IS_EINTR(rv)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
+                          "multi_perform[%d reqs]: poll failed", requests->nelts);
+            goto leave;
+        }
+        rv = APR_SUCCESS;
+        if (CURLM_OK == mc && multi->timeout >= 0 && multi->timeout <= apr_time_now()) {
+            multi->timeout = -1;
+            mc = curl_multi_socket_action(multi->curlm, CURL_SOCKET_TIMEOUT, 0, &running);
         }
         if (CURLM_OK != mc) {
+            multi->broken = 1;
             rv = APR_ECONNABORTED;
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
                           "multi_perform[%d reqs] failed(%d): %s", 
                           requests->nelts, mc, curl_multi_strerror(mc));
             goto leave;
         }
-        if (!numfds) {
-            /* no activity on any connection, timeout */
-            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, 
-                          "multi_perform[%d reqs]: slowdown %d", requests->nelts, slowdown);
-            if (slowdown) apr_sleep(apr_time_from_msec(100));
-            ++slowdown;
-        }
 
         /* process status messages, e.g. that a request is done */
         while (1) {
-            curlmsg = curl_multi_info_read(curlm, &msgcount);
+            curlmsg = curl_multi_info_read(multi->curlm, &msgcount);
             if (!curlmsg) break;
             if (curlmsg->msg == CURLMSG_DONE) {
                 req = find_curl_request(requests, curlmsg->easy_handle);
@@ -537,7 +830,7 @@ static apr_status_t md_curl_multi_perform(md_http_t *http, apr_pool_t *p,
                                   requests->nelts, req->id);
                     update_status(req);
                     fire_status(req, curl_status(curlmsg->data.result));
-                    remove_from_curlm(req, curlm);
+                    remove_from_curlm(req, multi->curlm);
                     md_array_remove(requests, req);
                     md_http_req_destroy(req);
                 }
@@ -548,19 +841,26 @@ static apr_status_t md_curl_multi_perform(md_http_t *http, apr_pool_t *p,
                 }
             }
         }
-        assert(running == requests->nelts);
     };
 
 leave:
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, p, 
-                  "multi_perform[%d reqs]: leaving", requests->nelts);
+                  "multi_perform[%d reqs, %d running]: leaving", requests->nelts, running);
+    if (md_log_is_level(p, MD_LOG_DEBUG)) {
+        md_curl_stats_t stats;
+        
+        md_curl_get_stats(&stats);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                      "curl: %u requests so far, needing %u new connections", 
+                      stats.requests, stats.connects);
+    }
     for (i = 0; i < requests->nelts; ++i) {
         req = APR_ARRAY_IDX(requests, i, md_http_request_t*);
         fire_status(req, APR_SUCCESS);
-        remove_from_curlm(req, curlm);
+        if (multi) remove_from_curlm(req, multi->curlm);
         md_http_req_destroy(req);
     }
-    if (curlm) curl_multi_cleanup(curlm);
+    if (multi) multi_release(multi, own);
     return rv;
 }
 
@@ -623,5 +923,17 @@ md_http_impl_t * md_curl_get_impl(apr_pool_t *p)
     /* trigger early global curl init, before we are down a rabbit hole */
     (void)p;
     md_curl_init();
+    if (!share_pool) {
+        /* lives as long as the process, like the curl global init */
+        if (APR_SUCCESS == apr_pool_create(&share_pool, NULL)) {
+            if (APR_SUCCESS != apr_thread_once_init(&share_once, share_pool)) {
+                share_once = NULL;
+            }
+            if (APR_SUCCESS != apr_threadkey_private_create(&multi_key, multi_destroy, 
+                                                            share_pool)) {
+                multi_key = NULL;
+            }
+        }
+    }
     return &impl;
 }
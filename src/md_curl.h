@@ -21,4 +21,16 @@ struct md_http_impl;
 
 struct md_http_impl_t * md_curl_get_impl(apr_pool_t *p);
 
+typedef struct md_curl_stats_t md_curl_stats_t;
+struct md_curl_stats_t {
+    apr_uint32_t requests;     /* transfers done in this process */
+    apr_uint32_t connects;     /* new connections they needed, the rest reused one */
+};
+
+/**
+ * All curl instances in a process share DNS lookups, TLS sessions and
+ * connections. Get the counters of how well that works.
+ */
+void md_curl_get_stats(md_curl_stats_t *stats);
+
 #endif /* md_curl_h */
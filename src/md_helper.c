@@ -0,0 +1,271 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_strings.h>
+#include <apr_file_io.h>
+#include <apr_hash.h>
+#include <apr_tables.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+
+#include "md_log.h"
+#include "md_helper.h"
+
+typedef struct md_helper_t md_helper_t;
+
+struct md_helper_t {
+    const char *cmdline;
+    apr_pool_t *p;                  /* lives as long as the helper process */
+    apr_proc_t *proc;               /* the running process or NULL */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;      /* one request at a time */
+#endif
+};
+
+static apr_pool_t *helper_pool;
+static apr_hash_t *helpers;
+static apr_time_t helper_timeout = MD_HELPER_TIMEOUT;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *helper_mutex;
+#endif
+
+static void helpers_lock(void)
+{
+#if APR_HAS_THREADS
+    if (helper_mutex) apr_thread_mutex_lock(helper_mutex);
+#endif
+}
+
+static void helpers_unlock(void)
+{
+#if APR_HAS_THREADS
+    if (helper_mutex) apr_thread_mutex_unlock(helper_mutex);
+#endif
+}
+
+static void helper_lock(md_helper_t *helper)
+{
+#if APR_HAS_THREADS
+    if (helper->mutex) apr_thread_mutex_lock(helper->mutex);
+#else
+    (void)helper;
+#endif
+}
+
+static void helper_unlock(md_helper_t *helper)
+{
+#if APR_HAS_THREADS
+    if (helper->mutex) apr_thread_mutex_unlock(helper->mutex);
+#else
+    (void)helper;
+#endif
+}
+
+void md_helper_init(void)
+{
+    if (helper_pool) return;
+    if (APR_SUCCESS != apr_pool_create(&helper_pool, NULL)) {
+        helper_pool = NULL;
+        return;
+    }
+    apr_pool_tag(helper_pool, "md_helpers");
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != apr_thread_mutex_create(&helper_mutex, APR_THREAD_MUTEX_DEFAULT, 
+                                               helper_pool)) {
+        helper_mutex = NULL;
+    }
+#endif
+    helpers = apr_hash_make(helper_pool);
+}
+
+void md_helper_set_timeout(apr_time_t timeout)
+{
+    helper_timeout = timeout;
+}
+
+static md_helper_t *helper_get(const char *cmdline)
+{
+    md_helper_t *helper;
+    
+    if (!helpers) return NULL;
+    helpers_lock();
+    helper = apr_hash_get(helpers, cmdline, APR_HASH_KEY_STRING);
+    if (!helper) {
+        helper = apr_pcalloc(helper_pool, sizeof(*helper));
+        helper->cmdline = apr_pstrdup(helper_pool, cmdline);
+#if APR_HAS_THREADS
+        if (APR_SUCCESS != apr_thread_mutex_create(&helper->mutex, APR_THREAD_MUTEX_DEFAULT, 
+                                                   helper_pool)) {
+            helper->mutex = NULL;
+        }
+#endif
+        apr_hash_set(helpers, helper->cmdline, APR_HASH_KEY_STRING, helper);
+    }
+    helpers_unlock();
+    return helper;
+}
+
+static void helper_stop(md_helper_t *helper)
+{
+    if (!helper->p) return;
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, helper->p, "helper(%s): stopping", 
+                  helper->cmdline);
+    if (helper->proc && helper->proc->in) {
+        /* tell it we are done, the pool cleanup kills it if it does not listen */
+        apr_file_close(helper->proc->in);
+        helper->proc->in = NULL;
+    }
+    apr_pool_destroy(helper->p);
+    helper->p = NULL;
+    helper->proc = NULL;
+}
+
+static apr_status_t helper_start(md_helper_t *helper, apr_array_header_t *env)
+{
+    apr_procattr_t *procattr;
+    apr_array_header_t *nenv;
+    const char * const *argv;
+    const char * const *envp = NULL;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_pool_create(&helper->p, NULL))) {
+        helper->p = NULL;
+        return rv;
+    }
+    apr_pool_tag(helper->p, "md_helper");
+    if (env && env->nelts > 0) {
+        nenv = apr_array_copy(helper->p, env);
+        APR_ARRAY_PUSH(nenv, const char *) = NULL;
+        envp = (const char * const *)nenv->elts;
+    }
+    apr_tokenize_to_argv(helper->cmdline, (char***)&argv, helper->p);
+    
+    helper->proc = apr_pcalloc(helper->p, sizeof(*helper->proc));
+    if (   APR_SUCCESS == (rv = apr_procattr_create(&procattr, helper->p))
+        && APR_SUCCESS == (rv = apr_procattr_io_set(procattr, APR_FULL_BLOCK, 
+                                                    APR_FULL_BLOCK, APR_NO_PIPE))
+        && APR_SUCCESS == (rv = apr_procattr_cmdtype_set(procattr, APR_PROGRAM))
+        && APR_SUCCESS == (rv = apr_proc_create(helper->proc, argv[0], argv, envp, 
+                                                procattr, helper->p))) {
+        apr_pool_note_subprocess(helper->p, helper->proc, APR_KILL_AFTER_TIMEOUT);
+        rv = apr_file_pipe_timeout_set(helper->proc->out, helper_timeout);
+    }
+    md_log_perror(MD_LOG_MARK, rv? MD_LOG_ERR : MD_LOG_DEBUG, rv, helper->p, 
+                  "helper(%s): starting", helper->cmdline);
+    if (APR_SUCCESS != rv) {
+        helper->proc = NULL;
+        helper_stop(helper);
+    }
+    return rv;
+}
+
+static apr_status_t helper_send(const char **presponse, md_helper_t *helper, 
+                                const char *request, apr_pool_t *p)
+{
+    char buffer[MD_HELPER_LINE_MAX];
+    const char *line;
+    apr_size_t len;
+    apr_status_t rv;
+    
+    *presponse = NULL;
+    line = apr_pstrcat(p, request, "\n", NULL);
+    if (APR_SUCCESS != (rv = apr_file_write_full(helper->proc->in, line, strlen(line), NULL))
+        || APR_SUCCESS != (rv = apr_file_flush(helper->proc->in))
+        || APR_SUCCESS != (rv = apr_file_gets(buffer, sizeof(buffer), helper->proc->out))) {
+        return rv;
+    }
+    len = strlen(buffer);
+    if (!len || buffer[len-1] != '\n') {
+        /* Not a complete line: either it did not fit or the helper went away
+         * in the middle. The rest of it would be taken as the next answer. */
+        rv = (len + 1 >= sizeof(buffer))? APR_ENOSPC : APR_EOF;
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "helper(%s): incomplete "
+                      "answer to '%s'", helper->cmdline, request);
+        return rv;
+    }
+    while (len > 0 && apr_isspace(buffer[len-1])) {
+        buffer[--len] = '\0';
+    }
+    if (!strncmp("ok", buffer, 2) && (!buffer[2] || apr_isspace(buffer[2]))) {
+        rv = APR_SUCCESS;
+        line = buffer + 2;
+    }
+    else if (!strncmp("error", buffer, 5) && (!buffer[5] || apr_isspace(buffer[5]))) {
+        rv = APR_EGENERAL;
+        line = buffer + 5;
+    }
+    else {
+        return APR_EINVAL;
+    }
+    while (apr_isspace(*line)) ++line;
+    *presponse = apr_pstrdup(p, line);
+    return rv;
+}
+
+apr_status_t md_helper_call(const char **presponse, const char *cmdline, 
+                            apr_array_header_t *env, const char *request, apr_pool_t *p)
+{
+    md_helper_t *helper;
+    apr_status_t rv;
+    int fresh = 0;
+    
+    *presponse = NULL;
+    if (!(helper = helper_get(cmdline))) return APR_ENOTIMPL;
+    
+    helper_lock(helper);
+    if (!helper->proc) {
+        if (APR_SUCCESS != (rv = helper_start(helper, env))) goto leave;
+        fresh = 1;
+    }
+    rv = helper_send(presponse, helper, request, p);
+    if (APR_SUCCESS != rv && APR_EGENERAL != rv && APR_ENOSPC != rv && !fresh) {
+        /* It may have died since its last request. Give a new one a chance.
+         * An answer too long for us would be the same the next time. */
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, "helper(%s): no answer, restarting", 
+                      cmdline);
+        helper_stop(helper);
+        if (APR_SUCCESS != (rv = helper_start(helper, env))) goto leave;
+        rv = helper_send(presponse, helper, request, p);
+    }
+    if (APR_SUCCESS != rv && APR_EGENERAL != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "helper(%s): request '%s' "
+                      "failed, stopping it", cmdline, request);
+        helper_stop(helper);
+    }
+leave:
+    helper_unlock(helper);
+    return rv;
+}
+
+void md_helper_stop_all(void)
+{
+    apr_hash_index_t *hi;
+    md_helper_t *helper;
+    
+    if (!helpers) return;
+    helpers_lock();
+    for (hi = apr_hash_first(NULL, helpers); hi; hi = apr_hash_next(hi)) {
+        helper = apr_hash_this_val(hi);
+        helper_lock(helper);
+        helper_stop(helper);
+        helper_unlock(helper);
+    }
+    helpers_unlock();
+}
@@ -0,0 +1,66 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef md_helper_h
+#define md_helper_h
+
+/**
+ * A helper is a long running process that we send requests to, one line
+ * on its stdin, and that answers each with one line on its stdout:
+ * "ok [text]" on success or "error [text]" on failure. Its stderr is ours.
+ * 
+ * A helper is started on first use and kept for all later requests with
+ * the same command line. When it dies or does not answer in time, it is 
+ * stopped and started again for the next request. A helper should exit
+ * when its stdin is closed.
+ * 
+ * The pipes carry one exchange at a time, so calls to the same helper are
+ * serialized: a caller waits while another one's request is answered, for
+ * up to MD_HELPER_TIMEOUT.
+ */
+
+/* How long we wait for an answer, e.g. for DNS records to propagate */
+#define MD_HELPER_TIMEOUT       apr_time_from_sec(10 * 60)
+/* Longest answer line we accept, including the newline */
+#define MD_HELPER_LINE_MAX      8192
+
+/**
+ * Global init, call once at start up.
+ */
+void md_helper_init(void);
+
+/**
+ * Send the request line to the helper for cmdline, starting it with the 
+ * environment variables in env ("NAME=value") if it is not running. 
+ * On return, *presponse has the text of its answer, if any. An answer
+ * longer than MD_HELPER_LINE_MAX fails with APR_ENOSPC and stops the helper.
+ */
+apr_status_t md_helper_call(const char **presponse, const char *cmdline, 
+                            struct apr_array_header_t *env, const char *request, 
+                            apr_pool_t *p);
+
+/**
+ * Set how long we wait for an answer from helpers started from now on,
+ * MD_HELPER_TIMEOUT by default.
+ */
+void md_helper_set_timeout(apr_time_t timeout);
+
+/**
+ * Stop all running helpers, e.g. when the watchdog that uses them stops.
+ */
+void md_helper_stop_all(void);
+
+#endif /* md_helper_h */
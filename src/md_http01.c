@@ -0,0 +1,230 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_atomic.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_shm.h>
+#include <apr_thread_mutex.h>
+
+#include "md_log.h"
+#include "md_http01.h"
+
+#define SLOT_HOST_MAX       256
+#define SLOT_TOKEN_MAX      128
+#define SLOT_CONTENT_MAX    256
+
+#define SLOT_FREE           0
+#define SLOT_USED           1
+#define SLOT_REMOVED        2     /* free, but keeps later slots reachable */
+
+/* A challenge in shared memory. Only the renewal driver writes, readers detect
+ * concurrent writes by the sequence number, which is odd during an update. */
+typedef struct {
+    volatile apr_uint32_t seq;
+    int state;
+    char host[SLOT_HOST_MAX];
+    char token[SLOT_TOKEN_MAX];
+    char content[SLOT_CONTENT_MAX];
+} http01_slot_t;
+
+static apr_shm_t *table_shm;
+static http01_slot_t *table_slots;
+static apr_size_t table_nslots;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *table_mutex; /* serializes writers, readers never lock */
+#endif
+
+static apr_status_t table_cleanup(void *data)
+{
+    (void)data;
+    table_shm = NULL;
+    table_slots = NULL;
+    table_nslots = 0;
+#if APR_HAS_THREADS
+    table_mutex = NULL;
+#endif
+    return APR_SUCCESS;
+}
+
+apr_status_t md_http01_shm_init(int nhosts, apr_pool_t *p)
+{
+    apr_size_t size;
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (table_shm || nhosts <= 0) goto leave;
+    
+    /* leave room, so probing for a host stays short */
+    table_nslots = (apr_size_t)nhosts * 2;
+    size = table_nslots * sizeof(http01_slot_t);
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&table_mutex, APR_THREAD_MUTEX_DEFAULT, p))) {
+        goto leave;
+    }
+#endif
+    if (APR_SUCCESS != (rv = apr_shm_create(&table_shm, size, NULL, p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "unable to create shared memory for %d http-01 challenges, "
+                      "child processes will read them from the store", nhosts);
+        table_cleanup(NULL);
+        goto leave;
+    }
+    table_slots = apr_shm_baseaddr_get(table_shm);
+    memset(table_slots, 0, size);
+    apr_pool_cleanup_register(p, NULL, table_cleanup, apr_pool_cleanup_null);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                  "http-01 challenges of %d hosts in shared memory (%ld bytes)", 
+                  nhosts, (long)size);
+leave:
+    return rv;
+}
+
+static apr_uint32_t slot_seq(http01_slot_t *slot)
+{
+    /* A compare-and-swap that never changes the value, but gives us a full
+     * memory barrier around the read. */
+    return apr_atomic_cas32(&slot->seq, 0, 0);
+}
+
+static int host_lower(char *buf, const char *host)
+{
+    apr_size_t i;
+    
+    for (i = 0; host[i]; ++i) {
+        if (i + 1 >= SLOT_HOST_MAX) return 0;
+        buf[i] = (char)apr_tolower(host[i]);
+    }
+    buf[i] = '\0';
+    return 1;
+}
+
+static apr_size_t host_index(const char *lhost)
+{
+    apr_ssize_t klen = APR_HASH_KEY_STRING;
+    return apr_hashfunc_default(lhost, &klen) % table_nslots;
+}
+
+/* Find the slot used for the host. Must only be called by writers. */
+static http01_slot_t *slot_find(const char *lhost, http01_slot_t **pfree)
+{
+    http01_slot_t *slot;
+    apr_size_t i, n;
+    
+    if (pfree) *pfree = NULL;
+    for (i = host_index(lhost), n = 0; n < table_nslots; ++n, i = (i + 1) % table_nslots) {
+        slot = &table_slots[i];
+        if (SLOT_FREE == slot->state) {
+            if (pfree && !*pfree) *pfree = slot;
+            break;
+        }
+        if (SLOT_REMOVED == slot->state) {
+            if (pfree && !*pfree) *pfree = slot;
+            continue;
+        }
+        if (!strcmp(lhost, slot->host)) return slot;
+    }
+    return NULL;
+}
+
+static void slot_write(http01_slot_t *slot, int state, const char *lhost, 
+                       const char *token, const char *content)
+{
+    apr_atomic_inc32(&slot->seq);
+    slot->state = state;
+    apr_cpystrn(slot->host, lhost, sizeof(slot->host));
+    apr_cpystrn(slot->token, token, sizeof(slot->token));
+    apr_cpystrn(slot->content, content, sizeof(slot->content));
+    apr_atomic_inc32(&slot->seq);
+}
+
+void md_http01_publish(const char *host, const char *token, const char *content)
+{
+    char lhost[SLOT_HOST_MAX];
+    http01_slot_t *slot, *free_slot;
+    
+    if (!table_slots) return;
+    if (!host_lower(lhost, host)
+        || strlen(token) >= SLOT_TOKEN_MAX || strlen(content) >= SLOT_CONTENT_MAX) {
+        /* not for us, answered from the store */
+        md_http01_withdraw(host);
+        return;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(table_mutex);
+#endif
+    if ((slot = slot_find(lhost, &free_slot)) || (slot = free_slot)) {
+        slot_write(slot, SLOT_USED, lhost, token, content);
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(table_mutex);
+#endif
+}
+
+void md_http01_withdraw(const char *host)
+{
+    char lhost[SLOT_HOST_MAX];
+    http01_slot_t *slot;
+    
+    if (!table_slots || !host_lower(lhost, host)) return;
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(table_mutex);
+#endif
+    if ((slot = slot_find(lhost, NULL))) {
+        slot_write(slot, SLOT_REMOVED, "", "", "");
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(table_mutex);
+#endif
+}
+
+apr_status_t md_http01_get(const char **pcontent, const char *host, const char *token,
+                           apr_pool_t *p)
+{
+    char lhost[SLOT_HOST_MAX];
+    http01_slot_t *slot, copy;
+    apr_uint32_t seq;
+    apr_size_t i, n;
+    int tries;
+    
+    *pcontent = NULL;
+    if (!table_slots) return APR_ENOTIMPL;
+    if (!host_lower(lhost, host)) return APR_ENOENT;
+    
+    for (i = host_index(lhost), n = 0; n < table_nslots; ++n, i = (i + 1) % table_nslots) {
+        slot = &table_slots[i];
+        for (tries = 0; tries < 100; ++tries) {
+            seq = slot_seq(slot);
+            if (seq & 1) continue; /* update in progress */
+            memcpy(&copy, slot, sizeof(copy));
+            if (slot_seq(slot) == seq) break;
+        }
+        if (tries >= 100) return APR_EAGAIN;
+        
+        copy.host[SLOT_HOST_MAX-1] = copy.token[SLOT_TOKEN_MAX-1] = '\0';
+        copy.content[SLOT_CONTENT_MAX-1] = '\0';
+        if (SLOT_FREE == copy.state) break;
+        if (SLOT_USED == copy.state && !strcmp(lhost, copy.host)) {
+            if (strcmp(token, copy.token)) break;
+            *pcontent = apr_pstrdup(p, copy.content);
+            return APR_SUCCESS;
+        }
+    }
+    return APR_ENOENT;
+}
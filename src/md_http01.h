@@ -0,0 +1,55 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef md_http01_h
+#define md_http01_h
+
+/**
+ * A table of the http-01 challenges currently set up, in shared memory. The 
+ * renewal driver publishes a challenge here after it has been written to the 
+ * store, so child processes can answer validation requests without reading
+ * the store. The store remains the source of truth: a challenge not found here 
+ * may still be there.
+ *
+ * There is at most one challenge per host name. Without a table, e.g. in a2md 
+ * or when no shared memory could be created, all functions do nothing.
+ */
+
+/**
+ * Create the table in shared memory for up to nhosts host names. Call in the 
+ * parent process before the children are created. The table lives as long as p.
+ */
+apr_status_t md_http01_shm_init(int nhosts, apr_pool_t *p);
+
+/**
+ * Make the challenge content for the host name available under token, 
+ * replacing any previous one for this host.
+ */
+void md_http01_publish(const char *host, const char *token, const char *content);
+
+/**
+ * Remove the challenge for the host name from the table.
+ */
+void md_http01_withdraw(const char *host);
+
+/**
+ * Get the challenge content for the host name and token. Returns APR_ENOENT if
+ * the table has none and APR_ENOTIMPL if there is no table.
+ */
+apr_status_t md_http01_get(const char **pcontent, const char *host, const char *token,
+                           apr_pool_t *p);
+
+#endif /* md_http01_h */
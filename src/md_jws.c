@@ -25,86 +25,170 @@
 #include "md_log.h"
 #include "md_util.h"
 
-static int header_set(void *data, const char *key, const char *val)
+struct md_jws_ctx_t {
+    struct md_pkey_t *pkey;
+    const char *key_id;
+    const char *prot_start;         /* protected header without the per message fields */
+    const char *thumb64;            /* JWK thumbprint of pkey */
+    md_signer_t *signer;
+};
+
+static const char *jws_str(apr_pool_t *p, const char *s)
 {
-    md_json_sets(val, (md_json_t *)data, key, NULL);
-    return 1;
+    apr_array_header_t *parts;
+    const char *c;
+    
+    for (c = s; *c; ++c) {
+        if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) break;
+    }
+    if (!*c) return apr_pstrcat(p, "\"", s, "\"", NULL);
+    
+    parts = apr_array_make(p, 10, sizeof(const char*));
+    APR_ARRAY_PUSH(parts, const char*) = "\"";
+    for (c = s; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            APR_ARRAY_PUSH(parts, const char*) = apr_psprintf(p, "\\%c", *c);
+        }
+        else if ((unsigned char)*c < 0x20) {
+            APR_ARRAY_PUSH(parts, const char*) = apr_psprintf(p, "\\u%04x", *c);
+        }
+        else {
+            APR_ARRAY_PUSH(parts, const char*) = apr_pstrndup(p, c, 1);
+        }
+    }
+    APR_ARRAY_PUSH(parts, const char*) = "\"";
+    return apr_array_pstrcat(p, parts, 0);
 }
 
-apr_status_t md_jws_sign(md_json_t **pmsg, apr_pool_t *p,
-                         md_data_t *payload, struct apr_table_t *protected, 
-                         struct md_pkey_t *pkey, const char *key_id)
+static const char *jwk_get(apr_pool_t *p, struct md_pkey_t *pkey)
 {
-    md_json_t *msg, *jprotected;
-    const char *prot64, *pay64, *sign64, *sign, *prot;
-    apr_status_t rv = APR_SUCCESS;
-    md_data_t data;
-
-    *pmsg = NULL;
+    const char *e64, *n64;
     
-    msg = md_json_create(p);
+    e64 = md_pkey_get_rsa_e64(pkey, p);
+    n64 = md_pkey_get_rsa_n64(pkey, p);
+    if (!e64 || !n64) return NULL;
+    /* whitespace and order is relevant, since we hand out a digest of this */
+    return apr_psprintf(p, "{\"e\":\"%s\",\"kty\":\"RSA\",\"n\":\"%s\"}", e64, n64);
+}
 
-    jprotected = md_json_create(p);
-    md_json_sets("RS256", jprotected, "alg", NULL);
-    if (key_id) {
-        md_json_sets(key_id, jprotected, "kid", NULL);
-    }
-    else {
-        md_json_sets(md_pkey_get_rsa_e64(pkey, p), jprotected, "jwk", "e", NULL);
-        md_json_sets("RSA", jprotected, "jwk", "kty", NULL);
-        md_json_sets(md_pkey_get_rsa_n64(pkey, p), jprotected, "jwk", "n", NULL);
+apr_status_t md_jws_ctx_create(md_jws_ctx_t **pctx, apr_pool_t *p, 
+                               struct md_pkey_t *pkey, const char *key_id)
+{
+    md_jws_ctx_t *ctx;
+    const char *jwk;
+    md_data_t data;
+    apr_status_t rv;
+    
+    *pctx = NULL;
+    if (!(jwk = jwk_get(p, pkey))) return APR_EINVAL;
+    
+    ctx = apr_pcalloc(p, sizeof(*ctx));
+    ctx->pkey = pkey;
+    ctx->key_id = key_id? apr_pstrdup(p, key_id) : NULL;
+    ctx->prot_start = apr_pstrcat(p, "{\"alg\":\"RS256\",", 
+                                  key_id? "\"kid\":" : "\"jwk\":", 
+                                  key_id? jws_str(p, key_id) : jwk, NULL);
+    MD_DATA_SET_STR(&data, jwk);
+    if (APR_SUCCESS != (rv = md_crypt_sha256_digest64(&ctx->thumb64, p, &data))
+        || APR_SUCCESS != (rv = md_crypt_signer_create(&ctx->signer, pkey, p))) {
+        return rv;
     }
-    apr_table_do(header_set, jprotected, protected, NULL);
-    prot = md_json_writep(jprotected, p, MD_JSON_FMT_COMPACT);
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, p, "protected: %s",
-                  prot ? prot : "<failed to serialize!>");
+    *pctx = ctx;
+    return APR_SUCCESS;
+}
 
-    if (!prot) {
-        rv = APR_EINVAL;
-    }
+int md_jws_ctx_is_for(const md_jws_ctx_t *ctx, const struct md_pkey_t *pkey, 
+                      const char *key_id)
+{
+    if (ctx->pkey != pkey) return 0;
+    if (!key_id || !ctx->key_id) return key_id == ctx->key_id;
+    return !strcmp(key_id, ctx->key_id);
+}
+
+const char *md_jws_ctx_thumb(const md_jws_ctx_t *ctx)
+{
+    return ctx->thumb64;
+}
+
+typedef struct {
+    apr_pool_t *p;
+    apr_array_header_t *parts;
+} header_ctx;
+
+static int header_add(void *data, const char *key, const char *val)
+{
+    header_ctx *ctx = data;
     
-    if (rv == APR_SUCCESS) {
-        data.data = prot;
-        data.len = strlen(prot);
-        prot64 = md_util_base64url_encode(&data, p);
-        md_json_sets(prot64, msg, "protected", NULL);
-        pay64 = md_util_base64url_encode(payload, p);
+    APR_ARRAY_PUSH(ctx->parts, const char*) = ",";
+    APR_ARRAY_PUSH(ctx->parts, const char*) = jws_str(ctx->p, key);
+    APR_ARRAY_PUSH(ctx->parts, const char*) = ":";
+    APR_ARRAY_PUSH(ctx->parts, const char*) = jws_str(ctx->p, val);
+    return 1;
+}
 
-        md_json_sets(pay64, msg, "payload", NULL);
-        sign = apr_psprintf(p, "%s.%s", prot64, pay64);
+apr_status_t md_jws_ctx_sign(md_json_t **pmsg, md_jws_ctx_t *ctx, apr_pool_t *p,
+                             struct md_data_t *payload, struct apr_table_t *protected)
+{
+    md_json_t *msg;
+    const char *prot64, *pay64, *sign64, *sign, *prot;
+    header_ctx hctx;
+    md_data_t data;
+    apr_status_t rv;
 
-        rv = md_crypt_sign64(&sign64, pkey, p, sign, strlen(sign));
-    }
+    *pmsg = NULL;
+    
+    hctx.p = p;
+    hctx.parts = apr_array_make(p, 10, sizeof(const char*));
+    APR_ARRAY_PUSH(hctx.parts, const char*) = ctx->prot_start;
+    if (protected) apr_table_do(header_add, &hctx, protected, NULL);
+    APR_ARRAY_PUSH(hctx.parts, const char*) = "}";
+    prot = apr_array_pstrcat(p, hctx.parts, 0);
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, p, "protected: %s", prot);
 
+    MD_DATA_SET_STR(&data, prot);
+    prot64 = md_util_base64url_encode(&data, p);
+    pay64 = md_util_base64url_encode(payload, p);
+    sign = apr_psprintf(p, "%s.%s", prot64, pay64);
+    
+    rv = md_crypt_signer_sign64(&sign64, ctx->signer, p, sign, strlen(sign));
     if (rv == APR_SUCCESS) {
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, 
                       "jws pay64=%s\nprot64=%s\nsign64=%s", pay64, prot64, sign64);
-        
+        msg = md_json_create(p);
+        md_json_sets(prot64, msg, "protected", NULL);
+        md_json_sets(pay64, msg, "payload", NULL);
         md_json_sets(sign64, msg, "signature", NULL);
+        *pmsg = msg;
     }
     else {
         md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "jwk signed message");
     } 
-    
-    *pmsg = (APR_SUCCESS == rv)? msg : NULL;
     return rv;
 }
 
+apr_status_t md_jws_sign(md_json_t **pmsg, apr_pool_t *p,
+                         md_data_t *payload, struct apr_table_t *protected, 
+                         struct md_pkey_t *pkey, const char *key_id)
+{
+    md_jws_ctx_t *ctx;
+    apr_status_t rv;
+    
+    *pmsg = NULL;
+    if (APR_SUCCESS != (rv = md_jws_ctx_create(&ctx, p, pkey, key_id))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "jwk signed message");
+        return rv;
+    }
+    return md_jws_ctx_sign(pmsg, ctx, p, payload, protected);
+}
+
 apr_status_t md_jws_pkey_thumb(const char **pthumb, apr_pool_t *p, struct md_pkey_t *pkey)
 {
-    const char *e64, *n64, *s;
+    const char *s;
     md_data_t data;
-    apr_status_t rv;
     
-    e64 = md_pkey_get_rsa_e64(pkey, p);
-    n64 = md_pkey_get_rsa_n64(pkey, p);
-    if (!e64 || !n64) {
+    if (!(s = jwk_get(p, pkey))) {
         return APR_EINVAL;
     }
-
-    /* whitespace and order is relevant, since we hand out a digest of this */
-    s = apr_psprintf(p, "{\"e\":\"%s\",\"kty\":\"RSA\",\"n\":\"%s\"}", e64, n64);
     MD_DATA_SET_STR(&data, s);
-    rv = md_crypt_sha256_digest64(pthumb, p, &data);
-    return rv;
+    return md_crypt_sha256_digest64(pthumb, p, &data);
 }
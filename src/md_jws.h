@@ -22,6 +22,34 @@ struct md_json_t;
 struct md_pkey_t;
 struct md_data_t;
 
+typedef struct md_jws_ctx_t md_jws_ctx_t;
+
+/**
+ * Create a context for signing messages with pkey. With a key_id, the protected
+ * header carries it as "kid", otherwise it carries the public key as "jwk".
+ * The fixed part of the header, the key's thumbprint and the signing setup are
+ * all done here once. The context lives as long as the pool.
+ */
+apr_status_t md_jws_ctx_create(md_jws_ctx_t **pctx, apr_pool_t *p, 
+                               struct md_pkey_t *pkey, const char *key_id);
+
+/**
+ * Return != 0 iff the context signs with pkey and uses key_id.
+ */
+int md_jws_ctx_is_for(const md_jws_ctx_t *ctx, const struct md_pkey_t *pkey, 
+                      const char *key_id);
+
+/**
+ * Sign the payload, adding the protected headers to the fixed ones of the context.
+ */
+apr_status_t md_jws_ctx_sign(md_json_t **pmsg, md_jws_ctx_t *ctx, apr_pool_t *p,
+                             struct md_data_t *payload, struct apr_table_t *protected);
+
+/**
+ * The base64url encoded JWK thumbprint of the context's key.
+ */
+const char *md_jws_ctx_thumb(const md_jws_ctx_t *ctx);
+
 apr_status_t md_jws_sign(md_json_t **pmsg, apr_pool_t *p,
                          struct md_data_t *payload, struct apr_table_t *protected, 
                          struct md_pkey_t *pkey, const char *key_id);
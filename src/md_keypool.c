@@ -0,0 +1,216 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_strings.h>
+#include <apr_file_io.h>
+#include <apr_tables.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_log.h"
+#include "md_store.h"
+#include "md_util.h"
+#include "md_keypool.h"
+
+#define KEYPOOL_PATTERN         "key-*.pem"
+
+const char *md_keypool_name(const md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    if (!spec) {
+        return apr_psprintf(p, "rsa%d", MD_PKEY_RSA_BITS_DEF);
+    }
+    switch (spec->type) {
+        case MD_PKEY_TYPE_DEFAULT:
+            return apr_psprintf(p, "rsa%d", MD_PKEY_RSA_BITS_DEF);
+        case MD_PKEY_TYPE_RSA:
+            return apr_psprintf(p, "rsa%u", (unsigned int)spec->params.rsa.bits);
+        case MD_PKEY_TYPE_EC:
+            return spec->params.ec.curve;
+    }
+    return "unknown";
+}
+
+static apr_status_t collect_key(void *baton, apr_pool_t *p, apr_pool_t *ptemp,
+                                const char *dir, const char *name, apr_filetype_e ftype)
+{
+    apr_array_header_t *fnames = baton;
+
+    (void)ptemp;
+    (void)dir;
+    if (APR_REG == ftype) {
+        APR_ARRAY_PUSH(fnames, const char*) = apr_pstrdup(p, name);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t keys_get(apr_array_header_t **pfnames, md_store_t *store,
+                             const char *name, apr_pool_t *p)
+{
+    apr_array_header_t *fnames;
+    const char *dir;
+    apr_status_t rv;
+
+    fnames = apr_array_make(p, 5, sizeof(const char*));
+    rv = md_store_get_fname(&dir, store, MD_SG_KEYS, name, NULL, p);
+    if (APR_SUCCESS == rv) {
+        rv = md_util_files_do(collect_key, fnames, p, dir, KEYPOOL_PATTERN, NULL);
+        if (APR_STATUS_IS_ENOENT(rv)) rv = APR_SUCCESS;
+    }
+    *pfnames = fnames;
+    return rv;
+}
+
+static apr_status_t take_pooled(md_pkey_t **ppkey, md_store_t *store,
+                                const char *name, apr_pool_t *p)
+{
+    apr_array_header_t *fnames;
+    const char *fname, *fpath, *taken, *tpath;
+    apr_status_t rv;
+    int i;
+
+    *ppkey = NULL;
+    if (APR_SUCCESS != (rv = keys_get(&fnames, store, name, p))) goto leave;
+
+    rv = APR_ENOENT;
+    for (i = 0; i < fnames->nelts && !*ppkey; ++i) {
+        fname = APR_ARRAY_IDX(fnames, i, const char*);
+        taken = apr_pstrcat(p, fname, ".taken", NULL);
+        if (APR_SUCCESS != md_store_get_fname(&fpath, store, MD_SG_KEYS, name, fname, p)
+            || APR_SUCCESS != md_store_get_fname(&tpath, store, MD_SG_KEYS, name, taken, p)) {
+            continue;
+        }
+        /* Whoever renames the file first, gets the key */
+        if (APR_SUCCESS != apr_file_rename(fpath, tpath, p)) continue;
+
+        rv = md_store_load(store, MD_SG_KEYS, name, taken, MD_SV_PKEY, (void**)ppkey, p);
+        md_store_remove(store, MD_SG_KEYS, name, taken, p, 1);
+        if (APR_SUCCESS != rv) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p,
+                          "keypool %s: unable to load %s, discarded", name, fname);
+            *ppkey = NULL;
+        }
+    }
+leave:
+    return rv;
+}
+
+apr_status_t md_keypool_take(md_pkey_t **ppkey, md_store_t *store,
+                             md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    const char *name = md_keypool_name(spec, p);
+    apr_status_t rv;
+
+    if (store && APR_SUCCESS == (rv = take_pooled(ppkey, store, name, p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "keypool %s: took key", name);
+        return rv;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "keypool %s: empty, generating key", name);
+    return md_pkey_gen(ppkey, p, spec);
+}
+
+int md_keypool_count(md_store_t *store, const md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    apr_array_header_t *fnames;
+
+    if (APR_SUCCESS != keys_get(&fnames, store, md_keypool_name(spec, p), p)) return 0;
+    return fnames->nelts;
+}
+
+apr_status_t md_keypool_add(md_store_t *store, md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    const char *name, *fname;
+    md_pkey_t *pkey;
+    md_json_t *json;
+    apr_time_t start;
+    long ms;
+    apr_status_t rv;
+
+    name = md_keypool_name(spec, p);
+    start = apr_time_now();
+    if (APR_SUCCESS != (rv = md_pkey_gen(&pkey, p, spec))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "keypool %s: generating key", name);
+        goto leave;
+    }
+    ms = (long)apr_time_as_msec(apr_time_now() - start);
+
+    fname = apr_psprintf(p, "key-%" APR_TIME_T_FMT ".pem", apr_time_now());
+    rv = md_store_save(store, p, MD_SG_KEYS, name, fname, MD_SV_PKEY, pkey, 1);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "keypool %s: saving key", name);
+        goto leave;
+    }
+
+    /* Only the single generating thread writes these */
+    if (APR_SUCCESS != md_store_load_json(store, MD_SG_KEYS, name, MD_FN_KEYPOOL, &json, p)) {
+        json = md_json_create(p);
+    }
+    md_json_setl(md_json_getl(json, MD_KEY_GENERATED, NULL) + 1, json, MD_KEY_GENERATED, NULL);
+    md_json_setl(ms, json, MD_KEY_GEN_MS_LAST, NULL);
+    md_json_setl(md_json_getl(json, MD_KEY_GEN_MS_TOTAL, NULL) + ms,
+                 json, MD_KEY_GEN_MS_TOTAL, NULL);
+    md_store_save_json(store, p, MD_SG_KEYS, name, MD_FN_KEYPOOL, json, 0);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p,
+                  "keypool %s: added key, generated in %ld ms", name, ms);
+leave:
+    return rv;
+}
+
+typedef struct {
+    md_store_t *store;
+    md_json_t *json;
+} status_ctx;
+
+static apr_status_t add_pool_status(void *baton, apr_pool_t *p, apr_pool_t *ptemp,
+                                    const char *dir, const char *name, apr_filetype_e ftype)
+{
+    status_ctx *ctx = baton;
+    apr_array_header_t *fnames;
+    md_json_t *json;
+
+    (void)dir;
+    if (APR_DIR != ftype) return APR_SUCCESS;
+    if (APR_SUCCESS != md_store_load_json(ctx->store, MD_SG_KEYS, name, MD_FN_KEYPOOL,
+                                          &json, p)) {
+        json = md_json_create(p);
+    }
+    if (APR_SUCCESS == keys_get(&fnames, ctx->store, name, ptemp)) {
+        md_json_setl(fnames->nelts, json, MD_KEY_AVAILABLE, NULL);
+    }
+    md_json_setj(json, ctx->json, name, NULL);
+    return APR_SUCCESS;
+}
+
+apr_status_t md_keypool_status_json(md_json_t **pjson, md_store_t *store, apr_pool_t *p)
+{
+    status_ctx ctx;
+    const char *dir;
+    apr_status_t rv;
+
+    ctx.store = store;
+    ctx.json = md_json_create(p);
+    rv = md_store_get_fname(&dir, store, MD_SG_KEYS, NULL, NULL, p);
+    if (APR_SUCCESS == rv) {
+        rv = md_util_files_do(add_pool_status, &ctx, p, dir, "*", NULL);
+        if (APR_STATUS_IS_ENOENT(rv)) rv = APR_SUCCESS;
+    }
+    *pjson = ctx.json;
+    return rv;
+}
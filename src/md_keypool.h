@@ -0,0 +1,67 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef md_keypool_h
+#define md_keypool_h
+
+struct md_json_t;
+struct md_pkey_t;
+struct md_pkey_spec_t;
+struct md_store_t;
+
+/**
+ * A pool of private keys, generated ahead of time, kept in the store group
+ * MD_SG_KEYS. There is one directory per key spec, each key is a separate
+ * file. Keys are taken by renaming their file, so several processes and
+ * threads may take keys without getting the same one.
+ */
+
+#define MD_FN_KEYPOOL           "keypool.json"
+
+#define MD_KEYPOOL_DEPTH_DEF    0
+
+/**
+ * The name of the pool for keys of the given spec, e.g. "rsa2048" or "secp384r1".
+ */
+const char *md_keypool_name(const struct md_pkey_spec_t *spec, apr_pool_t *p);
+
+/**
+ * Take a key from the pool. If the pool has none, generate one.
+ */
+apr_status_t md_keypool_take(struct md_pkey_t **ppkey, struct md_store_t *store,
+                             struct md_pkey_spec_t *spec, apr_pool_t *p);
+
+/**
+ * Number of keys the pool holds for the given spec.
+ */
+int md_keypool_count(struct md_store_t *store, const struct md_pkey_spec_t *spec,
+                     apr_pool_t *p);
+
+/**
+ * Generate a new key for the spec and add it to the pool. Records how
+ * long the generation took.
+ */
+apr_status_t md_keypool_add(struct md_store_t *store, struct md_pkey_spec_t *spec,
+                            apr_pool_t *p);
+
+/**
+ * Get a JSON object with a member for each pool in the store: the number of
+ * keys available, the number generated and the generation times.
+ */
+apr_status_t md_keypool_status_json(struct md_json_t **pjson, struct md_store_t *store,
+                                    apr_pool_t *p);
+
+#endif /* md_keypool_h */
@@ -19,10 +19,12 @@
 #include <stdlib.h>
 
 #include <apr_lib.h>
+#include <apr_atomic.h>
 #include <apr_buckets.h>
 #include <apr_hash.h>
 #include <apr_time.h>
 #include <apr_date.h>
+#include <apr_shm.h>
 #include <apr_strings.h>
 #include <apr_thread_mutex.h>
 
@@ -53,17 +55,65 @@
 #include "md_ocsp.h"
 
 #define MD_OCSP_ID_LENGTH   SHA_DIGEST_LENGTH
-   
+
+/* How long a replaced response snapshot is kept around before its memory
+ * is reclaimed. A reader needs to pick up a snapshot and increment its
+ * reference count within that time. */
+#define MD_OCSP_RESP_GRACE  (apr_time_from_sec(60))
+
+/* When a responder reports our response as not modified, but does not tell
+ * how long it stays fresh, ask again after this time. */
+#define MD_OCSP_NOT_MODIFIED_DELAY  (apr_time_from_sec(60 * 60))
+
+/* An immutable copy of an OCSP response as known at a point in time. 
+ * Readers on the handshake path get the current one via an atomic pointer
+ * load and hold a reference while copying the DER bytes. Writers create
+ * a new snapshot and swap it in, retiring the old one. */
+typedef struct md_ocsp_resp_t md_ocsp_resp_t;
+struct md_ocsp_resp_t {
+    volatile apr_uint32_t refs;   /* readers currently using this snapshot */
+    md_ocsp_cert_stat_t stat;
+    md_data_t der;
+    md_timeperiod_t valid;
+    apr_time_t retired;           /* when this snapshot was replaced */
+    md_ocsp_resp_t *next;         /* next in list of retired snapshots */
+};
+
+/* Max length of a DER response that fits into a shared memory slot. Larger
+ * responses are served from the per process copy. It is read from the store
+ * only when the slot's sequence shows that the watchdog has a new one. */
+#define MD_OCSP_SHM_DER_MAX (4 * 1024)
+
+/* A response as kept in shared memory, visible to all child processes. There
+ * is only one writer, the OCSP watchdog, see ostat_set(). Readers detect
+ * concurrent writes by the sequence number, which is odd while an update is
+ * in progress. */
+typedef struct md_ocsp_shm_slot_t md_ocsp_shm_slot_t;
+struct md_ocsp_shm_slot_t {
+    volatile apr_uint32_t seq;
+    md_ocsp_cert_stat_t stat;
+    md_timeperiod_t valid;
+    int oversize;                 /* last response did not fit */
+    apr_size_t len;               /* length of der, 0 if no response known */
+    char der[MD_OCSP_SHM_DER_MAX];
+};
+
 struct md_ocsp_reg_t {
     apr_pool_t *p;
     md_store_t *store;
     const char *user_agent;
     const char *proxy_url;
     apr_hash_t *hash;
-    apr_thread_mutex_t *mutex;
+    apr_thread_mutex_t *mutex;    /* serializes writers, readers never lock */
     md_timeslice_t renew_window;
     md_job_notify_cb *notify;
     void *notify_ctx;
+    md_ocsp_resp_t *retired;      /* replaced snapshots, waiting to be freed */
+    apr_shm_t *shm;               /* shared responses or NULL */
+    md_heap_t *schedule;          /* md_ocsp_status_t ordered by next_run */
+    int batch_size;               /* max number of certificates in one OCSP request */
+    int use_get;                  /* make cacheable GET requests (RFC 5019) if possible */
+    int max_parallel;             /* max number of requests open at the same time */
 };
 
 typedef struct md_ocsp_status_t md_ocsp_status_t; 
@@ -76,17 +126,19 @@ struct md_ocsp_status_t {
     
     apr_time_t next_run;      /* when the responder shall be asked again */
     int errors;               /* consecutive failed attempts */
+    int sched_idx;            /* position in reg->schedule, -1 if not in it */
 
-    md_ocsp_cert_stat_t resp_stat;
-    md_data_t resp_der;
-    md_timeperiod_t resp_valid;
+    md_ocsp_resp_t *resp;     /* current response snapshot or NULL, access atomically */
+    md_ocsp_shm_slot_t *slot; /* response in shared memory or NULL */
+    volatile apr_uint32_t slot_seen; /* slot sequence at our last look into the store */
+    char etag[128];           /* validators of the response we fetched via GET, */
+    char last_modified[64];   /* or empty. Only used by the watchdog */
     
-    md_data_t req_der;
-    OCSP_REQUEST *ocsp_req;
     md_ocsp_reg_t *reg;
 
     const char *md_name;
     const char *file_name;
+    apr_array_header_t *x509s;    /* X509* that carry this ostat as ex_data */
     
     apr_time_t resp_mtime;
     apr_time_t resp_last_check;
@@ -108,9 +160,21 @@ md_ocsp_cert_stat_t md_ocsp_cert_stat_value(const char *name)
     return MD_OCSP_CERT_ST_UNKNOWN;
 }
 
-static apr_status_t init_cert_id(md_data_t *data, const md_cert_t *cert)
+/* Index of our md_ocsp_status_t in the ex_data of primed X509 certificates,
+ * so that lookups on the handshake path need no digest or hash lookup. */
+static int ocsp_ex_idx = -1;
+
+static void x509_up_ref(X509 *x)
+{
+#if MD_USE_OPENSSL_PRE_1_1_API
+    CRYPTO_add(&x->references, 1, CRYPTO_LOCK_X509);
+#else
+    X509_up_ref(x);
+#endif
+}
+
+static apr_status_t init_cert_id(md_data_t *data, X509 *x)
 {
-    X509 *x = md_cert_get_X509(cert);
     unsigned int ulen = 0;
     
     assert(data->len == SHA_DIGEST_LENGTH);
@@ -121,16 +185,66 @@ static apr_status_t init_cert_id(md_data_t *data, const md_cert_t *cert)
     return APR_SUCCESS;
 }
 
-static void ostat_req_cleanup(md_ocsp_status_t *ostat)
+static md_ocsp_resp_t *resp_create(md_ocsp_cert_stat_t stat, const md_data_t *der,
+                                   const md_timeperiod_t *valid)
+{
+    md_ocsp_resp_t *resp;
+    
+    resp = OPENSSL_malloc(sizeof(*resp) + der->len);
+    if (!resp) return NULL;
+    memset(resp, 0, sizeof(*resp));
+    resp->stat = stat;
+    resp->valid = *valid;
+    resp->der.data = (const char*)(resp + 1);
+    resp->der.len = der->len;
+    if (der->len) memcpy((char*)resp->der.data, der->data, der->len);
+    return resp;
+}
+
+static void resp_destroy(md_ocsp_resp_t *resp)
 {
-    if (ostat->ocsp_req) {
-        OCSP_REQUEST_free(ostat->ocsp_req);
-        ostat->ocsp_req = NULL;
+    OPENSSL_free(resp);
+}
+
+/* Get the current response snapshot of ostat with a reference held, or NULL.
+ * The snapshot must be given back via resp_release(). Lock free. */
+static md_ocsp_resp_t *resp_acquire(md_ocsp_status_t *ostat)
+{
+    md_ocsp_resp_t *resp;
+    
+    while (1) {
+        resp = apr_atomic_casptr((void*)&ostat->resp, NULL, NULL);
+        if (!resp) break;
+        apr_atomic_inc32(&resp->refs);
+        /* if it is still the current one, it was not retired before we got hold of it */
+        if (resp == apr_atomic_casptr((void*)&ostat->resp, NULL, NULL)) break;
+        apr_atomic_dec32(&resp->refs);
     }
-    if (ostat->req_der.data) {
-        OPENSSL_free((void*)ostat->req_der.data);
-        ostat->req_der.data = NULL;
-        ostat->req_der.len = 0;
+    return resp;
+}
+
+static void resp_release(md_ocsp_resp_t *resp)
+{
+    if (resp) apr_atomic_dec32(&resp->refs);
+}
+
+/* Free retired snapshots that are no longer referenced and have been out of
+ * sight long enough. Call with reg->mutex held or when no readers exist (force). */
+static void resp_reclaim(md_ocsp_reg_t *reg, int force)
+{
+    md_ocsp_resp_t *resp, **pprev;
+    apr_time_t now = apr_time_now();
+    
+    pprev = &reg->retired;
+    while ((resp = *pprev)) {
+        if (force || (!apr_atomic_read32(&resp->refs) 
+                      && (now - resp->retired) >= MD_OCSP_RESP_GRACE)) {
+            *pprev = resp->next;
+            resp_destroy(resp);
+        }
+        else {
+            pprev = &resp->next;
+        }
     }
 }
 
@@ -138,61 +252,164 @@ static int ostat_cleanup(void *ctx, const void *key, apr_ssize_t klen, const voi
 {
     md_ocsp_reg_t *reg = ctx;
     md_ocsp_status_t *ostat = (md_ocsp_status_t *)val;
+    md_ocsp_resp_t *resp;
+    X509 *x;
+    int i;
     
     (void)reg;
     (void)key;
     (void)klen;
-    ostat_req_cleanup(ostat);
+    for (i = 0; i < ostat->x509s->nelts; ++i) {
+        x = APR_ARRAY_IDX(ostat->x509s, i, X509*);
+        X509_set_ex_data(x, ocsp_ex_idx, NULL);
+        X509_free(x);
+    }
+    apr_array_clear(ostat->x509s);
     if (ostat->certid) {
         OCSP_CERTID_free(ostat->certid);
         ostat->certid = NULL;
     }
-    if (ostat->resp_der.data) {
-        OPENSSL_free((void*)ostat->resp_der.data);
-        ostat->resp_der.data = NULL;
-        ostat->resp_der.len = 0;
-    }
+    resp = apr_atomic_xchgptr((void*)&ostat->resp, NULL);
+    if (resp) resp_destroy(resp);
     return 1;
 }
 
-static int ostat_should_renew(md_ocsp_status_t *ostat) 
+static apr_uint32_t slot_seq(md_ocsp_shm_slot_t *slot)
+{
+    /* A compare-and-swap that never changes the value, but gives us a full
+     * memory barrier around the read. */
+    return apr_atomic_cas32(&slot->seq, 0, 0);
+}
+
+static void slot_write(md_ocsp_shm_slot_t *slot, const md_ocsp_resp_t *resp)
+{
+    apr_atomic_inc32(&slot->seq);
+    slot->stat = resp->stat;
+    slot->valid = resp->valid;
+    slot->oversize = (resp->der.len > sizeof(slot->der));
+    slot->len = slot->oversize? 0 : resp->der.len;
+    if (slot->len) memcpy(slot->der, resp->der.data, slot->len);
+    apr_atomic_inc32(&slot->seq);
+}
+
+/* Read a consistent copy of the slot. If pder is not NULL, the DER response 
+ * is copied into OPENSSL_malloc()ed memory. Returns APR_ENOENT if no 
+ * response is known, APR_ENOSPC if the response is not kept in the slot and 
+ * APR_EAGAIN if no consistent read was possible. */
+static apr_status_t slot_read(unsigned char **pder, int *pderlen, md_ocsp_cert_stat_t *pstat,
+                              md_timeperiod_t *pvalid, md_ocsp_shm_slot_t *slot)
+{
+    unsigned char *der;
+    apr_uint32_t seq;
+    apr_size_t len;
+    int i;
+    
+    for (i = 0; i < 100; ++i) {
+        seq = slot_seq(slot);
+        if (seq & 1) continue; /* update in progress */
+        if (slot->oversize) return APR_ENOSPC;
+        len = slot->len;
+        if (len > sizeof(slot->der)) continue;
+        der = NULL;
+        if (pder && len) {
+            der = OPENSSL_malloc(len);
+            if (!der) return APR_ENOMEM;
+            memcpy(der, slot->der, len);
+        }
+        if (pstat) *pstat = slot->stat;
+        if (pvalid) *pvalid = slot->valid;
+        if (slot_seq(slot) != seq) {
+            /* changed while we read it, try again */
+            if (der) OPENSSL_free(der);
+            continue;
+        }
+        if (!len) return APR_ENOENT;
+        if (pder) {
+            *pder = der;
+            *pderlen = (int)len;
+        }
+        return APR_SUCCESS;
+    }
+    return APR_EAGAIN;
+}
+
+static int ostat_should_renew(md_ocsp_status_t *ostat, const md_ocsp_resp_t *resp) 
 {
     md_timeperiod_t renewal;
     
-    renewal = md_timeperiod_slice_before_end(&ostat->resp_valid, &ostat->reg->renew_window);
+    renewal = md_timeperiod_slice_before_end(&resp->valid, &ostat->reg->renew_window);
     return md_timeperiod_has_started(&renewal, apr_time_now());
 }  
 
+static int ostat_run_before(const void *a, const void *b)
+{
+    return ((const md_ocsp_status_t*)a)->next_run < ((const md_ocsp_status_t*)b)->next_run;
+}
+
+static void ostat_set_sched_idx(void *elem, int idx)
+{
+    ((md_ocsp_status_t*)elem)->sched_idx = idx;
+}
+
+/* Set when ostat shall be updated next. Needs to be called with reg->mutex held. */
+static void ostat_schedule(md_ocsp_status_t *ostat, apr_time_t next_run)
+{
+    ostat->next_run = next_run;
+    if (ostat->sched_idx >= 0) {
+        md_heap_update(ostat->reg->schedule, ostat->sched_idx);
+    }
+    else {
+        md_heap_push(ostat->reg->schedule, ostat);
+    }
+}
+
+/* A response may be cached for max_age and asking for a new one before that
+ * will only get us the same. Needs to be called with reg->mutex held. */
+static void ostat_on_fresh(md_ocsp_status_t *ostat, apr_time_t max_age, apr_time_t valid_end)
+{
+    apr_time_t fresh_until;
+    
+    if (max_age <= 0) return;
+    fresh_until = apr_time_now() + max_age;
+    if (fresh_until > valid_end) fresh_until = valid_end;
+    if (fresh_until > ostat->next_run) ostat_schedule(ostat, fresh_until);
+}
+
+/* Set a new response for ostat. Needs to be called with reg->mutex held.
+ * Only the watchdog, which retrieved the response, may publish it to the
+ * shared memory slot. Everyone else only updates the process local copy. */
 static apr_status_t ostat_set(md_ocsp_status_t *ostat, md_ocsp_cert_stat_t stat,
-                              md_data_t *der, md_timeperiod_t *valid, apr_time_t mtime)
+                              md_data_t *der, md_timeperiod_t *valid, apr_time_t mtime,
+                              int publish)
 {
+    md_ocsp_reg_t *reg = ostat->reg;
+    md_ocsp_resp_t *resp, *old;
     apr_status_t rv = APR_SUCCESS;
-    char *s = (char*)der->data;
     
-    if (der->len) {
-        s = OPENSSL_malloc(der->len);
-        if (!s) {
-            rv = APR_ENOMEM;
-            goto leave;
-        }
-        memcpy((char*)s, der->data, der->len);
+    resp = resp_create(stat, der, valid);
+    if (!resp) {
+        rv = APR_ENOMEM;
+        goto leave;
     }
- 
-    if (ostat->resp_der.data) {
-        OPENSSL_free((void*)ostat->resp_der.data);
-        ostat->resp_der.data = NULL;
-        ostat->resp_der.len = 0;
+    
+    old = apr_atomic_xchgptr((void*)&ostat->resp, resp);
+    if (old) {
+        /* readers may still hold the old one, free it later */
+        old->retired = apr_time_now();
+        old->next = reg->retired;
+        reg->retired = old;
+    }
+    resp_reclaim(reg, 0);
+    if (publish && ostat->slot) {
+        slot_write(ostat->slot, resp);
+        /* we know what we just wrote */
+        apr_atomic_set32(&ostat->slot_seen, slot_seq(ostat->slot));
     }
     
-    ostat->resp_stat = stat;
-    ostat->resp_der.data = s;
-    ostat->resp_der.len = der->len;
-    ostat->resp_valid = *valid;
     ostat->resp_mtime = mtime;
-    
     ostat->errors = 0;
-    ostat->next_run = md_timeperiod_slice_before_end(
-        &ostat->resp_valid, &ostat->reg->renew_window).start;
+    ostat_schedule(ostat, md_timeperiod_slice_before_end(
+        &resp->valid, &reg->renew_window).start);
     
 leave:
     return rv;
@@ -252,7 +469,7 @@ static apr_status_t ocsp_status_refresh(md_ocsp_status_t *ostat, apr_pool_t *pte
     if (APR_SUCCESS != rv) goto leave;
     rv = ostat_from_json(&resp_stat, &resp_der, &resp_valid, jprops, ptemp);
     if (APR_SUCCESS != rv) goto leave;
-    rv = ostat_set(ostat, resp_stat, &resp_der, &resp_valid, mtime);
+    rv = ostat_set(ostat, resp_stat, &resp_der, &resp_valid, mtime, 0);
     if (APR_SUCCESS != rv) goto leave;
 leave:
     return rv;
@@ -273,7 +490,11 @@ static apr_status_t ocsp_status_save(md_ocsp_cert_stat_t stat, const md_data_t *
     rv = md_store_save_json(store, ptemp, MD_SG_OCSP, ostat->md_name, ostat->file_name, jprops, 0);
     if (APR_SUCCESS != rv) goto leave;
     mtime = md_store_get_modified(store, MD_SG_OCSP, ostat->md_name, ostat->file_name, ptemp);
-    if (mtime) ostat->resp_mtime = mtime;
+    if (mtime) {
+        apr_thread_mutex_lock(ostat->reg->mutex);
+        ostat->resp_mtime = mtime;
+        apr_thread_mutex_unlock(ostat->reg->mutex);
+    }
 leave:
     return rv;
 }
@@ -284,6 +505,7 @@ static apr_status_t ocsp_reg_cleanup(void *data)
     
     /* free all OpenSSL structures that we hold */
     apr_hash_do(ostat_cleanup, reg, reg->hash);
+    resp_reclaim(reg, 1);
     return APR_SUCCESS;
 }
 
@@ -305,6 +527,20 @@ apr_status_t md_ocsp_reg_make(md_ocsp_reg_t **preg, apr_pool_t *p, md_store_t *s
     reg->proxy_url = proxy_url;
     reg->hash = apr_hash_make(p);
     reg->renew_window = *renew_window;
+    reg->retired = NULL;
+    reg->shm = NULL;
+    reg->schedule = md_heap_make(p, 10, ostat_run_before, ostat_set_sched_idx);
+    reg->batch_size = 1;
+    reg->use_get = 0;
+    reg->max_parallel = MD_REQUEST_PARALLEL_DEF;
+    
+    if (ocsp_ex_idx < 0) {
+        ocsp_ex_idx = X509_get_ex_new_index(0, (void*)"md_ocsp_status", NULL, NULL, NULL);
+        if (ocsp_ex_idx < 0) {
+            rv = APR_EGENERAL;
+            goto leave;
+        }
+    }
     
     rv = apr_thread_mutex_create(&reg->mutex, APR_THREAD_MUTEX_NESTED, p);
     if (APR_SUCCESS != rv) goto leave;
@@ -315,6 +551,34 @@ leave:
     return rv;
 }
 
+static void ostat_attach(md_ocsp_status_t *ostat, X509 *x)
+{
+    /* Remember ostat at the certificate itself. We hold a reference to the X509
+     * so that we can remove this again when the registry goes away. */
+    if (X509_get_ex_data(x, ocsp_ex_idx) == ostat) return;
+    if (X509_set_ex_data(x, ocsp_ex_idx, ostat)) {
+        x509_up_ref(x);
+        APR_ARRAY_PUSH(ostat->x509s, X509*) = x;
+    }
+}
+
+void md_ocsp_set_batch_size(md_ocsp_reg_t *reg, int batch_size)
+{
+    if (batch_size > MD_OCSP_BATCH_MAX) batch_size = MD_OCSP_BATCH_MAX;
+    reg->batch_size = (batch_size > 0)? batch_size : 1;
+}
+
+void md_ocsp_set_use_get(md_ocsp_reg_t *reg, int use_get)
+{
+    reg->use_get = use_get;
+}
+
+void md_ocsp_set_max_parallel(md_ocsp_reg_t *reg, int max_parallel)
+{
+    if (max_parallel > MD_REQUEST_PARALLEL_MAX) max_parallel = MD_REQUEST_PARALLEL_MAX;
+    reg->max_parallel = (max_parallel > 0)? max_parallel : 1;
+}
+
 apr_status_t md_ocsp_prime(md_ocsp_reg_t *reg, md_cert_t *cert, md_cert_t *issuer, const md_t *md)
 {
     char iddata[MD_OCSP_ID_LENGTH];
@@ -330,16 +594,22 @@ apr_status_t md_ocsp_prime(md_ocsp_reg_t *reg, md_cert_t *cert, md_cert_t *issue
     
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, reg->p, 
                   "md[%s]: priming OCSP status", name);
-    rv = init_cert_id(&id, cert);
+    rv = init_cert_id(&id, md_cert_get_X509(cert));
     if (APR_SUCCESS != rv) goto leave;
     
     ostat = apr_hash_get(reg->hash, id.data, (apr_ssize_t)id.len);
-    if (ostat) goto leave; /* already seen it, cert is used in >1 server_rec */
+    if (ostat) {
+        /* already seen it, cert is used in >1 server_rec */
+        ostat_attach(ostat, md_cert_get_X509(cert));
+        goto leave;
+    }
     
     ostat = apr_pcalloc(reg->p, sizeof(*ostat));
     md_data_assign_pcopy(&ostat->id, &id, reg->p);
     ostat->reg = reg;
     ostat->md_name = name;
+    ostat->x509s = apr_array_make(reg->p, 1, sizeof(X509*));
+    ostat->sched_idx = -1;
     md_data_to_hex(&ostat->hexid, 0, reg->p, &ostat->id);
     ostat->file_name = apr_psprintf(reg->p, "ocsp-%s.json", ostat->hexid);
     rv = md_cert_to_sha256_fingerprint(&ostat->hex_sha256, cert, reg->p); 
@@ -372,64 +642,123 @@ apr_status_t md_ocsp_prime(md_ocsp_reg_t *reg, md_cert_t *cert, md_cert_t *issue
     
     /* See, if we have something in store */
     ocsp_status_refresh(ostat, reg->p);
+    if (ostat->sched_idx < 0) ostat_schedule(ostat, ostat->next_run);
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, reg->p, 
                   "md[%s]: adding ocsp info (responder=%s)", 
                   name, ostat->responder_url);
     apr_hash_set(reg->hash, ostat->id.data, (apr_ssize_t)ostat->id.len, ostat);
+    ostat_attach(ostat, md_cert_get_X509(cert));
     rv = APR_SUCCESS;
 leave:
     return rv;
 }
 
+static md_ocsp_status_t *ostat_find(md_ocsp_reg_t *reg, X509 *x)
+{
+    char iddata[MD_OCSP_ID_LENGTH];
+    md_ocsp_status_t *ostat;
+    md_data_t id;
+    
+    ostat = (ocsp_ex_idx >= 0)? X509_get_ex_data(x, ocsp_ex_idx) : NULL;
+    if (ostat && ostat->reg == reg) return ostat;
+    /* Not primed with this instance, look it up the hard way. */
+    id.data = iddata; id.len = sizeof(iddata);
+    if (APR_SUCCESS != init_cert_id(&id, x)) return NULL;
+    return apr_hash_get(reg->hash, id.data, (apr_ssize_t)id.len);
+}
+
+/* Check the store for a newer response, unless another thread is already
+ * busy updating. Never blocks readers. With shared memory, the slot sequence
+ * tells us if the watchdog has published anything since we last looked and
+ * the store is only accessed when it has. The refresh only updates our own
+ * copy, the slot is left to the watchdog. */
+static void ocsp_status_try_refresh(md_ocsp_status_t *ostat, apr_pool_t *ptemp)
+{
+    apr_uint32_t seq = 0;
+    
+    if (ostat->slot) {
+        seq = slot_seq(ostat->slot);
+        if (seq == apr_atomic_read32(&ostat->slot_seen)) return;
+    }
+    if (APR_SUCCESS == apr_thread_mutex_trylock(ostat->reg->mutex)) {
+        /* Remember the sequence from before we looked. If the watchdog publishes
+         * while we read the store, the next look sees a new sequence again. */
+        if (ostat->slot) apr_atomic_set32(&ostat->slot_seen, seq);
+        ocsp_status_refresh(ostat, ptemp);
+        apr_thread_mutex_unlock(ostat->reg->mutex);
+    }
+}
+
 apr_status_t md_ocsp_get_status(unsigned char **pder, int *pderlen,
-                                md_ocsp_reg_t *reg, const md_cert_t *cert,
+                                md_ocsp_reg_t *reg, void *x509,
                                 apr_pool_t *p, const md_t *md)
 {
-    char iddata[MD_OCSP_ID_LENGTH];
     md_ocsp_status_t *ostat;
+    md_ocsp_resp_t *resp = NULL;
     const char *name;
-    apr_status_t rv;
-    int locked = 0;
-    md_data_t id;
+    apr_status_t rv = APR_SUCCESS;
     
     (void)p;
     (void)md;
-    id.data = iddata; id.len = sizeof(iddata);
     *pder = NULL;
     *pderlen = 0;
     name = md? md->name : MD_OTHER;
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
                   "md[%s]: OCSP, get_status", name);
-    rv = init_cert_id(&id, cert);
-    if (APR_SUCCESS != rv) goto leave;
     
-    ostat = apr_hash_get(reg->hash, id.data, (apr_ssize_t)id.len);
+    ostat = ostat_find(reg, x509);
     if (!ostat) {
         rv = APR_ENOENT;
         goto leave;
     }
     
-    /* While the ostat instance itself always exists, the response data it holds
-     * may vary over time and we need locked access to make a copy. */
-    apr_thread_mutex_lock(reg->mutex);
-    locked = 1;
+    if (ostat->slot) {
+        /* The watchdog keeps the shared memory up to date, no need to
+         * look into the store. */
+        rv = slot_read(pder, pderlen, NULL, NULL, ostat->slot);
+        if (APR_SUCCESS == rv) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
+                          "md[%s]: OCSP, returning %d bytes of shared response", 
+                          name, *pderlen);
+            goto leave;
+        }
+        else if (APR_STATUS_IS_ENOENT(rv)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
+                          "md[%s]: OCSP, no response available", name);
+            rv = APR_SUCCESS;
+            goto leave;
+        }
+        else if (APR_ENOSPC == rv) {
+            /* Too large for the slot, the watchdog announces updates there
+             * all the same. Reload our own copy when it did. */
+            ocsp_status_try_refresh(ostat, p);
+        }
+        /* not in shared memory, use what we have ourself */
+        rv = APR_SUCCESS;
+    }
     
-    if (ostat->resp_der.len <= 0) {
+    /* While the ostat instance itself always exists, the response data it holds
+     * may vary over time. We work on the snapshot that is current right now,
+     * without taking any locks. */
+    resp = resp_acquire(ostat);
+    if (!resp || resp->der.len <= 0) {
         /* No response known, check store for new response. */
-        ocsp_status_refresh(ostat, p);
-        if (ostat->resp_der.len <= 0) {
+        resp_release(resp);
+        ocsp_status_try_refresh(ostat, p);
+        resp = resp_acquire(ostat);
+        if (!resp || resp->der.len <= 0) {
             md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
                           "md[%s]: OCSP, no response available", name);
             goto leave;
         }
     }
     /* We have a response */
-    if (ostat_should_renew(ostat)) {
+    if (ostat_should_renew(ostat, resp)) {
         /* But it is up for renewal. A watchdog should be busy with
          * retrieving a new one. In case of outages, this might take
          * a while, however. Pace the frequency of checks with the
          * urgency of a new response based on the remaining time. */
-        long secs = (long)apr_time_sec(md_timeperiod_remaining(&ostat->resp_valid, apr_time_now()));
+        long secs = (long)apr_time_sec(md_timeperiod_remaining(&resp->valid, apr_time_now()));
         apr_time_t waiting_time; 
         
         /* every hour, every minute, every second */
@@ -438,64 +767,80 @@ apr_status_t md_ocsp_get_status(unsigned char **pder, int *pderlen,
                         apr_time_from_sec(60) : apr_time_from_sec(1)));
         if ((apr_time_now() - ostat->resp_last_check) >= waiting_time) {
             ostat->resp_last_check = apr_time_now();
-            ocsp_status_refresh(ostat, p);
+            ocsp_status_try_refresh(ostat, p);
+            /* continue with the snapshot we hold, the next handshake sees any update */
         }
     }
     
-    *pder = OPENSSL_malloc(ostat->resp_der.len);
+    *pder = OPENSSL_malloc(resp->der.len);
     if (*pder == NULL) {
         rv = APR_ENOMEM;
         goto leave;
     }
-    memcpy(*pder, ostat->resp_der.data, ostat->resp_der.len);
-    *pderlen = (int)ostat->resp_der.len;
+    memcpy(*pder, resp->der.data, resp->der.len);
+    *pderlen = (int)resp->der.len;
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
                   "md[%s]: OCSP, returning %ld bytes of response", 
-                  name, (long)ostat->resp_der.len);
+                  name, (long)resp->der.len);
 leave:
-    if (locked) apr_thread_mutex_unlock(reg->mutex);
+    resp_release(resp);
     return rv;
 }
 
 static void ocsp_get_meta(md_ocsp_cert_stat_t *pstat, md_timeperiod_t *pvalid, 
                           md_ocsp_reg_t *reg, md_ocsp_status_t *ostat, apr_pool_t *p)
 {
-    apr_thread_mutex_lock(reg->mutex);
-    if (ostat->resp_der.len <= 0) {
+    md_ocsp_resp_t *resp;
+    
+    (void)reg;
+    if (ostat->slot) {
+        apr_status_t rv = slot_read(NULL, NULL, pstat, pvalid, ostat->slot);
+        if (APR_SUCCESS == rv) return;
+        if (APR_STATUS_IS_ENOENT(rv)) {
+            memset(pvalid, 0, sizeof(*pvalid));
+            *pstat = MD_OCSP_CERT_ST_UNKNOWN;
+            return;
+        }
+        if (APR_ENOSPC == rv) ocsp_status_try_refresh(ostat, p);
+    }
+    resp = resp_acquire(ostat);
+    if (!resp || resp->der.len <= 0) {
         /* No resonse known, check the store if out watchdog retrieved one 
          * in the meantime. */
-        ocsp_status_refresh(ostat, p);
+        resp_release(resp);
+        ocsp_status_try_refresh(ostat, p);
+        resp = resp_acquire(ostat);
     }
-    *pvalid = ostat->resp_valid;
-    *pstat = ostat->resp_stat;
-    apr_thread_mutex_unlock(reg->mutex);
+    if (resp) {
+        *pvalid = resp->valid;
+        *pstat = resp->stat;
+    }
+    else {
+        memset(pvalid, 0, sizeof(*pvalid));
+        *pstat = MD_OCSP_CERT_ST_UNKNOWN;
+    }
+    resp_release(resp);
 }
 
 apr_status_t md_ocsp_get_meta(md_ocsp_cert_stat_t *pstat, md_timeperiod_t *pvalid,
                               md_ocsp_reg_t *reg, const md_cert_t *cert,
                               apr_pool_t *p, const md_t *md)
 {
-    char iddata[MD_OCSP_ID_LENGTH];
     md_ocsp_status_t *ostat;
     const char *name;
-    apr_status_t rv;
+    apr_status_t rv = APR_SUCCESS;
     md_timeperiod_t valid;
     md_ocsp_cert_stat_t stat;
-    md_data_t id;
     
     (void)p;
     (void)md;
-    id.data = iddata; id.len = sizeof(iddata);
     name = md? md->name : MD_OTHER;
     memset(&valid, 0, sizeof(valid));
     stat = MD_OCSP_CERT_ST_UNKNOWN;
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
                   "md[%s]: OCSP, get_status", name);
     
-    rv = init_cert_id(&id, cert);
-    if (APR_SUCCESS != rv) goto leave;
-    
-    ostat = apr_hash_get(reg->hash, id.data, (apr_ssize_t)id.len);
+    ostat = ostat_find(reg, md_cert_get_X509(cert));
     if (!ostat) {
         rv = APR_ENOENT;
         goto leave;
@@ -507,6 +852,58 @@ leave:
     return rv;
 }
 
+typedef struct {
+    md_ocsp_shm_slot_t *slots;
+    apr_size_t nslots;
+    apr_size_t next;
+} ocsp_shm_ctx_t;
+
+static int assign_slot(void *baton, const void *key, apr_ssize_t klen, const void *val)
+{
+    ocsp_shm_ctx_t *ctx = baton;
+    md_ocsp_status_t *ostat = (md_ocsp_status_t *)val;
+    md_ocsp_resp_t *resp;
+    
+    (void)key;
+    (void)klen;
+    if (ctx->next >= ctx->nslots) return 0;
+    ostat->slot = &ctx->slots[ctx->next++];
+    memset(ostat->slot, 0, sizeof(*ostat->slot));
+    resp = resp_acquire(ostat);
+    if (resp) slot_write(ostat->slot, resp);
+    resp_release(resp);
+    apr_atomic_set32(&ostat->slot_seen, slot_seq(ostat->slot));
+    return 1;
+}
+
+apr_status_t md_ocsp_shm_init(md_ocsp_reg_t *reg, apr_pool_t *p)
+{
+    ocsp_shm_ctx_t ctx;
+    apr_size_t size;
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (reg->shm || !apr_hash_count(reg->hash)) goto leave;
+    
+    ctx.nslots = apr_hash_count(reg->hash);
+    ctx.next = 0;
+    size = ctx.nslots * sizeof(md_ocsp_shm_slot_t);
+    rv = apr_shm_create(&reg->shm, size, NULL, p);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "unable to create shared memory for %d OCSP responses, "
+                      "child processes will read them from the store", (int)ctx.nslots);
+        reg->shm = NULL;
+        goto leave;
+    }
+    ctx.slots = apr_shm_baseaddr_get(reg->shm);
+    apr_hash_do(assign_slot, &ctx, reg->hash);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                  "OCSP responses of %d certificates in shared memory (%ld bytes)", 
+                  (int)ctx.next, (long)size);
+leave:
+    return rv;
+}
+
 apr_size_t md_ocsp_count(md_ocsp_reg_t *reg)
 {
     return apr_hash_count(reg->hash);
@@ -594,28 +991,284 @@ typedef struct {
     md_ocsp_status_t *ostat;
     md_result_t *result;
     md_job_t *job;
+    apr_status_t rv;          /* outcome for this certificate in a batch response */
 } md_ocsp_update_t;
 
-static apr_status_t ostat_on_resp(const md_http_response_t *resp, void *baton)
+/* Certificates with the same responder and issuer that are queried in one request */
+typedef struct {
+    apr_pool_t *p;
+    const char *responder_url;
+    apr_array_header_t *updates;  /* md_ocsp_update_t* */
+    OCSP_REQUEST *ocsp_req;
+    md_data_t req_der;
+    const char *get_url;          /* url of a GET request or NULL when POSTing */
+    int conditional;              /* request carries the validators of our response */
+    apr_time_t max_age;           /* Cache-Control: max-age of the response or -1 */
+    const char *etag;             /* validators of the response to a single GET */
+    const char *last_modified;
+} md_ocsp_batch_t;
+
+static apr_status_t batch_cleanup(void *data)
+{
+    md_ocsp_batch_t *batch = data;
+    
+    if (batch->ocsp_req) {
+        OCSP_REQUEST_free(batch->ocsp_req);
+        batch->ocsp_req = NULL;
+    }
+    if (batch->req_der.data) {
+        OPENSSL_free((void*)batch->req_der.data);
+        batch->req_der.data = NULL;
+        batch->req_der.len = 0;
+    }
+    return APR_SUCCESS;
+}
+
+static md_ocsp_batch_t *batch_make(apr_pool_t *p, const char *responder_url, int nalloc)
+{
+    md_ocsp_batch_t *batch;
+    
+    batch = apr_pcalloc(p, sizeof(*batch));
+    batch->p = p;
+    batch->responder_url = responder_url;
+    batch->updates = apr_array_make(p, nalloc, sizeof(md_ocsp_update_t*));
+    apr_pool_cleanup_register(p, batch, batch_cleanup, apr_pool_cleanup_null);
+    return batch;
+}
+
+/* RFC 5019: GET url is the responder url + the url encoded base64 of the request. 
+ * Returns NULL if the request is too large for this. */
+static const char *ocsp_get_url(const char *responder_url, const md_data_t *der, 
+                                apr_pool_t *p)
+{
+    const char *b64, *cp;
+    char *url, *dp;
+    apr_size_t len, pad;
+    
+    len = ((der->len + 2) / 3) * 4;
+    if (len > 255) return NULL;
+    
+    b64 = md_util_base64url_encode(der, p);
+    len = strlen(responder_url);
+    url = dp = apr_pcalloc(p, len + 1 + (3 * strlen(b64)) + 6 + 1);
+    memcpy(dp, responder_url, len);
+    dp += len;
+    if (!len || responder_url[len-1] != '/') *dp++ = '/';
+    for (cp = b64; *cp; ++cp) {
+        switch (*cp) {
+            case '-': memcpy(dp, "%2B", 3); dp += 3; break;
+            case '_': memcpy(dp, "%2F", 3); dp += 3; break;
+            default: *dp++ = *cp; break;
+        }
+    }
+    for (pad = (3 - (der->len % 3)) % 3; pad > 0; --pad) {
+        memcpy(dp, "%3D", 3); dp += 3;
+    }
+    *dp = '\0';
+    return url;
+}
+
+/* Get the freshness lifetime a response carries in its Cache-Control, or -1 */
+static apr_time_t resp_max_age(const md_http_response_t *resp)
+{
+    const char *cc;
+    char *list, *token, *last, *value;
+    apr_time_t max_age = -1;
+    
+    cc = apr_table_get(resp->headers, "Cache-Control");
+    if (!cc) goto leave;
+    list = apr_pstrdup(resp->req->pool, cc);
+    for (token = apr_strtok(list, ", \t", &last); token; 
+         token = apr_strtok(NULL, ", \t", &last)) {
+        if (!apr_strnatcasecmp("no-cache", token) || !apr_strnatcasecmp("no-store", token)) {
+            max_age = 0;
+            goto leave;
+        }
+        if ((value = strchr(token, '='))) {
+            *value++ = '\0';
+            if (!apr_strnatcasecmp("max-age", token)) {
+                max_age = apr_time_from_sec(apr_atoi64(value));
+                if (max_age < 0) max_age = 0;
+            }
+        }
+    }
+leave:
+    return max_age;
+}
+
+/* Requests may only be batched for certificates with the same responder and issuer */
+static const char *batch_key(md_ocsp_status_t *ostat, apr_pool_t *p)
+{
+    ASN1_OCTET_STRING *aname_hash = NULL, *akey_hash = NULL;
+    const char *name = "", *key = "";
+    md_data_t data;
+    
+    OCSP_id_get0_info(&aname_hash, NULL, &akey_hash, NULL, ostat->certid);
+    if (aname_hash) {
+        data.len = (apr_size_t)aname_hash->length;
+        data.data = (const char*)aname_hash->data;
+        md_data_to_hex(&name, 0, p, &data);
+    }
+    if (akey_hash) {
+        data.len = (apr_size_t)akey_hash->length;
+        data.data = (const char*)akey_hash->data;
+        md_data_to_hex(&key, 0, p, &data);
+    }
+    return apr_psprintf(p, "%s %s:%s", ostat->responder_url, name, key);
+}
+
+static apr_status_t update_on_basic_resp(md_ocsp_update_t *update, md_ocsp_batch_t *batch,
+                                         OCSP_BASICRESP *basic_resp,
+                                         md_data_t *new_der, apr_pool_t *p)
 {
-    md_ocsp_update_t *update = baton;
     md_ocsp_status_t *ostat = update->ostat;
-    md_http_request_t *req = resp->req;
-    OCSP_RESPONSE *ocsp_resp = NULL;
-    OCSP_BASICRESP *basic_resp = NULL;
     OCSP_SINGLERESP *single_resp;
     apr_status_t rv = APR_SUCCESS;
-    int n, breason = 0, bstatus;
+    int breason = 0, bstatus;
     ASN1_GENERALIZEDTIME *bup = NULL, *bnextup = NULL;
-    md_data_t der, new_der;
     md_timeperiod_t valid;
     md_ocsp_cert_stat_t nstat;
     
+    if (!OCSP_resp_find_status(basic_resp, ostat->certid, &bstatus,
+                               &breason, NULL, &bup, &bnextup)) {
+        const char *prefix, *slist = "", *sep = "";
+        int i;
+        
+        rv = APR_EINVAL;
+        prefix = apr_psprintf(p, "OCSP response, no matching status reported for  %s",
+                              certid_summary(ostat->certid, p));
+        for (i = 0; i < OCSP_resp_count(basic_resp); ++i) {
+            single_resp = OCSP_resp_get0(basic_resp, i);
+            slist = apr_psprintf(p, "%s%s%s", slist, sep, single_resp_summary(single_resp, p));
+            sep = ", ";
+        }
+        md_result_printf(update->result, rv, "%s, status list [%s]", prefix, slist);
+        md_result_log(update->result, MD_LOG_DEBUG);
+        goto leave;
+    }
+    if (V_OCSP_CERTSTATUS_UNKNOWN == bstatus) {
+        rv = APR_ENOENT;
+        md_result_set(update->result, rv, "OCSP basicresponse says cert is unknown");
+        md_result_log(update->result, MD_LOG_DEBUG);
+        goto leave;
+    }
+    if (!bnextup) {
+        rv = APR_EINVAL;
+        md_result_set(update->result, rv, "OCSP basicresponse reports not valid dates");
+        md_result_log(update->result, MD_LOG_DEBUG);
+        goto leave;
+    }
+    
+    /* Coming here, we have a response for our certid and it is either GOOD
+     * or REVOKED. Both cases we want to remember and use in stapling. */
+    nstat = (bstatus == V_OCSP_CERTSTATUS_GOOD)? MD_OCSP_CERT_ST_GOOD : MD_OCSP_CERT_ST_REVOKED;
+    valid.start = bup? md_asn1_generalized_time_get(bup) : apr_time_now();
+    valid.end = md_asn1_generalized_time_get(bnextup);
+    
+    /* First, save the original response. Other processes that see our
+     * update announced in shared memory may then read it from the store. */
+    rv = ocsp_status_save(nstat, new_der, &valid, ostat, p); 
+    
+    /* Next, update the instance with a copy */
+    apr_thread_mutex_lock(ostat->reg->mutex);
+    ostat_set(ostat, nstat, new_der, &valid, apr_time_now(), 1);
+    ostat_on_fresh(ostat, batch->max_age, valid.end);
+    apr_cpystrn(ostat->etag, batch->etag? batch->etag : "", sizeof(ostat->etag));
+    apr_cpystrn(ostat->last_modified, batch->last_modified? batch->last_modified : "", 
+                sizeof(ostat->last_modified));
+    apr_thread_mutex_unlock(ostat->reg->mutex);
+    
+    if (APR_SUCCESS != rv) {
+        md_result_set(update->result, rv, "error saving OCSP status");
+        md_result_log(update->result, MD_LOG_ERR);
+        goto leave;
+    }
+    
+    md_result_printf(update->result, rv, "certificate status is %s, status valid %s", 
+                     (nstat == MD_OCSP_CERT_ST_GOOD)? "GOOD" : "REVOKED",
+                     md_timeperiod_print(p, &valid));
+    md_result_log(update->result, MD_LOG_DEBUG);
+
+leave:
+    return rv;
+}
+
+/* The responder told us that the response we have is still the current one */
+static apr_status_t update_not_modified(md_ocsp_update_t *update, md_ocsp_batch_t *batch)
+{
+    md_ocsp_status_t *ostat = update->ostat;
+    apr_status_t rv = APR_SUCCESS;
+    apr_time_t now = apr_time_now(), next_run;
+    
+    apr_thread_mutex_lock(ostat->reg->mutex);
+    if (!ostat->resp || ostat->resp->valid.end <= now) {
+        rv = APR_EINVAL;
+        ostat->etag[0] = ostat->last_modified[0] = '\0';
+        md_result_set(update->result, rv, "OCSP responder reports no change, but our "
+                      "response has expired");
+        md_result_log(update->result, MD_LOG_DEBUG);
+    }
+    else {
+        next_run = now + ((batch->max_age > 0)? batch->max_age : MD_OCSP_NOT_MODIFIED_DELAY);
+        if (next_run > ostat->resp->valid.end) next_run = ostat->resp->valid.end;
+        ostat->errors = 0;
+        ostat_schedule(ostat, next_run);
+        md_result_set(update->result, rv, "OCSP response not modified at responder");
+        md_result_log(update->result, MD_LOG_DEBUG);
+    }
+    apr_thread_mutex_unlock(ostat->reg->mutex);
+    return rv;
+}
+
+static void batch_fail(md_ocsp_batch_t *batch, apr_status_t rv, unsigned int level, 
+                       const char *fmt, ...)
+{
+    md_ocsp_update_t *update;
+    const char *msg;
+    va_list ap;
+    int i;
+    
+    va_start(ap, fmt);
+    msg = apr_pvsprintf(batch->p, fmt, ap);
+    va_end(ap);
+    for (i = 0; i < batch->updates->nelts; ++i) {
+        update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+        md_result_set(update->result, rv, msg);
+        md_result_log(update->result, level);
+    }
+}
+
+static apr_status_t batch_on_resp(const md_http_response_t *resp, void *baton)
+{
+    md_ocsp_batch_t *batch = baton;
+    md_ocsp_update_t *update;
+    md_http_request_t *req = resp->req;
+    OCSP_RESPONSE *ocsp_resp = NULL;
+    OCSP_BASICRESP *basic_resp = NULL;
+    apr_status_t rv = APR_SUCCESS;
+    md_data_t der, new_der;
+    int i, n;
+    
     der.data = new_der.data = NULL;
     der.len  = new_der.len = 0;
 
-    md_result_activity_printf(update->result, "status of certid %s, reading response", 
-                              ostat->hexid);
+    for (i = 0; i < batch->updates->nelts; ++i) {
+        update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+        md_result_activity_printf(update->result, "status of certid %s, reading response", 
+                                  update->ostat->hexid);
+    }
+    batch->max_age = resp_max_age(resp);
+    if (304 == resp->status && batch->conditional) {
+        for (i = 0; i < batch->updates->nelts; ++i) {
+            update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+            update->rv = update_not_modified(update, batch);
+        }
+        goto leave;
+    }
+    if (batch->get_url && batch->updates->nelts == 1) {
+        batch->etag = apr_table_get(resp->headers, "ETag");
+        batch->last_modified = apr_table_get(resp->headers, "Last-Modified");
+    }
     if (APR_SUCCESS != (rv = apr_brigade_pflatten(resp->body, (char**)&der.data, 
                                                   &der.len, req->pool))) {
         goto leave;
@@ -623,23 +1276,20 @@ static apr_status_t ostat_on_resp(const md_http_response_t *resp, void *baton)
     if (NULL == (ocsp_resp = d2i_OCSP_RESPONSE(NULL, (const unsigned char**)&der.data, 
                                                (long)der.len))) {
         rv = APR_EINVAL;
-        md_result_set(update->result, rv, "response body does not parse as OCSP response");
-        md_result_log(update->result, MD_LOG_DEBUG);
+        batch_fail(batch, rv, MD_LOG_DEBUG, "response body does not parse as OCSP response");
         goto leave;
     }
     /* got a response! but what does it say? */
     n = OCSP_response_status(ocsp_resp);
     if (OCSP_RESPONSE_STATUS_SUCCESSFUL != n) {
         rv = APR_EINVAL;
-        md_result_printf(update->result, rv, "OCSP response status is, unsuccessfully, %d", n);
-        md_result_log(update->result, MD_LOG_DEBUG);
+        batch_fail(batch, rv, MD_LOG_DEBUG, "OCSP response status is, unsuccessfully, %d", n);
         goto leave;
     }
     basic_resp = OCSP_response_get1_basic(ocsp_resp);
     if (!basic_resp) {
         rv = APR_EINVAL;
-        md_result_set(update->result, rv, "OCSP response has no basicresponse");
-        md_result_log(update->result, MD_LOG_DEBUG);
+        batch_fail(batch, rv, MD_LOG_DEBUG, "OCSP response has no basicresponse");
         goto leave;
     }
     /* The notion of nonce enabled freshness in OCSP responses, e.g. that the response
@@ -647,15 +1297,14 @@ static apr_status_t ostat_on_resp(const md_http_response_t *resp, void *baton)
      * like to return cached response bytes and therefore do not add a nonce to it.
      * So, in reality, we can only detect a mismatch when present and otherwise have
      * to accept it. */
-    switch ((n = OCSP_check_nonce(ostat->ocsp_req, basic_resp))) {
+    switch ((n = OCSP_check_nonce(batch->ocsp_req, basic_resp))) {
         case 1:
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, req->pool, 
                           "req[%d]: OCSP respoonse nonce does match", req->id);
             break;
         case 0:
             rv = APR_EINVAL;
-            md_result_printf(update->result, rv, "OCSP nonce mismatch in response", n);
-            md_result_log(update->result, MD_LOG_WARNING);
+            batch_fail(batch, rv, MD_LOG_WARNING, "OCSP nonce mismatch in response");
             goto leave;
             
         case -1:
@@ -666,68 +1315,20 @@ static apr_status_t ostat_on_resp(const md_http_response_t *resp, void *baton)
             break;
     }
     
-    if (!OCSP_resp_find_status(basic_resp, ostat->certid, &bstatus,
-                               &breason, NULL, &bup, &bnextup)) {
-        const char *prefix, *slist = "", *sep = "";
-        int i;
-        
-        rv = APR_EINVAL;
-        prefix = apr_psprintf(req->pool, "OCSP response, no matching status reported for  %s",
-                              certid_summary(ostat->certid, req->pool));
-        for (i = 0; i < OCSP_resp_count(basic_resp); ++i) {
-            single_resp = OCSP_resp_get0(basic_resp, i);
-            slist = apr_psprintf(req->pool, "%s%s%s", slist, sep, 
-                                 single_resp_summary(single_resp, req->pool));
-            sep = ", ";
-        }
-        md_result_printf(update->result, rv, "%s, status list [%s]", prefix, slist);
-        md_result_log(update->result, MD_LOG_DEBUG);
-        goto leave;
-    }
-    if (V_OCSP_CERTSTATUS_UNKNOWN == bstatus) {
-        rv = APR_ENOENT;
-        md_result_set(update->result, rv, "OCSP basicresponse says cert is unknown");
-        md_result_log(update->result, MD_LOG_DEBUG);
-        goto leave;
-    }
-    if (!bnextup) {
-        rv = APR_EINVAL;
-        md_result_set(update->result, rv, "OCSP basicresponse reports not valid dates");
-        md_result_log(update->result, MD_LOG_DEBUG);
-        goto leave;
-    }
-    
-    /* Coming here, we have a response for our certid and it is either GOOD
-     * or REVOKED. Both cases we want to remember and use in stapling. */
+    /* The response is signed as a whole and cannot be split. Every certificate
+     * found in it staples the complete response. */
     n = i2d_OCSP_RESPONSE(ocsp_resp, (unsigned char**)&new_der.data);
     if (n <= 0) {
         rv = APR_EGENERAL;
-        md_result_set(update->result, rv, "error DER encoding OCSP response");
-        md_result_log(update->result, MD_LOG_WARNING);
+        batch_fail(batch, rv, MD_LOG_WARNING, "error DER encoding OCSP response");
         goto leave;
     }
-    nstat = (bstatus == V_OCSP_CERTSTATUS_GOOD)? MD_OCSP_CERT_ST_GOOD : MD_OCSP_CERT_ST_REVOKED;
     new_der.len = (apr_size_t)n;
-    valid.start = bup? md_asn1_generalized_time_get(bup) : apr_time_now();
-    valid.end = md_asn1_generalized_time_get(bnextup);
     
-    /* First, update the instance with a copy */
-    apr_thread_mutex_lock(ostat->reg->mutex);
-    ostat_set(ostat, nstat, &new_der, &valid, apr_time_now());
-    apr_thread_mutex_unlock(ostat->reg->mutex);
-    
-    /* Next, save the original response */
-    rv = ocsp_status_save(nstat, &new_der, &valid, ostat, req->pool); 
-    if (APR_SUCCESS != rv) {
-        md_result_set(update->result, rv, "error saving OCSP status");
-        md_result_log(update->result, MD_LOG_ERR);
-        goto leave;
+    for (i = 0; i < batch->updates->nelts; ++i) {
+        update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+        update->rv = update_on_basic_resp(update, batch, basic_resp, &new_der, req->pool);
     }
-    
-    md_result_printf(update->result, rv, "certificate status is %s, status valid %s", 
-                     (nstat == MD_OCSP_CERT_ST_GOOD)? "GOOD" : "REVOKED",
-                     md_timeperiod_print(req->pool, &ostat->resp_valid));
-    md_result_log(update->result, MD_LOG_DEBUG);
 
 leave:
     if (new_der.data) OPENSSL_free((void*)new_der.data);
@@ -736,17 +1337,17 @@ leave:
     return rv;
 }
 
-static apr_status_t ostat_on_req_status(const md_http_request_t *req, apr_status_t status, 
-                                        void *baton)
+static void update_on_status(md_ocsp_update_t *update, apr_status_t status)
 {
-    md_ocsp_update_t *update = baton;
     md_ocsp_status_t *ostat = update->ostat;
 
-    (void)req;
     md_job_end_run(update->job, update->result);
     if (APR_SUCCESS != status) {
+        apr_thread_mutex_lock(ostat->reg->mutex);
         ++ostat->errors;
-        ostat->next_run = apr_time_now() + md_job_delay_on_errors(update->job, ostat->errors, NULL);
+        ostat_schedule(ostat, apr_time_now() 
+                       + md_job_delay_on_errors(update->job, ostat->errors, NULL));
+        apr_thread_mutex_unlock(ostat->reg->mutex);
         md_result_printf(update->result, status, "OCSP status update failed (%d. time)",  
                          ostat->errors);
         md_result_log(update->result, MD_LOG_DEBUG);
@@ -759,7 +1360,21 @@ static apr_status_t ostat_on_req_status(const md_http_request_t *req, apr_status
 
 leave:
     md_job_save(update->job, update->result, update->p);
-    ostat_req_cleanup(ostat);
+}
+
+static apr_status_t batch_on_req_status(const md_http_request_t *req, apr_status_t status, 
+                                        void *baton)
+{
+    md_ocsp_batch_t *batch = baton;
+    md_ocsp_update_t *update;
+    int i;
+
+    (void)req;
+    for (i = 0; i < batch->updates->nelts; ++i) {
+        update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+        update_on_status(update, (APR_SUCCESS == status)? update->rv : status);
+    }
+    batch_cleanup(batch);
     return APR_SUCCESS;
 }
 
@@ -775,107 +1390,149 @@ static apr_status_t next_todo(md_http_request_t **preq, void *baton,
                               md_http_t *http, int in_flight)
 {
     md_ocsp_todo_ctx_t *ctx = baton;
-    md_ocsp_update_t *update, **pupdate;    
+    md_ocsp_batch_t *batch = NULL, **pbatch;
+    md_ocsp_update_t *update;
     md_ocsp_status_t *ostat;
     OCSP_CERTID *certid = NULL;
     md_http_request_t *req = NULL;
     apr_status_t rv = APR_ENOENT;
     apr_table_t *headers;
-    int len;
+    int i, len;
     
     if (in_flight < ctx->max_parallel) {
-        pupdate = apr_array_pop(ctx->todos);
-        if (pupdate) {
-            update = *pupdate;
-            ostat = update->ostat;
+        pbatch = apr_array_pop(ctx->todos);
+        if (pbatch) {
+            batch = *pbatch;
             
-            update->job = md_ocsp_job_make(ctx->reg, ostat->md_name, update->p);
-            md_job_load(update->job);
-            md_job_start_run(update->job, update->result, ctx->reg->store);
-             
-            if (!ostat->ocsp_req) {
-                ostat->ocsp_req = OCSP_REQUEST_new();
-                if (!ostat->ocsp_req) goto leave;
+            batch->ocsp_req = OCSP_REQUEST_new();
+            if (!batch->ocsp_req) goto leave;
+            for (i = 0; i < batch->updates->nelts; ++i) {
+                update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+                ostat = update->ostat;
+                
+                update->job = md_ocsp_job_make(ctx->reg, ostat->md_name, update->p);
+                md_job_load(update->job);
+                md_job_start_run(update->job, update->result, ctx->reg->store);
+                
                 certid = OCSP_CERTID_dup(ostat->certid);
                 if (!certid) goto leave;
-                if (!OCSP_request_add0_id(ostat->ocsp_req, certid)) goto leave;
-                OCSP_request_add1_nonce(ostat->ocsp_req, 0, -1);
+                if (!OCSP_request_add0_id(batch->ocsp_req, certid)) goto leave;
                 certid = NULL;
+                md_result_activity_printf(update->result, "status of certid %s, "
+                                          "contacting %s", ostat->hexid, batch->responder_url);
             }
-            if (0 == ostat->req_der.len) {
-                len = i2d_OCSP_REQUEST(ostat->ocsp_req, (unsigned char**)&ostat->req_der.data);
-                if (len < 0) goto leave;
-                ostat->req_der.len = (apr_size_t)len;
-            }
-            md_result_activity_printf(update->result, "status of certid %s, "
-                                      "contacting %s", ostat->hexid, ostat->responder_url);
+            /* A nonce makes the response uncacheable */
+            if (!ctx->reg->use_get) OCSP_request_add1_nonce(batch->ocsp_req, 0, -1);
+            len = i2d_OCSP_REQUEST(batch->ocsp_req, (unsigned char**)&batch->req_der.data);
+            if (len < 0) goto leave;
+            batch->req_der.len = (apr_size_t)len;
+            
+            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, ctx->ptemp, 
+                          "OCSP request for %d certificates to %s", 
+                          batch->updates->nelts, batch->responder_url);
             headers = apr_table_make(ctx->ptemp, 5);
-            apr_table_set(headers, "Expect", "");
-            rv = md_http_POSTd_create(&req, http, ostat->responder_url, headers, 
-                                      "application/ocsp-request", &ostat->req_der);
+            if (ctx->reg->use_get) {
+                batch->get_url = ocsp_get_url(batch->responder_url, &batch->req_der, ctx->ptemp);
+            }
+            if (batch->get_url) {
+                if (batch->updates->nelts == 1) {
+                    ostat = APR_ARRAY_IDX(batch->updates, 0, md_ocsp_update_t*)->ostat;
+                    if (ostat->etag[0]) {
+                        apr_table_set(headers, "If-None-Match", ostat->etag);
+                        batch->conditional = 1;
+                    }
+                    if (ostat->last_modified[0]) {
+                        apr_table_set(headers, "If-Modified-Since", ostat->last_modified);
+                        batch->conditional = 1;
+                    }
+                }
+                rv = md_http_GET_create(&req, http, batch->get_url, headers);
+            }
+            else {
+                apr_table_set(headers, "Expect", "");
+                rv = md_http_POSTd_create(&req, http, batch->responder_url, headers, 
+                                          "application/ocsp-request", &batch->req_der);
+            }
             if (APR_SUCCESS != rv) goto leave;
-            md_http_set_on_status_cb(req, ostat_on_req_status, update);
-            md_http_set_on_response_cb(req, ostat_on_resp, update);
+            md_http_set_on_status_cb(req, batch_on_req_status, batch);
+            md_http_set_on_response_cb(req, batch_on_resp, batch);
             rv = APR_SUCCESS;
         }
     }
 leave:
     *preq = (APR_SUCCESS == rv)? req : NULL;
     if (certid) OCSP_CERTID_free(certid);
-    return rv;
-}
-
-static int select_updates(void *baton, const void *key, apr_ssize_t klen, const void *val)
-{
-    md_ocsp_todo_ctx_t *ctx = baton;
-    md_ocsp_status_t *ostat = (md_ocsp_status_t *)val;
-    md_ocsp_update_t *update;
-    
-    (void)key;
-    (void)klen;
-    if (ostat->next_run <= ctx->time) {
-        update = apr_pcalloc(ctx->ptemp, sizeof(*update));
-        update->p = ctx->ptemp;
-        update->ostat = ostat;
-        update->result = md_result_md_make(update->p, ostat->md_name);
-        update->job = NULL;
-        APR_ARRAY_PUSH(ctx->todos, md_ocsp_update_t*) = update;
-    }
-    return 1;
-}
-
-static int select_next_run(void *baton, const void *key, apr_ssize_t klen, const void *val)
-{
-    md_ocsp_todo_ctx_t *ctx = baton;
-    md_ocsp_status_t *ostat = (md_ocsp_status_t *)val;
-    
-    (void)key;
-    (void)klen;
-    if (ostat->next_run < ctx->time && ostat->next_run > apr_time_now()) {
-        ctx->time = ostat->next_run;
+    if (batch && APR_SUCCESS != rv) {
+        /* End the runs we started, they are retried like failed updates */
+        batch_fail(batch, APR_EGENERAL, MD_LOG_WARNING, 
+                   "unable to create OCSP request to %s", batch->responder_url);
+        for (i = 0; i < batch->updates->nelts; ++i) {
+            update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+            if (update->job) update_on_status(update, APR_EGENERAL);
+        }
+        batch_cleanup(batch);
     }
-    return 1;
+    return rv;
 }
 
 void md_ocsp_renew(md_ocsp_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp, apr_time_t *pnext_run)
 {
     md_ocsp_todo_ctx_t ctx;
+    md_ocsp_status_t *ostat;
+    md_ocsp_update_t *update;
+    md_ocsp_batch_t *batch;
     md_http_t *http;
+    apr_array_header_t *selected, *batches;
+    apr_hash_t *open_batches;
+    const char *key;
     apr_status_t rv = APR_SUCCESS;
-    
-    (void)p;
-    (void)pnext_run;
+    int i;
     
     ctx.reg = reg;
     ctx.ptemp = ptemp;
-    ctx.todos = apr_array_make(ptemp, (int)md_ocsp_count(reg), sizeof(md_ocsp_status_t*));
-    ctx.max_parallel = 6; /* the magic number in HTTP */
+    ctx.todos = apr_array_make(ptemp, 10, sizeof(md_ocsp_batch_t*));
+    ctx.max_parallel = reg->max_parallel;
+    selected = apr_array_make(ptemp, 10, sizeof(md_ocsp_status_t*));
+    
+    /* Take all update tasks from the schedule that are needed now or in the next 
+     * minute. They get scheduled again when their update succeeds or fails. */
+    ctx.time = apr_time_now() + apr_time_from_sec(60);
+    apr_thread_mutex_lock(reg->mutex);
+    while ((ostat = md_heap_peek(reg->schedule)) && ostat->next_run <= ctx.time) {
+        md_heap_pop(reg->schedule);
+        APR_ARRAY_PUSH(selected, md_ocsp_status_t*) = ostat;
+    }
+    apr_thread_mutex_unlock(reg->mutex);
     
-    /* Create a list of update tasks that are needed now or in the next minute */
-    ctx.time = apr_time_now() + apr_time_from_sec(60);;
-    apr_hash_do(select_updates, &ctx, reg->hash);
+    /* Group the updates into batches for the same responder and issuer. */
+    batches = apr_array_make(ptemp, 10, sizeof(md_ocsp_batch_t*));
+    open_batches = apr_hash_make(ptemp);
+    for (i = 0; i < selected->nelts; ++i) {
+        ostat = APR_ARRAY_IDX(selected, i, md_ocsp_status_t*);
+        update = apr_pcalloc(ptemp, sizeof(*update));
+        update->p = ptemp;
+        update->ostat = ostat;
+        update->result = md_result_md_make(update->p, ostat->md_name);
+        update->job = NULL;
+        update->rv = APR_SUCCESS;
+        
+        key = (reg->batch_size > 1)? batch_key(ostat, ptemp) : NULL;
+        batch = key? apr_hash_get(open_batches, key, APR_HASH_KEY_STRING) : NULL;
+        if (!batch || batch->updates->nelts >= reg->batch_size) {
+            batch = batch_make(ptemp, ostat->responder_url, 
+                               (reg->batch_size < 10)? reg->batch_size : 10);
+            APR_ARRAY_PUSH(batches, md_ocsp_batch_t*) = batch;
+            if (key) apr_hash_set(open_batches, key, APR_HASH_KEY_STRING, batch);
+        }
+        APR_ARRAY_PUSH(batch->updates, md_ocsp_update_t*) = update;
+    }
+    /* next_todo() takes from the end, put the most urgent ones there */
+    for (i = batches->nelts - 1; i >= 0; --i) {
+        APR_ARRAY_PUSH(ctx.todos, md_ocsp_batch_t*) = APR_ARRAY_IDX(batches, i, md_ocsp_batch_t*);
+    }
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
-                  "OCSP status updates due: %d",  ctx.todos->nelts);
+                  "OCSP status updates due: %d in %d requests",  
+                  selected->nelts, ctx.todos->nelts);
     if (!ctx.todos->nelts) goto leave;
     
     rv = md_http_create(&http, ptemp, reg->user_agent, reg->proxy_url);
@@ -884,14 +1541,21 @@ void md_ocsp_renew(md_ocsp_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp, apr_tim
     rv = md_http_multi_perform(http, next_todo, &ctx);
 
 leave:
+    apr_thread_mutex_lock(reg->mutex);
+    /* Anything we selected, but did not get to update, is tried again
+     * on the planned schedule. */
+    for (i = 0; i < selected->nelts; ++i) {
+        ostat = APR_ARRAY_IDX(selected, i, md_ocsp_status_t*);
+        if (ostat->sched_idx < 0) ostat_schedule(ostat, *pnext_run);
+    }
     /* When do we need to run next? *pnext_run contains the planned schedule from
      * the watchdog. We can make that earlier if we need it. */
-    ctx.time = *pnext_run;
-    apr_hash_do(select_next_run, &ctx, reg->hash);
+    ostat = md_heap_peek(reg->schedule);
+    if (ostat && ostat->next_run < *pnext_run) *pnext_run = ostat->next_run;
+    apr_thread_mutex_unlock(reg->mutex);
 
     /* sanity check and return */
-    if (ctx.time < apr_time_now()) ctx.time = apr_time_now() + apr_time_from_sec(1);
-    *pnext_run = ctx.time;
+    if (*pnext_run < apr_time_now()) *pnext_run = apr_time_now() + apr_time_from_sec(1);
 
     if (APR_SUCCESS != rv && APR_ENOENT != rv) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "ocsp_renew done");
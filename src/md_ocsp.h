@@ -39,17 +39,57 @@ apr_status_t md_ocsp_reg_make(md_ocsp_reg_t **preg, apr_pool_t *p,
                               const md_timeslice_t *renew_window,
                               const char *user_agent, const char *proxy_url);
 
+/* The most certificates queried in one OCSP request. A response for that
+ * many still fits the 4 KB a response may have in shared memory, with the
+ * responder's signature, its certificate and ~110 bytes per certificate. */
+#define MD_OCSP_BATCH_MAX       16
+
+/**
+ * Set how many certificates of the same issuer may be queried in a single
+ * request to their OCSP responder. Defaults to 1, limited to MD_OCSP_BATCH_MAX.
+ * The response then carries the status of all certificates in the batch and
+ * is stapled for each of them.
+ */
+void md_ocsp_set_batch_size(md_ocsp_reg_t *reg, int batch_size);
+
+/**
+ * Make cacheable GET requests as described in RFC 5019 instead of POSTs
+ * with a nonce, when the request is small enough. Responses are then
+ * revalidated with conditional requests and not asked for again while
+ * their Cache-Control max-age says they are fresh.
+ */
+void md_ocsp_set_use_get(md_ocsp_reg_t *reg, int use_get);
+
+/**
+ * Set how many requests to OCSP responders may be open at the same time.
+ * Defaults to MD_REQUEST_PARALLEL_DEF, limited to MD_REQUEST_PARALLEL_MAX.
+ */
+void md_ocsp_set_max_parallel(md_ocsp_reg_t *reg, int max_parallel);
+
 apr_status_t md_ocsp_prime(md_ocsp_reg_t *reg, md_cert_t *x, 
                            md_cert_t *issuer, const md_t *md);
 
+/**
+ * Get the DER encoded OCSP response for the certificate, if one is known.
+ * The X509 is the certificate as primed before. Lookups on primed
+ * certificates do not compute any digests.
+ */
 apr_status_t md_ocsp_get_status(unsigned char **pder, int *pderlen,
-                                md_ocsp_reg_t *reg, const md_cert_t *cert,
+                                md_ocsp_reg_t *reg, void *x509,
                                 apr_pool_t *p, const md_t *md);
 
 apr_status_t md_ocsp_get_meta(md_ocsp_cert_stat_t *pstat, md_timeperiod_t *pvalid,
                               md_ocsp_reg_t *reg, const md_cert_t *cert,
                               apr_pool_t *p, const md_t *md);
 
+/**
+ * Keep the responses of all primed certificates in shared memory. Updates
+ * made by the OCSP watchdog are then seen by all child processes without 
+ * reading the store. Call once in the parent, after all certificates have
+ * been primed.
+ */
+apr_status_t md_ocsp_shm_init(md_ocsp_reg_t *reg, apr_pool_t *p);
+
 apr_size_t md_ocsp_count(md_ocsp_reg_t *reg);
 
 void md_ocsp_renew(md_ocsp_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp, apr_time_t *pnext_run);
@@ -20,8 +20,11 @@
 #include <stdlib.h>
 
 #include <apr_lib.h>
+#include <apr_file_info.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
 #include <apr_uri.h>
 
 #include "md.h"
@@ -199,7 +202,6 @@ static apr_status_t state_init(md_reg_t *reg, apr_pool_t *p, md_t *md)
 {
     md_state_t state;
     const md_pubcert_t *pub;
-    const md_cert_t *cert;
     apr_status_t rv = APR_SUCCESS;
     md_pkey_spec_t *spec;
     int i;
@@ -210,7 +212,6 @@ static apr_status_t state_init(md_reg_t *reg, apr_pool_t *p, md_t *md)
     for (i = 0; i < md_pkeys_spec_count(md->pks); ++i) {
         spec = md_pkeys_spec_get(md->pks, i);
         if (APR_SUCCESS == (rv = md_reg_get_pubcert(&pub, reg, md, spec, p))) {
-            cert = APR_ARRAY_IDX(pub->certs, 0, const md_cert_t*);
             if (!md_is_covered_by_alt_names(md, pub->alt_names)) {
                 state = MD_S_INCOMPLETE;
                 md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
@@ -218,7 +219,7 @@ static apr_status_t state_init(md_reg_t *reg, apr_pool_t *p, md_t *md)
                               md->name, md_pkey_spec_name(spec));
                 goto out;
             }
-            if (!md->must_staple != !md_cert_must_staple(cert)) {
+            if (!md->must_staple != !pub->must_staple) {
                 state = MD_S_INCOMPLETE;
                 md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
                               "md{%s}: incomplete, OCSP Stapling is%s requested, but "
@@ -526,6 +527,16 @@ apr_status_t md_reg_delete_acct(md_reg_t *reg, apr_pool_t *p, const char *acct_i
 /**************************************************************************************************/
 /* certificate related */
 
+static apr_status_t pubcert_fname(const char **pfname, md_reg_t *reg, md_store_group_t group,
+                                  const md_t *md, md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    if (md->cert_file) {
+        *pfname = md->cert_file;
+        return APR_SUCCESS;
+    }
+    return md_store_get_fname(pfname, reg->store, group, md->name, md_chain_filename(spec, p), p);
+}
+
 static apr_status_t pubcert_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
 {
     md_reg_t *reg = baton;
@@ -553,8 +564,14 @@ static apr_status_t pubcert_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp,
             
     pubcert = apr_pcalloc(p, sizeof(*pubcert));
     pubcert->certs = certs;
+    if (APR_SUCCESS != (rv = pubcert_fname(&pubcert->cert_file, reg, group, md, spec, p))) {
+        goto leave;
+    }
     cert = APR_ARRAY_IDX(certs, 0, const md_cert_t *);
     if (APR_SUCCESS != (rv = md_cert_get_alt_names(&pubcert->alt_names, cert, p))) goto leave;
+    pubcert->not_before = md_cert_get_not_before(cert);
+    pubcert->not_after = md_cert_get_not_after(cert);
+    pubcert->must_staple = md_cert_must_staple(cert);
     switch ((cert_state = md_cert_state_get(cert))) {
         case MD_CERT_VALID:
         case MD_CERT_EXPIRED:
@@ -590,13 +607,338 @@ apr_status_t md_reg_get_pubcert(const md_pubcert_t **ppubcert, md_reg_t *reg,
         apr_hash_set(reg->certs, name, (apr_ssize_t)strlen(name), pubcert);
     }
 leave:
-    if (APR_SUCCESS == rv && (!pubcert || !pubcert->certs)) {
+    if (APR_SUCCESS == rv && (!pubcert || !pubcert->cert_file)) {
         rv = APR_ENOENT;
     }
     *ppubcert = (APR_SUCCESS == rv)? pubcert : NULL;
     return rv;
 }
 
+typedef struct {
+    const md_t *md;
+    md_pkey_spec_t *spec;
+    const char *name;
+    md_pubcert_t *pubcert;
+    apr_status_t rv;
+} pubcert_job_t;
+
+typedef struct {
+    md_reg_t *reg;
+    apr_array_header_t *jobs;
+    int next_job;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;      /* protects next_job */
+#endif
+} pubcert_load_ctx_t;
+
+typedef struct {
+    pubcert_load_ctx_t *ctx;
+    apr_pool_t *p;                  /* with own allocator, the certificates live here */
+} pubcert_worker_t;
+
+static pubcert_job_t *next_pubcert_job(pubcert_load_ctx_t *ctx)
+{
+    pubcert_job_t *job = NULL;
+    
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(ctx->mutex);
+#endif
+    if (ctx->next_job < ctx->jobs->nelts) {
+        job = &APR_ARRAY_IDX(ctx->jobs, ctx->next_job++, pubcert_job_t);
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(ctx->mutex);
+#endif
+    return job;
+}
+
+static void load_pubcert_jobs(pubcert_worker_t *worker)
+{
+    pubcert_job_t *job;
+    
+    while ((job = next_pubcert_job(worker->ctx))) {
+        job->rv = md_util_pool_vdo(pubcert_load, worker->ctx->reg, worker->p, &job->pubcert, 
+                                   MD_SG_DOMAINS, job->md, job->spec, NULL);
+    }
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC pubcert_worker_run(apr_thread_t *thread, void *data)
+{
+    (void)thread;
+    load_pubcert_jobs(data);
+    return NULL;
+}
+#endif
+
+static apr_status_t worker_pool_create(apr_pool_t **ppool, apr_pool_t *parent)
+{
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+    
+    /* A pool with own allocator, so it may be used independent of other threads */
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) return rv;
+    rv = apr_pool_create_ex(ppool, parent, NULL, allocator);
+    if (rv != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, *ppool);
+    apr_pool_tag(*ppool, "md_reg_pubcerts");
+    return APR_SUCCESS;
+}
+
+/* Load the pubcerts of all mds that are not in the cache. With chains set, also
+ * those only cached as snapshot record, without a parsed chain. */
+static apr_status_t load_pubcerts(md_reg_t *reg, apr_array_header_t *mds, int nworkers,
+                                  int chains, apr_pool_t *p)
+{
+#if APR_HAS_THREADS
+    pubcert_load_ctx_t ctx;
+    pubcert_worker_t *workers;
+    pubcert_job_t *job;
+    apr_thread_t **threads;
+    const md_t *md;
+    md_pubcert_t *cached;
+    md_pkey_spec_t *spec;
+    const char *name;
+    apr_status_t rv, wrv;
+    apr_time_t start;
+    int i, j, nthreads;
+    
+    if (reg->domains_frozen || nworkers <= 1) return APR_SUCCESS;
+    
+    ctx.reg = reg;
+    ctx.next_job = 0;
+    ctx.jobs = apr_array_make(p, mds->nelts, sizeof(pubcert_job_t));
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, const md_t *);
+        for (j = 0; j < md_pkeys_spec_count(md->pks); ++j) {
+            spec = md_pkeys_spec_get(md->pks, j);
+            name = apr_pstrcat(p, md->name, "[", md_pkey_spec_name(spec), "]", NULL);
+            cached = apr_hash_get(reg->certs, name, (apr_ssize_t)strlen(name));
+            if (cached && (!chains || !cached->cert_file || cached->certs)) continue;
+            job = apr_array_push(ctx.jobs);
+            memset(job, 0, sizeof(*job));
+            job->md = md;
+            job->spec = spec;
+            job->name = name;
+        }
+    }
+    if (ctx.jobs->nelts < 2) return APR_SUCCESS;
+    if (nworkers > ctx.jobs->nelts) nworkers = ctx.jobs->nelts;
+    
+    rv = apr_thread_mutex_create(&ctx.mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (APR_SUCCESS != rv) goto leave;
+    workers = apr_pcalloc(p, (apr_size_t)nworkers * sizeof(*workers));
+    for (i = 0; i < nworkers; ++i) {
+        workers[i].ctx = &ctx;
+        if (APR_SUCCESS != (rv = worker_pool_create(&workers[i].p, reg->p))) goto leave;
+    }
+    
+    start = apr_time_now();
+    /* The calling thread is one of the workers */
+    threads = apr_pcalloc(p, (apr_size_t)nworkers * sizeof(*threads));
+    for (nthreads = 0; nthreads < nworkers - 1; ++nthreads) {
+        rv = apr_thread_create(&threads[nthreads], NULL, pubcert_worker_run, 
+                               &workers[nthreads + 1], p);
+        if (APR_SUCCESS != rv) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                          "creating certificate loader thread %d", nthreads);
+            rv = APR_SUCCESS;
+            break;
+        }
+    }
+    load_pubcert_jobs(&workers[0]);
+    for (i = 0; i < nthreads; ++i) {
+        apr_thread_join(&wrv, threads[i]);
+    }
+    
+    for (i = 0; i < ctx.jobs->nelts; ++i) {
+        job = &APR_ARRAY_IDX(ctx.jobs, i, pubcert_job_t);
+        cached = apr_hash_get(reg->certs, job->name, (apr_ssize_t)strlen(job->name));
+        if (cached) {
+            /* a snapshot record, only the chain was missing */
+            if (APR_SUCCESS == job->rv) cached->certs = job->pubcert->certs;
+            continue;
+        }
+        if (APR_STATUS_IS_ENOENT(job->rv)) {
+            /* We cache it missing with an empty record */
+            job->pubcert = apr_pcalloc(reg->p, sizeof(*job->pubcert));
+        }
+        else if (APR_SUCCESS != job->rv) {
+            continue;
+        }
+        name = apr_pstrdup(reg->p, job->name);
+        apr_hash_set(reg->certs, name, (apr_ssize_t)strlen(name), job->pubcert);
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                  "loaded %d certificates with %d threads in %ld ms", ctx.jobs->nelts, 
+                  nthreads + 1, (long)apr_time_as_msec(apr_time_now() - start));
+leave:
+    return rv;
+#else
+    (void)reg;
+    (void)mds;
+    (void)nworkers;
+    (void)chains;
+    (void)p;
+    return APR_SUCCESS;
+#endif
+}
+
+apr_status_t md_reg_load_pubcerts(md_reg_t *reg, apr_array_header_t *mds, int nworkers,
+                                  apr_pool_t *p)
+{
+    return load_pubcerts(reg, mds, nworkers, 0, p);
+}
+
+apr_status_t md_reg_load_pubcert_chains(md_reg_t *reg, apr_array_header_t *mds, int nworkers,
+                                        apr_pool_t *p)
+{
+    if (reg->domains_frozen) return APR_EACCES;
+    return load_pubcerts(reg, mds, nworkers, 1, p);
+}
+
+apr_status_t md_reg_get_pubcert_chain(apr_array_header_t **pcerts, md_reg_t *reg, 
+                                      const md_t *md, md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    const md_pubcert_t *pubcert;
+    md_pubcert_t *loaded;
+    apr_status_t rv;
+    
+    *pcerts = NULL;
+    if (APR_SUCCESS != (rv = md_reg_get_pubcert(&pubcert, reg, md, spec, p))) goto leave;
+    if (pubcert->certs) {
+        *pcerts = pubcert->certs;
+        goto leave;
+    }
+    /* A snapshot record in a registry that was never frozen. Load without caching. */
+    rv = md_util_pool_vdo(pubcert_load, reg, p, &loaded, MD_SG_DOMAINS, md, spec, NULL);
+    if (APR_SUCCESS == rv) *pcerts = loaded->certs;
+leave:
+    return rv;
+}
+
+/**************************************************************************************************/
+/* startup snapshot */
+
+/* The snapshot keeps, for each certificate chain in use, what the registry needs
+ * to know at startup. A chain whose file has the same modification time and size
+ * as recorded is not parsed again. Increase the version when the format changes. */
+#define MD_SNAPSHOT_VERSION     1
+
+static int snapshot_entry_matches(md_json_t *entry, const char *fpath, apr_pool_t *p)
+{
+    apr_finfo_t finfo;
+    const char *s;
+    
+    if (!entry) return 0;
+    if (!(s = md_json_gets(entry, MD_KEY_CERT_FILE, NULL)) || strcmp(s, fpath)) return 0;
+    if (APR_SUCCESS != apr_stat(&finfo, fpath, APR_FINFO_MTIME|APR_FINFO_SIZE, p)) return 0;
+    if (!(s = md_json_gets(entry, MD_KEY_MODIFIED, NULL)) || apr_atoi64(s) != finfo.mtime) return 0;
+    return md_json_getl(entry, MD_KEY_SIZE, NULL) == (long)finfo.size;
+}
+
+apr_status_t md_reg_snapshot_load(md_reg_t *reg, apr_array_header_t *mds, apr_pool_t *p)
+{
+    md_json_t *json, *entry;
+    md_pubcert_t *pubcert;
+    md_timeperiod_t valid;
+    const md_t *md;
+    md_pkey_spec_t *spec;
+    const char *name, *fpath;
+    apr_status_t rv;
+    int i, j, total = 0, unchanged = 0;
+    
+    if (reg->domains_frozen) return APR_EACCES;
+    rv = md_store_load_json(reg->store, MD_SG_NONE, NULL, MD_FN_SNAPSHOT, &json, p);
+    if (APR_SUCCESS != rv) goto leave;
+    if (md_json_getl(json, MD_KEY_VERSION, NULL) != MD_SNAPSHOT_VERSION) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "snapshot: version differs, ignored");
+        goto leave;
+    }
+    
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, const md_t *);
+        for (j = 0; j < md_pkeys_spec_count(md->pks); ++j) {
+            spec = md_pkeys_spec_get(md->pks, j);
+            ++total;
+            name = apr_pstrcat(p, md->name, "[", md_pkey_spec_name(spec), "]", NULL);
+            if (apr_hash_get(reg->certs, name, (apr_ssize_t)strlen(name))) continue;
+            entry = md_json_getj(json, MD_KEY_CERTS, name, NULL);
+            if (APR_SUCCESS != pubcert_fname(&fpath, reg, MD_SG_DOMAINS, md, spec, p)
+                || !snapshot_entry_matches(entry, fpath, p)
+                || APR_SUCCESS != md_json_get_timeperiod(&valid, entry, MD_KEY_VALID, NULL)) {
+                continue;
+            }
+            
+            pubcert = apr_pcalloc(reg->p, sizeof(*pubcert));
+            pubcert->cert_file = apr_pstrdup(reg->p, fpath);
+            pubcert->not_before = valid.start;
+            pubcert->not_after = valid.end;
+            pubcert->must_staple = md_json_getb(entry, MD_KEY_MUST_STAPLE, NULL);
+            pubcert->from_snapshot = 1;
+            pubcert->alt_names = apr_array_make(reg->p, 5, sizeof(const char *));
+            md_json_dupsa(pubcert->alt_names, reg->p, entry, MD_KEY_DOMAINS, NULL);
+            name = apr_pstrdup(reg->p, name);
+            apr_hash_set(reg->certs, name, (apr_ssize_t)strlen(name), pubcert);
+            ++unchanged;
+        }
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                  "snapshot: %d of %d certificates unchanged", unchanged, total);
+leave:
+    return rv;
+}
+
+apr_status_t md_reg_snapshot_save(md_reg_t *reg, apr_array_header_t *mds, apr_pool_t *p)
+{
+    md_json_t *json, *entry;
+    const md_pubcert_t *pubcert;
+    md_timeperiod_t valid;
+    apr_finfo_t finfo;
+    const md_t *md;
+    md_pkey_spec_t *spec;
+    const char *name;
+    apr_status_t rv;
+    int i, j, loaded = 0;
+    
+    json = md_json_create(p);
+    md_json_setl(MD_SNAPSHOT_VERSION, json, MD_KEY_VERSION, NULL);
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, const md_t *);
+        for (j = 0; j < md_pkeys_spec_count(md->pks); ++j) {
+            spec = md_pkeys_spec_get(md->pks, j);
+            name = apr_pstrcat(p, md->name, "[", md_pkey_spec_name(spec), "]", NULL);
+            pubcert = apr_hash_get(reg->certs, name, (apr_ssize_t)strlen(name));
+            if (!pubcert || !pubcert->cert_file) continue;
+            if (!pubcert->from_snapshot) ++loaded;
+            if (APR_SUCCESS != apr_stat(&finfo, pubcert->cert_file, 
+                                        APR_FINFO_MTIME|APR_FINFO_SIZE, p)) continue;
+            
+            entry = md_json_create(p);
+            md_json_sets(pubcert->cert_file, entry, MD_KEY_CERT_FILE, NULL);
+            md_json_sets(apr_psprintf(p, "%" APR_TIME_T_FMT, finfo.mtime), 
+                         entry, MD_KEY_MODIFIED, NULL);
+            md_json_setl((long)finfo.size, entry, MD_KEY_SIZE, NULL);
+            valid.start = pubcert->not_before;
+            valid.end = pubcert->not_after;
+            md_json_set_timeperiod(&valid, entry, MD_KEY_VALID, NULL);
+            md_json_setb(pubcert->must_staple, entry, MD_KEY_MUST_STAPLE, NULL);
+            md_json_setsa(pubcert->alt_names, entry, MD_KEY_DOMAINS, NULL);
+            md_json_setj(entry, json, MD_KEY_CERTS, name, NULL);
+        }
+    }
+    /* All chains came from the snapshot, it is still up to date */
+    if (!loaded) return APR_SUCCESS;
+    rv = md_store_save_json(reg->store, p, MD_SG_NONE, NULL, MD_FN_SNAPSHOT, json, 0);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "snapshot: saving");
+    }
+    return rv;
+}
+
 apr_status_t md_reg_get_cred_files(const char **pkeyfile, const char **pcertfile,
                                    md_reg_t *reg, md_store_group_t group, 
                                    const md_t *md, md_pkey_spec_t *spec, apr_pool_t *p)
@@ -621,7 +963,6 @@ apr_status_t md_reg_get_cred_files(const char **pkeyfile, const char **pcertfile
 apr_time_t md_reg_valid_until(md_reg_t *reg, const md_t *md, apr_pool_t *p)
 {
     const md_pubcert_t *pub;
-    const md_cert_t *cert;
     md_pkey_spec_t *spec;
     int i;
     apr_time_t t, valid_until = 0;
@@ -631,8 +972,7 @@ apr_time_t md_reg_valid_until(md_reg_t *reg, const md_t *md, apr_pool_t *p)
         spec = md_pkeys_spec_get(md->pks, i);
         rv = md_reg_get_pubcert(&pub, reg, md, spec, p);
         if (APR_SUCCESS == rv) {
-            cert = APR_ARRAY_IDX(pub->certs, 0, const md_cert_t*);
-            t = md_cert_get_not_after(cert);
+            t = pub->not_after;
             if (valid_until == 0 || t < valid_until) {
                 valid_until = t;
             }
@@ -644,7 +984,6 @@ apr_time_t md_reg_valid_until(md_reg_t *reg, const md_t *md, apr_pool_t *p)
 apr_time_t md_reg_renew_at(md_reg_t *reg, const md_t *md, apr_pool_t *p)
 {
     const md_pubcert_t *pub;
-    const md_cert_t *cert;
     md_timeperiod_t certlife, renewal;
     md_pkey_spec_t *spec;
     int i;
@@ -657,9 +996,8 @@ apr_time_t md_reg_renew_at(md_reg_t *reg, const md_t *md, apr_pool_t *p)
         rv = md_reg_get_pubcert(&pub, reg, md, spec, p);
         if (APR_STATUS_IS_ENOENT(rv)) return apr_time_now();
         if (APR_SUCCESS == rv) {
-            cert = APR_ARRAY_IDX(pub->certs, 0, const md_cert_t*);
-            certlife.start = md_cert_get_not_before(cert);
-            certlife.end = md_cert_get_not_after(cert);
+            certlife.start = pub->not_before;
+            certlife.end = pub->not_after;
 
             renewal = md_timeperiod_slice_before_end(&certlife, md->renew_window);
             if (md_log_is_level(p, MD_LOG_TRACE1)) {
@@ -689,7 +1027,6 @@ int md_reg_should_renew(md_reg_t *reg, const md_t *md, apr_pool_t *p)
 int md_reg_should_warn(md_reg_t *reg, const md_t *md, apr_pool_t *p)
 {
     const md_pubcert_t *pub;
-    const md_cert_t *cert;
     md_timeperiod_t certlife, warn;
     md_pkey_spec_t *spec;
     int i;
@@ -701,9 +1038,8 @@ int md_reg_should_warn(md_reg_t *reg, const md_t *md, apr_pool_t *p)
         rv = md_reg_get_pubcert(&pub, reg, md, spec, p);
         if (APR_STATUS_IS_ENOENT(rv)) return 0;
         if (APR_SUCCESS == rv) {
-            cert = APR_ARRAY_IDX(pub->certs, 0, const md_cert_t*);
-            certlife.start = md_cert_get_not_before(cert);
-            certlife.end = md_cert_get_not_after(cert);
+            certlife.start = pub->not_before;
+            certlife.end = pub->not_after;
             
             warn = md_timeperiod_slice_before_end(&certlife, md->warn_window);
             if (md_log_is_level(p, MD_LOG_TRACE1)) {
@@ -742,45 +1078,18 @@ apr_status_t md_reg_set_props(md_reg_t *reg, apr_pool_t *p, int can_http, int ca
     return APR_SUCCESS;
 }
 
-static md_t *find_closest_match(apr_array_header_t *mds, const md_t *md)
-{
-    md_t *candidate, *m;
-    apr_size_t cand_n, n;
-    int i;
-    
-    candidate = md_get_by_name(mds, md->name);
-    if (!candidate) {
-        /* try to find an instance that contains all domain names from md */ 
-        for (i = 0; i < mds->nelts; ++i) {
-            m = APR_ARRAY_IDX(mds, i, md_t *);
-            if (md_contains_domains(m, md)) {
-                return m;
-            }
-        }
-        /* no matching name and no md in the list has all domains.
-         * We consider that managed domain as closest match that contains at least one
-         * domain name from md, ONLY if there is no other one that also has.
-         */
-        cand_n = 0;
-        for (i = 0; i < mds->nelts; ++i) {
-            m = APR_ARRAY_IDX(mds, i, md_t *);
-            n = md_common_name_count(md, m);
-            if (n > cand_n) {
-                candidate = m;
-                cand_n = n;
-            }
-        }
-    }
-    return candidate;
-}
-
 typedef struct {
     apr_pool_t *p;
     apr_array_header_t *master_mds;
     apr_array_header_t *store_names;
+    apr_hash_t *store_name_set;      /* names in store_names */
+    apr_hash_t *master_names;        /* names of master_mds */
     apr_array_header_t *maybe_new_mds;
     apr_array_header_t *new_mds;
     apr_array_header_t *unassigned_mds;
+    apr_hash_t *unassigned_names;    /* name -> md_t* from unassigned_mds */
+    apr_hash_t *unassigned_domains;  /* lower case domain -> indices into unassigned_mds */
+    apr_hash_t *moved;               /* md_t* from unassigned_mds that have been renamed */
 } sync_ctx_v2;
 
 static int iter_add_name(void *baton, const char *dir, const char *name, 
@@ -792,10 +1101,110 @@ static int iter_add_name(void *baton, const char *dir, const char *name,
     (void)value;
     (void)ptemp;
     (void)vtype;
-    APR_ARRAY_PUSH(ctx->store_names, const char*) = apr_pstrdup(ctx->p, name);
+    name = apr_pstrdup(ctx->p, name);
+    APR_ARRAY_PUSH(ctx->store_names, const char*) = name;
+    apr_hash_set(ctx->store_name_set, name, APR_HASH_KEY_STRING, name);
     return APR_SUCCESS;
 }
 
+static apr_array_header_t *sync_domain_get(sync_ctx_v2 *ctx, const char *domain, 
+                                           int create, apr_pool_t *p)
+{
+    apr_array_header_t *indices;
+    const char *key = md_util_str_tolower(apr_pstrdup(p, domain));
+    
+    indices = apr_hash_get(ctx->unassigned_domains, key, APR_HASH_KEY_STRING);
+    if (!indices && create) {
+        indices = apr_array_make(ctx->p, 1, sizeof(int));
+        apr_hash_set(ctx->unassigned_domains, key, APR_HASH_KEY_STRING, indices);
+    }
+    return indices;
+}
+
+static void sync_index_unassigned(sync_ctx_v2 *ctx)
+{
+    apr_array_header_t *indices;
+    md_t *m;
+    int i, j;
+    
+    for (i = 0; i < ctx->unassigned_mds->nelts; ++i) {
+        m = APR_ARRAY_IDX(ctx->unassigned_mds, i, md_t *);
+        if (!apr_hash_get(ctx->unassigned_names, m->name, APR_HASH_KEY_STRING)) {
+            apr_hash_set(ctx->unassigned_names, m->name, APR_HASH_KEY_STRING, m);
+        }
+        for (j = 0; j < m->domains->nelts; ++j) {
+            indices = sync_domain_get(ctx, APR_ARRAY_IDX(m->domains, j, const char*), 1, ctx->p);
+            if (!indices->nelts || APR_ARRAY_IDX(indices, indices->nelts-1, int) != i) {
+                APR_ARRAY_PUSH(indices, int) = i;
+            }
+        }
+    }
+}
+
+static md_t *sync_unassigned_at(sync_ctx_v2 *ctx, int idx)
+{
+    md_t *m = APR_ARRAY_IDX(ctx->unassigned_mds, idx, md_t *);
+    return apr_hash_get(ctx->moved, &m, sizeof(m))? NULL : m;
+}
+
+/* Find the unassigned MD that md was most likely named before. Only MDs sharing
+ * a domain with md are looked at, via the domain index. */
+static md_t *find_closest_match(sync_ctx_v2 *ctx, const md_t *md, apr_pool_t *ptemp)
+{
+    apr_array_header_t *indices;
+    apr_hash_t *counts;
+    apr_hash_index_t *hi;
+    md_t *candidate, *m;
+    const int *pidx;
+    int i, j, idx, cand_idx, *pcount, cand_n;
+    
+    candidate = apr_hash_get(ctx->unassigned_names, md->name, APR_HASH_KEY_STRING);
+    if (candidate && !apr_hash_get(ctx->moved, &candidate, sizeof(candidate))) {
+        return candidate;
+    }
+    if (!md->domains->nelts) return NULL;
+    
+    /* try to find an instance that contains all domain names from md */ 
+    indices = sync_domain_get(ctx, APR_ARRAY_IDX(md->domains, 0, const char*), 0, ptemp);
+    for (i = 0; indices && i < indices->nelts; ++i) {
+        m = sync_unassigned_at(ctx, APR_ARRAY_IDX(indices, i, int));
+        if (m && md_contains_domains(m, md)) {
+            return m;
+        }
+    }
+    /* no matching name and no md in the list has all domains.
+     * We consider that managed domain as closest match that contains the most
+     * domain names from md, the first one found if several have the same number.
+     */
+    counts = apr_hash_make(ptemp);
+    for (i = 0; i < md->domains->nelts; ++i) {
+        indices = sync_domain_get(ctx, APR_ARRAY_IDX(md->domains, i, const char*), 0, ptemp);
+        for (j = 0; indices && j < indices->nelts; ++j) {
+            pidx = &APR_ARRAY_IDX(indices, j, int);
+            pcount = apr_hash_get(counts, pidx, sizeof(*pidx));
+            if (!pcount) {
+                pcount = apr_pcalloc(ptemp, sizeof(*pcount));
+                apr_hash_set(counts, pidx, sizeof(*pidx), pcount);
+            }
+            ++(*pcount);
+        }
+    }
+    candidate = NULL;
+    cand_idx = -1;
+    cand_n = 0;
+    for (hi = apr_hash_first(ptemp, counts); hi; hi = apr_hash_next(hi)) {
+        idx = *(const int*)apr_hash_this_key(hi);
+        pcount = apr_hash_this_val(hi);
+        if ((*pcount > cand_n || (*pcount == cand_n && idx < cand_idx))
+            && (m = sync_unassigned_at(ctx, idx))) {
+            candidate = m;
+            cand_idx = idx;
+            cand_n = *pcount;
+        }
+    }
+    return candidate;
+}
+
 /* A better scaling version:
  *  1. The consistency of the MDs in 'master_mds' has already been verified. E.g.
  *     that no domain lists overlap etc.
@@ -807,23 +1216,31 @@ static int iter_add_name(void *baton, const char *dir, const char *name,
  *      - if we find it, we assume this is a rename and move the old MD to the new name.
  *      - if not, MD is completely new.
  *  4. Any MD in store that does not match the "master_mds" will just be left as is. 
+ * Names and domains are looked up in hashes, so this stays near linear in the
+ * number of MDs.
  */
 apr_status_t md_reg_sync_start(md_reg_t *reg, apr_array_header_t *master_mds, apr_pool_t *p) 
 {
     sync_ctx_v2 ctx;
     apr_status_t rv;
+    apr_pool_t *ptemp;
     md_t *md, *oldmd;
     const char *name;
-    int i, idx;
+    int i;
     
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "sync MDs, start");
      
     ctx.p = p;
     ctx.master_mds = master_mds;
     ctx.store_names = apr_array_make(p, master_mds->nelts + 100, sizeof(const char*));
+    ctx.store_name_set = apr_hash_make(p);
+    ctx.master_names = apr_hash_make(p);
     ctx.maybe_new_mds = apr_array_make(p, master_mds->nelts, sizeof(md_t*));
     ctx.new_mds = apr_array_make(p, master_mds->nelts, sizeof(md_t*));
     ctx.unassigned_mds = apr_array_make(p, master_mds->nelts, sizeof(md_t*));
+    ctx.unassigned_names = apr_hash_make(p);
+    ctx.unassigned_domains = apr_hash_make(p);
+    ctx.moved = apr_hash_make(p);
     
     rv = md_store_iter_names(iter_add_name, &ctx, reg->store, p, MD_SG_DOMAINS, "*");
     if (APR_SUCCESS != rv) {
@@ -834,10 +1251,9 @@ apr_status_t md_reg_sync_start(md_reg_t *reg, apr_array_header_t *master_mds, ap
     /* Get all MDs that are not already present in store */
     for (i = 0; i < ctx.master_mds->nelts; ++i) {
         md = APR_ARRAY_IDX(ctx.master_mds, i, md_t*);
-        idx = md_array_str_index(ctx.store_names, md->name, 0, 1);
-        if (idx < 0) {
+        apr_hash_set(ctx.master_names, md->name, APR_HASH_KEY_STRING, md);
+        if (!apr_hash_get(ctx.store_name_set, md->name, APR_HASH_KEY_STRING)) {
             APR_ARRAY_PUSH(ctx.maybe_new_mds, md_t*) = md;
-            md_array_remove_at(ctx.store_names, idx);
         }
     }
     
@@ -847,19 +1263,24 @@ apr_status_t md_reg_sync_start(md_reg_t *reg, apr_array_header_t *master_mds, ap
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
                   "sync MDs, %d potentially new MDs detected, looking for renames among "
                   "the %d unassigned store domains", (int)ctx.maybe_new_mds->nelts,
-                  (int)ctx.store_names->nelts);
+                  (int)(ctx.store_names->nelts - (ctx.master_mds->nelts 
+                                                  - ctx.maybe_new_mds->nelts)));
     for (i = 0; i < ctx.store_names->nelts; ++i) {
         name = APR_ARRAY_IDX(ctx.store_names, i, const char*);
+        if (apr_hash_get(ctx.master_names, name, APR_HASH_KEY_STRING)) continue;
         if (APR_SUCCESS == md_load(reg->store, MD_SG_DOMAINS, name, &md, p)) {
             APR_ARRAY_PUSH(ctx.unassigned_mds, md_t*) = md;
         } 
     }
+    sync_index_unassigned(&ctx);
     
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
                   "sync MDs, %d MDs maybe new, checking store", (int)ctx.maybe_new_mds->nelts);
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) goto leave;
     for (i = 0; i < ctx.maybe_new_mds->nelts; ++i) {
         md = APR_ARRAY_IDX(ctx.maybe_new_mds, i, md_t*);
-        oldmd = find_closest_match(ctx.unassigned_mds, md);
+        oldmd = find_closest_match(&ctx, md, ptemp);
+        apr_pool_clear(ptemp);
         if (oldmd) {
             /* found the rename, move the domains and possible staging directory */
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
@@ -871,12 +1292,13 @@ apr_status_t md_reg_sync_start(md_reg_t *reg, apr_array_header_t *master_mds, ap
                 /* ignore it? */
             }
             md_store_rename(reg->store, p, MD_SG_STAGING, oldmd->name, md->name);
-            md_array_remove(ctx.unassigned_mds, oldmd);
+            apr_hash_set(ctx.moved, apr_pmemdup(p, &oldmd, sizeof(oldmd)), sizeof(oldmd), oldmd);
         }
         else {
             APR_ARRAY_PUSH(ctx.new_mds, md_t*) = md;
         }
     }
+    apr_pool_destroy(ptemp);
 
 leave:
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
@@ -1202,16 +1624,34 @@ apr_status_t md_reg_freeze_domains(md_reg_t *reg, apr_array_header_t *mds)
     apr_status_t rv = APR_SUCCESS;
     md_t *md;
     const md_pubcert_t *pubcert;
+    md_pubcert_t *cached, *loaded;
     md_pkey_spec_t *spec;
+    const char *name;
     int i, j;
     
     assert(!reg->domains_frozen);
-    /* prefill the certs cache for all mds */
+    /* prefill the certs cache for all mds. Records from the snapshot get their
+     * chains parsed here. Once frozen, the status handlers in the child processes 
+     * have only the cache, they may not be allowed to read MD_SG_DOMAINS. */
     for (i = 0; i < mds->nelts; ++i) {
         md = APR_ARRAY_IDX(mds, i, md_t*);
         for (j = 0; j < md_pkeys_spec_count(md->pks); ++j) {
             spec = md_pkeys_spec_get(md->pks, j);
             rv = md_reg_get_pubcert(&pubcert, reg, md, spec, reg->p);
+            if (APR_SUCCESS == rv && !pubcert->certs) {
+                name = apr_pstrcat(reg->p, md->name, "[", md_pkey_spec_name(spec), "]", NULL);
+                cached = apr_hash_get(reg->certs, name, (apr_ssize_t)strlen(name));
+                rv = md_util_pool_vdo(pubcert_load, reg, reg->p, &loaded, 
+                                      MD_SG_DOMAINS, md, spec, NULL);
+                if (APR_SUCCESS == rv) {
+                    cached->certs = loaded->certs;
+                }
+                else {
+                    md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, reg->p, 
+                                  "%s: parsing certificate chain", name);
+                    rv = APR_SUCCESS;
+                }
+            }
             if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) goto leave;
         }
     }
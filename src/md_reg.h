@@ -111,10 +111,21 @@ apr_status_t md_reg_update(md_reg_t *reg, apr_pool_t *p,
 /**
  * Get the chain of public certificates of the managed domain md, starting with the cert
  * of the domain and going up the issuers. Returns APR_ENOENT when not available. 
+ * Records taken from the startup snapshot carry no chain, only the properties
+ * of the leaf certificate.
  */
 apr_status_t md_reg_get_pubcert(const md_pubcert_t **ppubcert, md_reg_t *reg, 
                                 const md_t *md, struct md_pkey_spec_t *spec, apr_pool_t *p);
 
+/**
+ * Get the certificate chain of the managed domain md. A frozen registry has all
+ * chains cached. Otherwise, it is loaded into p if the registry only has the 
+ * snapshot record for it. Returns APR_ENOENT when not available.
+ */
+apr_status_t md_reg_get_pubcert_chain(apr_array_header_t **pcerts, md_reg_t *reg, 
+                                      const md_t *md, struct md_pkey_spec_t *spec, 
+                                      apr_pool_t *p);
+
 /**
  * Get the filenames of private key and pubcert of the MD - if they exist.
  * @return APR_ENOENT if one or both do not exist.
@@ -128,6 +139,35 @@ apr_status_t md_reg_get_cred_files(const char **pkeyfile, const char **pcertfile
  */
 apr_status_t md_reg_sync_start(md_reg_t *reg, apr_array_header_t *master_mds, apr_pool_t *p);
 
+/**
+ * Load the certificates of all mds with up to nworkers threads, so that the
+ * following md_reg_sync_finish() calls find them ready. Certificates that fail 
+ * to load are not remembered, md_reg_sync_finish() will try them again.
+ */
+apr_status_t md_reg_load_pubcerts(md_reg_t *reg, apr_array_header_t *mds, int nworkers,
+                                  apr_pool_t *p);
+
+/**
+ * Parse the certificate chains of all mds whose records were taken from the
+ * snapshot, using up to nworkers threads. Call before md_reg_freeze_domains(),
+ * which otherwise parses them one by one.
+ */
+apr_status_t md_reg_load_pubcert_chains(md_reg_t *reg, apr_array_header_t *mds, int nworkers,
+                                        apr_pool_t *p);
+
+/**
+ * Take the certificate records of all mds from the snapshot in the store, where
+ * the chain file is unchanged since the snapshot was saved. Returns APR_ENOENT
+ * when there is no snapshot. Call before md_reg_load_pubcerts().
+ */
+apr_status_t md_reg_snapshot_load(md_reg_t *reg, apr_array_header_t *mds, apr_pool_t *p);
+
+/**
+ * Save the certificate records of all mds as snapshot in the store, unless all
+ * of them were taken from the snapshot already.
+ */
+apr_status_t md_reg_snapshot_save(md_reg_t *reg, apr_array_header_t *mds, apr_pool_t *p);
+
 /**
  * Re-compute the state of the MD, given current store contents.
  */
@@ -156,7 +196,8 @@ apr_status_t md_reg_cleanup_challenges(md_reg_t *reg, apr_pool_t *p, apr_pool_t
 /**
  * Mark all information from group MD_SG_DOMAINS as readonly, deny future modifications 
  * (MD_SG_STAGING and MD_SG_CHALLENGES remain writeable). For the given MDs, cache
- * the public information (MDs themselves and their pubcerts or lack of).
+ * the public information (MDs themselves and their pubcerts, with parsed chains, 
+ * or lack of).
  */
 apr_status_t md_reg_freeze_domains(md_reg_t *reg, apr_array_header_t *mds);
 
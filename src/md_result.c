@@ -91,6 +91,7 @@ void md_result_activity_printf(md_result_t *result, const char *fmt, ...)
 void md_result_set(md_result_t *result, apr_status_t status, const char *detail)
 {
     result->status = status;
+    result->yielded = 0;
     result->problem = NULL;
     result->detail = detail? apr_pstrdup(result->p, detail) : NULL;
     result->subproblems = NULL;
@@ -102,6 +103,7 @@ void md_result_problem_set(md_result_t *result, apr_status_t status,
                            const md_json_t *subproblems)
 {
     result->status = status;
+    result->yielded = 0;
     result->problem = dup_trim(result->p, problem);
     result->detail = apr_pstrdup(result->p, detail);
     result->subproblems = subproblems? md_json_clone(result->p, subproblems) : NULL;
@@ -114,6 +116,7 @@ void md_result_problem_printf(md_result_t *result, apr_status_t status,
     va_list ap;
 
     result->status = status;
+    result->yielded = 0;
     result->problem = dup_trim(result->p, problem);
 
     va_start(ap, fmt);
@@ -128,6 +131,7 @@ void md_result_printf(md_result_t *result, apr_status_t status, const char *fmt,
     va_list ap;
 
     result->status = status;
+    result->yielded = 0;
     va_start(ap, fmt);
     result->detail = apr_pvsprintf(result->p, fmt, ap);
     va_end(ap);
@@ -141,6 +145,13 @@ void md_result_delay_set(md_result_t *result, apr_time_t ready_at)
     on_change(result);
 }
 
+void md_result_yield_set(md_result_t *result, apr_time_t ready_at)
+{
+    result->ready_at = ready_at;
+    result->yielded = 1;
+    on_change(result);
+}
+
 md_result_t*md_result_from_json(const struct md_json_t *json, apr_pool_t *p)
 {
     md_result_t *result;
@@ -210,6 +221,7 @@ void md_result_assign(md_result_t *dest, const md_result_t *src)
    dest->detail = src->detail;
    dest->activity = src->activity;
    dest->ready_at = src->ready_at;
+   dest->yielded = src->yielded;
    dest->subproblems = src->subproblems;
 }
 
@@ -220,6 +232,7 @@ void md_result_dup(md_result_t *dest, const md_result_t *src)
    dest->detail = src->detail? apr_pstrdup(dest->p, src->detail) : NULL; 
    dest->activity = src->activity? apr_pstrdup(dest->p, src->activity) : NULL; 
    dest->ready_at = src->ready_at;
+   dest->yielded = src->yielded;
    dest->subproblems = src->subproblems? md_json_clone(dest->p, src->subproblems) : NULL;
    on_change(dest);
 }
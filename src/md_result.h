@@ -33,6 +33,7 @@ struct md_result_t {
     const struct md_json_t *subproblems;
     const char *activity;
     apr_time_t ready_at;
+    int yielded;                    /* APR_EAGAIN status is a planned pause, not an error */
     md_result_change_cb *on_change;
     void *on_change_data;
 };
@@ -58,6 +59,13 @@ void md_result_printf(md_result_t *result, apr_status_t status, const char *fmt,
 
 void md_result_delay_set(md_result_t *result, apr_time_t ready_at);
 
+/**
+ * Mark the result's APR_EAGAIN as the run giving way to the CA or to our own
+ * request budget, to be continued at ready_at. Any later status change
+ * clears the mark again.
+ */
+void md_result_yield_set(md_result_t *result, apr_time_t ready_at);
+
 md_result_t*md_result_from_json(const struct md_json_t *json, apr_pool_t *p);
 struct md_json_t *md_result_to_json(const md_result_t *result, apr_pool_t *p);
 
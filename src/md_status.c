@@ -28,6 +28,7 @@
 #include "md_acme.h"
 #include "md_crypt.h"
 #include "md_event.h"
+#include "md_keypool.h"
 #include "md_log.h"
 #include "md_ocsp.h"
 #include "md_store.h"
@@ -175,9 +176,8 @@ static apr_status_t status_get_md_json(md_json_t **pjson, const md_t *md,
 {
     md_json_t *mdj, *certsj, *jobj;
     int renew;
-    const md_pubcert_t *pubcert;
     const md_cert_t *cert = NULL;
-    apr_array_header_t *certs;
+    apr_array_header_t *certs, *chain;
     apr_status_t rv = APR_SUCCESS;
     apr_time_t renew_at;
     md_pkey_spec_t *spec;
@@ -188,8 +188,8 @@ static apr_status_t status_get_md_json(md_json_t **pjson, const md_t *md,
     for (i = 0; i < md_pkeys_spec_count(md->pks); ++i) {
         spec = md_pkeys_spec_get(md->pks, i);
         cert = NULL;
-        if (APR_SUCCESS == md_reg_get_pubcert(&pubcert, reg, md, spec, p)) {
-            cert = APR_ARRAY_IDX(pubcert->certs, 0, const md_cert_t*);
+        if (APR_SUCCESS == md_reg_get_pubcert_chain(&chain, reg, md, spec, p)) {
+            cert = APR_ARRAY_IDX(chain, 0, const md_cert_t*);
         }
         APR_ARRAY_PUSH(certs, const md_cert_t*) = cert;
     }
@@ -236,7 +236,7 @@ apr_status_t md_status_get_md_json(md_json_t **pjson, const md_t *md,
 apr_status_t md_status_get_json(md_json_t **pjson, apr_array_header_t *mds, 
                                 md_reg_t *reg, md_ocsp_reg_t *ocsp, apr_pool_t *p) 
 {
-    md_json_t *json, *mdj;
+    md_json_t *json, *mdj, *jkeys;
     const md_t *md;
     int i;
     
@@ -247,6 +247,9 @@ apr_status_t md_status_get_json(md_json_t **pjson, apr_array_header_t *mds,
         status_get_md_json(&mdj, md, reg, ocsp, 0, p);
         md_json_addj(mdj, json, MD_KEY_MDS, NULL);
     }
+    if (APR_SUCCESS == md_keypool_status_json(&jkeys, md_reg_store_get(reg), p)) {
+        md_json_setj(jkeys, json, MD_KEY_KEY_POOL, NULL);
+    }
     *pjson = json;
     return APR_SUCCESS;
 }
@@ -516,6 +519,9 @@ void md_job_start_run(md_job_t *job, md_result_t *result, md_store_t *store)
 {
     job->fatal_error = 0;
     job->last_run = apr_time_now();
+    /* a delay from an earlier run must not carry over into this one */
+    result->ready_at = 0;
+    result->yielded = 0;
     job_observation_start(job, result, store);
     md_job_log_append(job, "starting", NULL, NULL);
 }
@@ -562,6 +568,16 @@ void md_job_end_run(md_job_t *job, md_result_t *result)
         job->dirty = 1;
         md_job_log_append(job, "finished", NULL, NULL);
     }
+    else if (result->yielded && APR_STATUS_IS_EAGAIN(result->status)) {
+        /* renewal gave way to the CA or to the request budget. Not an error.
+         * Other APR_EAGAINs are failures and back off like any other.
+         * A ready_at that has already passed would have us spin. */
+        apr_time_t now = apr_time_now();
+        
+        job->dirty = 1;
+        job->next_run = (result->ready_at > now)? 
+            result->ready_at : now + apr_time_from_sec(5);
+    }
     else {
         ++job->error_runs;
         job->dirty = 1;
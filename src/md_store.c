@@ -56,6 +56,7 @@ static const char *GROUP_NAME[] = {
     "archive",
     "tmp",
     "ocsp",
+    "keys",
     NULL
 };
 
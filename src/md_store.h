@@ -68,12 +68,14 @@ typedef enum {
     MD_SG_ARCHIVE,      /* Archived live sets of a domain */
     MD_SG_TMP,          /* temporary domain storage */
     MD_SG_OCSP,         /* OCSP stapling related domain data */
+    MD_SG_KEYS,         /* pool of pre-generated private keys */
     MD_SG_COUNT,        /* number of storage groups, used in setups */
 } md_store_group_t;
 
 #define MD_FN_MD                "md.json"
 #define MD_FN_JOB               "job.json"
 #define MD_FN_HTTPD_JSON        "httpd.json"
+#define MD_FN_SNAPSHOT          "snapshot.json"
 
 /* The corresponding names for current cert & key files are constructed
  * in md_store and md_crypt.
@@ -18,6 +18,7 @@
 #include <stdio.h>
 
 #include <apr_lib.h>
+#include <apr_date.h>
 #include <apr_strings.h>
 #include <apr_portable.h>
 #include <apr_file_info.h>
@@ -184,6 +185,116 @@ int md_array_remove(struct apr_array_header_t *a, void *elem)
     return n;
 }
 
+/**************************************************************************************************/
+/* priority queue */
+
+struct md_heap_t {
+    apr_array_header_t *elts;
+    md_heap_less_cb *less;
+    md_heap_set_idx_cb *set_idx;
+};
+
+md_heap_t *md_heap_make(apr_pool_t *p, int nalloc, 
+                        md_heap_less_cb *less, md_heap_set_idx_cb *set_idx)
+{
+    md_heap_t *heap;
+    
+    heap = apr_pcalloc(p, sizeof(*heap));
+    heap->elts = apr_array_make(p, nalloc, sizeof(void*));
+    heap->less = less;
+    heap->set_idx = set_idx;
+    return heap;
+}
+
+int md_heap_count(const md_heap_t *heap)
+{
+    return heap->elts->nelts;
+}
+
+static void heap_set(md_heap_t *heap, int idx, void *elem)
+{
+    APR_ARRAY_IDX(heap->elts, idx, void*) = elem;
+    if (heap->set_idx) heap->set_idx(elem, idx);
+}
+
+static void heap_sift_up(md_heap_t *heap, int idx)
+{
+    void *elem, *parent;
+    int pidx;
+    
+    elem = APR_ARRAY_IDX(heap->elts, idx, void*);
+    while (idx > 0) {
+        pidx = (idx - 1) / 2;
+        parent = APR_ARRAY_IDX(heap->elts, pidx, void*);
+        if (!heap->less(elem, parent)) break;
+        heap_set(heap, idx, parent);
+        idx = pidx;
+    }
+    heap_set(heap, idx, elem);
+}
+
+static void heap_sift_down(md_heap_t *heap, int idx)
+{
+    void *elem, *child;
+    int cidx, n = heap->elts->nelts;
+    
+    elem = APR_ARRAY_IDX(heap->elts, idx, void*);
+    while ((cidx = 2 * idx + 1) < n) {
+        if (cidx + 1 < n && heap->less(APR_ARRAY_IDX(heap->elts, cidx + 1, void*),
+                                       APR_ARRAY_IDX(heap->elts, cidx, void*))) {
+            ++cidx;
+        }
+        child = APR_ARRAY_IDX(heap->elts, cidx, void*);
+        if (!heap->less(child, elem)) break;
+        heap_set(heap, idx, child);
+        idx = cidx;
+    }
+    heap_set(heap, idx, elem);
+}
+
+void md_heap_push(md_heap_t *heap, void *elem)
+{
+    APR_ARRAY_PUSH(heap->elts, void*) = elem;
+    heap_sift_up(heap, heap->elts->nelts - 1);
+}
+
+void *md_heap_peek(const md_heap_t *heap)
+{
+    return heap->elts->nelts? APR_ARRAY_IDX(heap->elts, 0, void*) : NULL;
+}
+
+void *md_heap_remove_at(md_heap_t *heap, int idx)
+{
+    void *elem, *last;
+    
+    if (idx < 0 || idx >= heap->elts->nelts) return NULL;
+    elem = APR_ARRAY_IDX(heap->elts, idx, void*);
+    last = *(void**)apr_array_pop(heap->elts);
+    if (idx < heap->elts->nelts) {
+        heap_set(heap, idx, last);
+        md_heap_update(heap, idx);
+    }
+    if (heap->set_idx) heap->set_idx(elem, -1);
+    return elem;
+}
+
+void *md_heap_pop(md_heap_t *heap)
+{
+    return md_heap_remove_at(heap, 0);
+}
+
+void md_heap_update(md_heap_t *heap, int idx)
+{
+    if (idx < 0 || idx >= heap->elts->nelts) return;
+    if (idx > 0 && heap->less(APR_ARRAY_IDX(heap->elts, idx, void*), 
+                              APR_ARRAY_IDX(heap->elts, (idx - 1) / 2, void*))) {
+        heap_sift_up(heap, idx);
+    }
+    else {
+        heap_sift_down(heap, idx);
+    }
+}
+
 /**************************************************************************************************/
 /* string related */
 
@@ -988,6 +1099,10 @@ apr_status_t md_util_try(md_util_try_fn *fn, void *baton, int ignore_errs,
         else if (!APR_STATUS_IS_EAGAIN(rv) && !ignore_errs) {
             break;
         }
+        else if (timeout <= 0) {
+            /* single attempt, caller will come back later */
+            break;
+        }
         
         now = apr_time_now();
         if (now > giveup) {
@@ -1516,6 +1631,24 @@ const char *md_link_find_relation(const apr_table_t *headers,
     return ctx.url;
 }
 
+apr_time_t md_util_parse_retry_after(const char *value, apr_time_t now)
+{
+    apr_int64_t secs;
+    const char *s;
+    char *end;
+    
+    if (!value) return 0;
+    for (s = value; *s == ' ' || *s == '\t'; ++s)
+        ;
+    if (apr_isdigit(*s)) {
+        secs = apr_strtoi64(s, &end, 10);
+        if (end == s || secs < 0 || (*end && *end != ' ' && *end != '\t')) return 0;
+        if (secs > MD_SECS_PER_DAY) secs = MD_SECS_PER_DAY;
+        return now + apr_time_from_sec(secs);
+    }
+    return apr_date_parse_http(s);
+}
+
 const char *md_util_parse_ct(apr_pool_t *pool, const char *cth)
 {
     char       *type;
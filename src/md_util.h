@@ -66,6 +66,35 @@ int md_array_remove(struct apr_array_header_t *a, void *elem);
  */
 int md_array_remove_at(struct apr_array_header_t *a, int idx);
 
+/**************************************************************************************************/
+/* priority queue */
+
+/**
+ * A binary min-heap of pointers. The element for which no other is "less"
+ * is on top. Elements may be told their position in the heap via the
+ * set_idx callback, so that they can be updated or removed later.
+ */
+typedef struct md_heap_t md_heap_t;
+
+/* Return != 0 iff element a needs to come before b. */
+typedef int md_heap_less_cb(const void *a, const void *b);
+/* Inform element of its current index in the heap, -1 when it is removed. */
+typedef void md_heap_set_idx_cb(void *elem, int idx);
+
+md_heap_t *md_heap_make(apr_pool_t *p, int nalloc, 
+                        md_heap_less_cb *less, md_heap_set_idx_cb *set_idx);
+
+int md_heap_count(const md_heap_t *heap);
+void md_heap_push(md_heap_t *heap, void *elem);
+/* Get the top element without removing it, or NULL when heap is empty. */
+void *md_heap_peek(const md_heap_t *heap);
+/* Remove and return the top element, or NULL when heap is empty. */
+void *md_heap_pop(md_heap_t *heap);
+/* Restore order after the key of the element at idx has changed. */
+void md_heap_update(md_heap_t *heap, int idx);
+/* Remove the element at idx and return it, or NULL when idx is out of range. */
+void *md_heap_remove_at(md_heap_t *heap, int idx);
+
 /**************************************************************************************************/
 /* string related */
 char *md_util_str_tolower(char *s);
@@ -214,11 +243,25 @@ const char *md_link_find_relation(const struct apr_table_t *headers,
                                   apr_pool_t *pool, const char *relation);
 
 const char *md_util_parse_ct(apr_pool_t *pool, const char *cth);
+
+/**
+ * Parse the value of a HTTP 'Retry-After' header, either delta seconds
+ * or a HTTP date. Returns the absolute time or 0 if the value is not
+ * understood. Delta seconds are capped at a day.
+ */
+apr_time_t md_util_parse_retry_after(const char *value, apr_time_t now);
+
 /**************************************************************************************************/
 /* retry logic */
 
 typedef apr_status_t md_util_try_fn(void *baton, int i);
 
+/**
+ * Call fn until it succeeds, fails with an error other than APR_EAGAIN
+ * (unless ignore_errs is set) or timeout has passed, sleeping in between.
+ * With a timeout <= 0, fn is called only once and its result returned.
+ */
+
 apr_status_t md_util_try(md_util_try_fn *fn, void *baton, int ignore_errs,  
                          apr_interval_time_t timeout, apr_interval_time_t start_delay, 
                          apr_interval_time_t max_delay, int backoff);
@@ -16,7 +16,9 @@
 
 #include <assert.h>
 #include <apr_optional.h>
+#include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
 
 #include <mpm_common.h>
 #include <httpd.h>
@@ -34,7 +36,9 @@
 #include "md_crypt.h"
 #include "md_event.h"
 #include "md_http.h"
+#include "md_http01.h"
 #include "md_json.h"
+#include "md_keypool.h"
 #include "md_store.h"
 #include "md_store_fs.h"
 #include "md_log.h"
@@ -255,7 +259,7 @@ static apr_status_t store_file_ev(void *baton, struct md_store_t *store,
     ap_log_error(APLOG_MARK, APLOG_TRACE3, 0, s, "store event=%d on %s %s (group %d)",
                  ev, (ftype == APR_DIR)? "dir" : "file", fname, group);
 
-    /* Directories in group CHALLENGES, STAGING and OCSP are written to
+    /* Directories in group CHALLENGES, STAGING, OCSP and KEYS are written to
      * under a different user. Give her ownership.
      */
     if (ftype == APR_DIR) {
@@ -263,6 +267,7 @@ static apr_status_t store_file_ev(void *baton, struct md_store_t *store,
             case MD_SG_CHALLENGES:
             case MD_SG_STAGING:
             case MD_SG_OCSP:
+            case MD_SG_KEYS:
                 rv = md_make_worker_accessible(fname, p);
                 if (APR_ENOTIMPL != rv) {
                     return rv;
@@ -306,6 +311,7 @@ static apr_status_t setup_store(md_store_t **pstore, md_mod_conf_t *mc,
         || APR_SUCCESS != (rv = check_group_dir(*pstore, MD_SG_STAGING, p, s))
         || APR_SUCCESS != (rv = check_group_dir(*pstore, MD_SG_ACCOUNTS, p, s))
         || APR_SUCCESS != (rv = check_group_dir(*pstore, MD_SG_OCSP, p, s))
+        || APR_SUCCESS != (rv = check_group_dir(*pstore, MD_SG_KEYS, p, s))
         ) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10047)
                      "setup challenges directory");
@@ -850,6 +856,7 @@ static apr_status_t md_post_config_before_ssl(apr_pool_t *p, apr_pool_t *plog,
     apr_status_t rv = APR_SUCCESS;
     int dry_run = 0, log_level = APLOG_DEBUG;
     md_store_t *store;
+    const char *parallel;
 
     apr_pool_userdata_get(&data, mod_md_init_key, s->process->pool);
     if (data == NULL) {
@@ -898,6 +905,11 @@ static apr_status_t md_post_config_before_ssl(apr_pool_t *p, apr_pool_t *plog,
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10196) "setup ocsp registry");
         goto leave;
     }
+    md_ocsp_set_batch_size(mc->ocsp, mc->ocsp_batch_size);
+    md_ocsp_set_use_get(mc->ocsp, mc->ocsp_use_get);
+    if ((parallel = apr_table_get(mc->env, MD_KEY_REQUEST_PARALLELISM))) {
+        md_ocsp_set_max_parallel(mc->ocsp, (int)apr_atoi64(parallel));
+    }
 
     init_ssl();
 
@@ -944,10 +956,9 @@ static apr_status_t md_post_config_after_ssl(apr_pool_t *p, apr_pool_t *plog,
     md_srv_conf_t *sc;
     apr_status_t rv = APR_SUCCESS;
     md_mod_conf_t *mc;
-    int watched, i;
+    int watched, i, nhosts;
     md_t *md;
 
-    (void)ptemp;
     (void)plog;
     sc = md_config_get(s);
 
@@ -960,6 +971,10 @@ static apr_status_t md_post_config_after_ssl(apr_pool_t *p, apr_pool_t *plog,
         goto leave;
     }
     apr_array_clear(mc->unused_names);
+    /* Parsing certificates is the bulk of the work when there are many MDs,
+     * only parse those that changed since the last start */
+    md_reg_snapshot_load(mc->reg, mc->mds, ptemp);
+    md_reg_load_pubcerts(mc->reg, mc->mds, md_cpu_count(), ptemp);
     for (i = 0; i < mc->mds->nelts; ++i) {
         md = APR_ARRAY_IDX(mc->mds, i, md_t *);
 
@@ -982,14 +997,26 @@ static apr_status_t md_post_config_after_ssl(apr_pool_t *p, apr_pool_t *plog,
     md_reg_cleanup_challenges(mc->reg, p, ptemp, mc->mds);
 
     /* From here on, the domains in the registry are readonly
-     * and only staging/challenges may be manipulated */
+     * and only staging/challenges may be manipulated. The children 
+     * may not read the chains themselves, parse those from the snapshot. */
+    md_reg_load_pubcert_chains(mc->reg, mc->mds, md_cpu_count(), ptemp);
     md_reg_freeze_domains(mc->reg, mc->mds);
+    mc->domain_idx = md_domain_idx_make(mc->mds, p);
+    md_reg_snapshot_save(mc->reg, mc->mds, ptemp);
 
     if (watched) {
         /*10*/
         ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, s, APLOGNO(10074)
                      "%d out of %d mds need watching", watched, mc->mds->nelts);
 
+        /* Let children answer http-01 challenges without the store, failure
+         * to do so is not fatal. */
+        for (i = 0, nhosts = 0; i < mc->mds->nelts; ++i) {
+            md = APR_ARRAY_IDX(mc->mds, i, md_t *);
+            nhosts += md->domains->nelts;
+        }
+        md_http01_shm_init(nhosts, p);
+
         md_http_use_implementation(md_curl_get_impl(p));
         rv = md_renew_start_watching(mc, s, p);
     }
@@ -999,6 +1026,10 @@ static apr_status_t md_post_config_after_ssl(apr_pool_t *p, apr_pool_t *plog,
 
     if (!mc->ocsp || md_ocsp_count(mc->ocsp) == 0) goto leave;
 
+    /* All certificates have been primed by mod_ssl by now. Share their
+     * responses with the children, failure to do so is not fatal. */
+    md_ocsp_shm_init(mc->ocsp, p);
+    
     md_http_use_implementation(md_curl_get_impl(p));
     rv = md_ocsp_start_watching(mc, s, p);
 
@@ -1076,7 +1107,8 @@ static apr_status_t make_fallback_cert(md_store_t *store, const md_t *md, md_pke
     md_cert_t *cert;
     apr_status_t rv;
 
-    if (APR_SUCCESS != (rv = md_pkey_gen(&pkey, p, kspec))
+    /* startup waits for this, a key from the pool saves the generation time */
+    if (APR_SUCCESS != (rv = md_keypool_take(&pkey, store, kspec, p))
         || APR_SUCCESS != (rv = md_store_save(store, p, MD_SG_DOMAINS, md->name,
                                 keyfn, MD_SV_PKEY, (void*)pkey, 0))
         || APR_SUCCESS != (rv = md_cert_self_sign(&cert, "Apache Managed Domain Fallback",
@@ -1249,6 +1281,106 @@ static int md_add_fallback_cert_files(server_rec *s, apr_pool_t *p,
     return DECLINED;
 }
 
+/* tls-alpn-01 challenge certificates and keys, parsed once per child process.
+ * CAs connect several times from different places to verify a challenge. An entry
+ * is valid as long as the certificate file has the same modification time. The
+ * key is always saved before its certificate, so a new key means a new one, too,
+ * and a single stat per handshake is enough. */
+
+#define CHA_CACHE_MAX       100
+
+typedef struct {
+    apr_pool_t *p;
+    md_cert_t *cert;
+    md_pkey_t *pkey;
+    apr_time_t cert_mtime;
+} cha_cache_entry_t;
+
+static apr_pool_t *cha_cache_pool;
+static apr_hash_t *cha_cache;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *cha_cache_mutex;
+#endif
+
+static void cha_cache_init(apr_pool_t *pchild)
+{
+    if (APR_SUCCESS != apr_pool_create(&cha_cache_pool, pchild)) {
+        cha_cache_pool = NULL;
+        return;
+    }
+    apr_pool_tag(cha_cache_pool, "md_cha_cache");
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != apr_thread_mutex_create(&cha_cache_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                               pchild)) {
+        cha_cache_pool = NULL;
+        return;
+    }
+#endif
+    /* entries live in sub pools of cha_cache_pool, the rest outlives clearing it */
+    cha_cache = apr_hash_make(pchild);
+}
+
+static void cha_cache_lock(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cha_cache_mutex);
+#endif
+}
+
+static void cha_cache_unlock(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cha_cache_mutex);
+#endif
+}
+
+static int cha_cache_get(md_cert_t **pcert, md_pkey_t **ppkey, const char *key,
+                         apr_time_t cert_mtime, apr_pool_t *p)
+{
+    cha_cache_entry_t *entry;
+    int found = 0;
+
+    if (!cha_cache_pool) return 0;
+    cha_cache_lock();
+    entry = apr_hash_get(cha_cache, key, APR_HASH_KEY_STRING);
+    if (entry && entry->cert_mtime == cert_mtime) {
+        /* the entry may be replaced while the handshake still uses these */
+        *pcert = md_cert_share(entry->cert, p);
+        *ppkey = md_pkey_share(entry->pkey, p);
+        found = 1;
+    }
+    cha_cache_unlock();
+    return found;
+}
+
+static void cha_cache_put(const char *key, md_cert_t *cert, md_pkey_t *pkey,
+                          apr_time_t cert_mtime)
+{
+    cha_cache_entry_t *entry;
+    apr_pool_t *p;
+
+    if (!cha_cache_pool) return;
+    cha_cache_lock();
+    if ((entry = apr_hash_get(cha_cache, key, APR_HASH_KEY_STRING))) {
+        apr_hash_set(cha_cache, key, APR_HASH_KEY_STRING, NULL);
+        apr_pool_destroy(entry->p);
+    }
+    else if (apr_hash_count(cha_cache) >= CHA_CACHE_MAX) {
+        /* challenges are short lived, start over */
+        apr_hash_clear(cha_cache);
+        apr_pool_clear(cha_cache_pool);
+    }
+    if (APR_SUCCESS == apr_pool_create(&p, cha_cache_pool)) {
+        entry = apr_pcalloc(p, sizeof(*entry));
+        entry->p = p;
+        entry->cert = md_cert_share(cert, p);
+        entry->pkey = md_pkey_share(pkey, p);
+        entry->cert_mtime = cert_mtime;
+        apr_hash_set(cha_cache, apr_pstrdup(p, key), APR_HASH_KEY_STRING, entry);
+    }
+    cha_cache_unlock();
+}
+
 /* Requires newer mod_ssl to handle multiple active certificates per server
  *
  * Return codes were chosen to inform older mod_ssl that hook is present.
@@ -1285,10 +1417,25 @@ static apr_status_t md_answer_challenges(conn_rec *c, const char *servername,
             for (i = 0; i < md_pkeys_spec_count( sc->pks ); i++) {
                 X509     *x;
                 EVP_PKEY *pk;
+                const char *cache_key;
+                apr_time_t cert_mtime;
 
                 tls_alpn01_fnames(c->pool, md_pkeys_spec_get(sc->pks,i),
                                   &pkey_name, &cert_name);
 
+                cache_key = apr_pstrcat(c->pool, servername, "/", cert_name, NULL);
+                cert_mtime = md_store_get_modified(store, MD_SG_CHALLENGES, servername,
+                                                   cert_name, c->pool);
+                if (cert_mtime
+                    && cha_cache_get(&mdcert, &mdpkey, cache_key, cert_mtime, c->pool)) {
+                    ap_log_cerror(APLOG_MARK, APLOG_TRACE1, 0, c,
+                                  "%s: using cached %s challenge cert %s",
+                                  servername, challenge, cert_name);
+                    APR_ARRAY_PUSH(certs, X509*)    = md_cert_get_X509(mdcert);
+                    APR_ARRAY_PUSH(pkeys, EVP_PKEY*) = md_pkey_get_EVP_PKEY(mdpkey);
+                    continue;
+                }
+
                 ap_log_cerror(APLOG_MARK, APLOG_TRACE1, 0, c,
                               "Loading challenge cert %s, key %s for %s",
                               cert_name, pkey_name, servername);
@@ -1298,6 +1445,9 @@ static apr_status_t md_answer_challenges(conn_rec *c, const char *servername,
                     rv = md_store_load(store, MD_SG_CHALLENGES, servername, pkey_name,
                                        MD_SV_PKEY, (void**)&mdpkey, c->pool);
                     if (APR_SUCCESS == rv && (pk = md_pkey_get_EVP_PKEY(mdpkey))) {
+                        if (cert_mtime) {
+                            cha_cache_put(cache_key, mdcert, mdpkey, cert_mtime);
+                        }
                         ap_log_cerror(APLOG_MARK, APLOG_INFO, 0, c, APLOGNO(10078)
                                       "%s: is a %s challenge host", servername, challenge);
                         APR_ARRAY_PUSH(certs, X509*)    = x;
@@ -1350,9 +1500,29 @@ static int md_answer_challenge(conn_rec *c, const char *servername,
 #define WELL_KNOWN_PREFIX           "/.well-known/"
 #define ACME_CHALLENGE_PREFIX       WELL_KNOWN_PREFIX"acme-challenge/"
 
-static int md_http_challenge_pr(request_rec *r)
+static int md_http_challenge_send(request_rec *r, const char *data)
 {
     apr_bucket_brigade *bb;
+    apr_size_t len = strlen(data);
+
+    if (r->method_number != M_GET) {
+        return HTTP_NOT_IMPLEMENTED;
+    }
+    /* A GET on a challenge resource for a hostname we are
+     * configured for. Let's send the content back */
+    r->status = HTTP_OK;
+    apr_table_setn(r->headers_out, "Content-Length", apr_ltoa(r->pool, (long)len));
+
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    apr_brigade_write(bb, NULL, NULL, data, len);
+    ap_pass_brigade(r->output_filters, bb);
+    apr_brigade_cleanup(bb);
+
+    return DONE;
+}
+
+static int md_http_challenge_pr(request_rec *r)
+{
     const md_srv_conf_t *sc;
     const char *name, *data;
     md_reg_t *reg;
@@ -1366,44 +1536,40 @@ static int md_http_challenge_pr(request_rec *r)
             ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
                           "access inside /.well-known/acme-challenge for %s%s",
                           r->hostname, r->parsed_uri.path);
-            md = md_get_by_domain(sc->mc->mds, r->hostname);
             name = r->parsed_uri.path + sizeof(ACME_CHALLENGE_PREFIX)-1;
             reg = sc && sc->mc? sc->mc->reg : NULL;
 
             if (strlen(name) && !ap_strchr_c(name, '/') && reg) {
                 md_store_t *store = md_reg_store_get(reg);
 
-                rv = md_store_load(store, MD_SG_CHALLENGES, r->hostname,
-                                   MD_FN_HTTP01, MD_SV_TEXT, (void**)&data, r->pool);
-                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r,
-                              "loading challenge for %s (%s)", r->hostname, r->uri);
-                if (APR_SUCCESS == rv) {
-                    apr_size_t len = strlen(data);
-
-                    if (r->method_number != M_GET) {
-                        return HTTP_NOT_IMPLEMENTED;
-                    }
-                    /* A GET on a challenge resource for a hostname we are
-                     * configured for. Let's send the content back */
-                    r->status = HTTP_OK;
-                    apr_table_setn(r->headers_out, "Content-Length", apr_ltoa(r->pool, (long)len));
-
-                    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
-                    apr_brigade_write(bb, NULL, NULL, data, len);
-                    ap_pass_brigade(r->output_filters, bb);
-                    apr_brigade_cleanup(bb);
-
-                    return DONE;
+                if (r->hostname 
+                    && APR_SUCCESS == md_http01_get(&data, r->hostname, name, r->pool)) {
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                                  "shared challenge for %s (%s)", r->hostname, r->uri);
+                    return md_http_challenge_send(r, data);
                 }
-                else if (!md || md->renew_mode == MD_RENEW_MANUAL
+
+                md = md_config_get_by_domain(sc->mc, r->hostname);
+                if (!md || md->renew_mode == MD_RENEW_MANUAL
                     || (md->cert_file && md->renew_mode == MD_RENEW_AUTO)) {
                     /* The request hostname is not for a domain - or at least not for
                      * a domain that we renew ourselves. We are not
                      * the sole authority here for /.well-known/acme-challenge (see PR62189).
                      * So, we decline to handle this and give others a chance to provide
-                     * the answer.
+                     * the answer, unless the store has a challenge for it, e.g. one set
+                     * up by another server sharing the store.
                      */
-                    return DECLINED;
+                    rv = md_store_load(store, MD_SG_CHALLENGES, r->hostname,
+                                       MD_FN_HTTP01, MD_SV_TEXT, (void**)&data, r->pool);
+                    return (APR_SUCCESS == rv)? md_http_challenge_send(r, data) : DECLINED;
+                }
+
+                rv = md_store_load(store, MD_SG_CHALLENGES, r->hostname,
+                                   MD_FN_HTTP01, MD_SV_TEXT, (void**)&data, r->pool);
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r,
+                              "loading challenge for %s (%s)", r->hostname, r->uri);
+                if (APR_SUCCESS == rv) {
+                    return md_http_challenge_send(r, data);
                 }
                 else if (APR_STATUS_IS_ENOENT(rv)) {
                     return HTTP_NOT_FOUND;
@@ -1488,8 +1654,8 @@ declined:
  */
 static void md_child_init(apr_pool_t *pool, server_rec *s)
 {
-    (void)pool;
     (void)s;
+    cha_cache_init(pool);
 }
 
 /* Install this module into the apache2 infrastructure.
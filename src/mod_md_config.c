@@ -27,7 +27,9 @@
 
 #include "md.h"
 #include "md_crypt.h"
+#include "md_keypool.h"
 #include "md_log.h"
+#include "md_ocsp.h"
 #include "md_util.h"
 #include "mod_md_private.h"
 #include "mod_md_config.h"
@@ -54,6 +56,7 @@ static md_timeslice_t def_ocsp_renew_window = {
 /* Default settings for the global conf */
 static md_mod_conf_t defmc = {
     NULL,                      /* list of mds */
+    NULL,                      /* index of md domain names */
 #if AP_MODULE_MAGIC_AT_LEAST(20180906, 2)
     NULL,                      /* base dirm by default state-dir-relative */
 #else
@@ -80,6 +83,10 @@ static md_mod_conf_t defmc = {
     1,                         /* certificate_status_enabled */
     &def_ocsp_keep_window,     /* default time to keep ocsp responses */
     &def_ocsp_renew_window,    /* default time to renew ocsp responses */
+    1,                         /* one certificate per ocsp request */
+    0,                         /* ocsp requests via POST */
+    4,                         /* renew up to 4 MDs at the same time */
+    MD_KEYPOOL_DEPTH_DEF,      /* private keys generated ahead */
     "crt.sh",                  /* default cert checker site name */
     "https://crt.sh?q=",       /* default cert checker site url */
     NULL,                      /* CA cert file to use */
@@ -860,6 +867,39 @@ static const char *md_config_set_dns01_cmd(cmd_parms *cmd, void *mconfig, const
     return NULL;
 }
 
+static const char *md_config_set_dns01_helper(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    apr_table_set(sc->mc->env, MD_KEY_CMD_DNS01_HELPER, arg);
+    (void)mconfig;
+    return NULL;
+}
+
+static const char *md_config_set_dns01_batch(cmd_parms *cmd, void *mconfig, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int batch = 0;
+
+    (void)mconfig;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))
+        || (err = set_on_off(&batch, value, cmd->pool))) {
+        return err;
+    }
+    if (batch) {
+        apr_table_set(sc->mc->env, MD_KEY_CMD_DNS01_BATCH, "on");
+    }
+    else {
+        apr_table_unset(sc->mc->env, MD_KEY_CMD_DNS01_BATCH);
+    }
+    return NULL;
+}
+
 static const char *md_config_set_cert_file(cmd_parms *cmd, void *mconfig, const char *arg)
 {
     md_srv_conf_t *sc = md_config_get(cmd->server);
@@ -940,6 +980,103 @@ static const char *md_config_set_ocsp_renew_window(cmd_parms *cmd, void *dc, con
     return NULL;
 }
 
+static const char *md_config_set_ocsp_batch_size(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int n;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_ALL))) {
+        return err;
+    }
+    n = (int)apr_atoi64(value);
+    if (n <= 0 || n > MD_OCSP_BATCH_MAX) {
+        return apr_psprintf(cmd->pool, "MDStaplingBatchSize needs a number "
+                            "from 1 to %d", MD_OCSP_BATCH_MAX);
+    }
+    sc->mc->ocsp_batch_size = n;
+    return NULL;
+}
+
+static const char *md_config_set_renew_workers(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int n;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    n = (int)apr_atoi64(value);
+    if (n <= 0) {
+        return "MDRenewWorkers needs a positive number";
+    }
+    sc->mc->renew_workers = n;
+    return NULL;
+}
+
+static const char *md_config_set_request_parallelism(cmd_parms *cmd, void *dc, 
+                                                     const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int n;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    n = (int)apr_atoi64(value);
+    if (n <= 0 || n > MD_REQUEST_PARALLEL_MAX) {
+        return apr_psprintf(cmd->pool, "MDRequestParallelism needs a number "
+                            "from 1 to %d", MD_REQUEST_PARALLEL_MAX);
+    }
+    apr_table_set(sc->mc->env, MD_KEY_REQUEST_PARALLELISM, apr_itoa(cmd->pool, n));
+    return NULL;
+}
+
+static const char *md_config_set_key_pool(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int n;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    n = (int)apr_atoi64(value);
+    if (n < 0) {
+        return "MDPrivateKeyPool needs a number >= 0";
+    }
+    sc->mc->key_pool_depth = n;
+    return NULL;
+}
+
+static const char *md_config_set_ocsp_method(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_ALL))) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("GET", value)) {
+        sc->mc->ocsp_use_get = 1;
+    }
+    else if (!apr_strnatcasecmp("POST", value)) {
+        sc->mc->ocsp_use_get = 0;
+    }
+    else {
+        return apr_pstrcat(cmd->pool, "unknown method '", value, 
+                           "', supported are 'GET' and 'POST'", NULL);
+    }
+    return NULL;
+}
+
 static const char *md_config_set_cert_check(cmd_parms *cmd, void *dc, 
                                             const char *name, const char *url)
 {
@@ -1031,6 +1168,10 @@ const command_rec md_cmds[] = {
                   "Allow managing of base server outside virtual hosts."),
     AP_INIT_RAW_ARGS("MDChallengeDns01", md_config_set_dns01_cmd, NULL, RSRC_CONF, 
                   "Set the command for setup/teardown of dns-01 challenges"),
+    AP_INIT_TAKE1("MDChallengeDns01Batch", md_config_set_dns01_batch, NULL, RSRC_CONF, 
+                  "Invoke the dns-01 command once for all domains of an order"),
+    AP_INIT_RAW_ARGS("MDChallengeDns01Helper", md_config_set_dns01_helper, NULL, RSRC_CONF, 
+                  "Set the command of a long running helper for dns-01 challenges"),
     AP_INIT_TAKE1("MDCertificateFile", md_config_set_cert_file, NULL, RSRC_CONF, 
                   "set the static certificate (chain) file to use for this domain."),
     AP_INIT_TAKE1("MDCertificateKeyFile", md_config_set_key_file, NULL, RSRC_CONF, 
@@ -1051,6 +1192,17 @@ const command_rec md_cmds[] = {
                   "The amount of time to keep an OCSP response in the store."),
     AP_INIT_TAKE1("MDStaplingRenewWindow", md_config_set_ocsp_renew_window, NULL, RSRC_CONF, 
                   "Time length for renewal before OCSP responses expire (defaults to days)."),
+    AP_INIT_TAKE1("MDStaplingBatchSize", md_config_set_ocsp_batch_size, NULL, RSRC_CONF, 
+                  "Max number of certificates of the same issuer to query in one OCSP request."),
+    AP_INIT_TAKE1("MDStaplingRequestMethod", md_config_set_ocsp_method, NULL, RSRC_CONF, 
+                  "Use GET (cacheable) or POST requests to OCSP responders."),
+    AP_INIT_TAKE1("MDRenewWorkers", md_config_set_renew_workers, NULL, RSRC_CONF, 
+                  "Max number of Managed Domains to renew at the same time."),
+    AP_INIT_TAKE1("MDRequestParallelism", md_config_set_request_parallelism, NULL, RSRC_CONF, 
+                  "Max number of requests open at the same time to an ACME server "
+                  "or OCSP responder."),
+    AP_INIT_TAKE1("MDPrivateKeyPool", md_config_set_key_pool, NULL, RSRC_CONF, 
+                  "Number of private keys to generate ahead of time, per key type."),
     AP_INIT_TAKE2("MDCertificateCheck", md_config_set_cert_check, NULL, RSRC_CONF, 
                   "Set name and URL pattern for a certificate monitoring site."),
     AP_INIT_TAKE1("MDActivationDelay", md_config_set_activation_delay, NULL, RSRC_CONF, 
@@ -1176,6 +1328,16 @@ const md_t *md_get_for_domain(server_rec *s, const char *domain)
     int i;
     
     sc = md_config_get(s);
+    if (sc && sc->assigned && sc->mc->domain_idx) {
+        /* a name is in only one MD, it needs to be one of ours */
+        if ((md = md_domain_idx_get(sc->mc->domain_idx, domain))) {
+            for (i = 0; i < sc->assigned->nelts; ++i) {
+                if (md == APR_ARRAY_IDX(sc->assigned, i, const md_t*)) goto leave;
+            }
+        }
+        md = NULL;
+        goto leave;
+    }
     for (i = 0; sc && sc->assigned && i < sc->assigned->nelts; ++i) {
         md = APR_ARRAY_IDX(sc->assigned, i, const md_t*);
         if (md_contains(md, domain, 0)) goto leave;
@@ -1185,3 +1347,9 @@ leave:
     return md;
 }
 
+md_t *md_config_get_by_domain(md_mod_conf_t *mc, const char *domain)
+{
+    return mc->domain_idx? md_domain_idx_get(mc->domain_idx, domain) 
+                         : md_get_by_domain(mc->mds, domain);
+}
+
@@ -45,6 +45,7 @@ typedef enum {
 typedef struct md_mod_conf_t md_mod_conf_t;
 struct md_mod_conf_t {
     apr_array_header_t *mds;           /* all md_t* defined in the config, shared */
+    struct md_domain_idx_t *domain_idx; /* post config, index of the DNS names in mds */
     const char *base_dir;              /* base dir for store */
     const char *proxy_url;             /* proxy url to use (or NULL) */
     struct md_reg_t *reg;              /* md registry instance */
@@ -69,6 +70,10 @@ struct md_mod_conf_t {
     int certificate_status_enabled;    /* if module should expose /.httpd/certificate-status */
     md_timeslice_t *ocsp_keep_window;  /* time that we keep ocsp responses around */
     md_timeslice_t *ocsp_renew_window; /* time before exp. that we start renewing ocsp resp. */
+    int ocsp_batch_size;               /* max number of certificates in one OCSP request */
+    int ocsp_use_get;                  /* make cacheable GET requests for OCSP */
+    int renew_workers;                 /* max number of MDs renewed concurrently */
+    int key_pool_depth;                /* number of private keys to generate ahead, per spec */
     const char *cert_check_name;       /* name of the linked certificate check site */
     const char *cert_check_url;        /* url "template for" checking a certificate */
     const char *ca_certs;              /* root certificates to use for connections */
@@ -123,4 +128,7 @@ void md_config_get_timespan(md_timeslice_t **pspan, const md_srv_conf_t *sc, md_
 
 const md_t *md_get_for_domain(server_rec *s, const char *domain);
 
+/* Get the MD that contains the DNS name, by index once post config has built it */
+md_t *md_config_get_by_domain(md_mod_conf_t *mc, const char *domain);
+
 #endif /* md_config_h */
@@ -19,6 +19,8 @@
 #include <apr_hash.h>
 #include <apr_strings.h>
 #include <apr_date.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
 
 #include <httpd.h>
 #include <http_core.h>
@@ -32,8 +34,10 @@
 #include "md_curl.h"
 #include "md_crypt.h"
 #include "md_event.h"
+#include "md_helper.h"
 #include "md_http.h"
 #include "md_json.h"
+#include "md_keypool.h"
 #include "md_status.h"
 #include "md_store.h"
 #include "md_store_fs.h"
@@ -55,6 +59,7 @@
 /* watchdog based impl. */
 
 #define MD_RENEW_WATCHDOG_NAME   "_md_renew_"
+#define MD_KEYPOOL_WATCHDOG_NAME "_md_keypool_"
 
 static APR_OPTIONAL_FN_TYPE(ap_watchdog_get_instance) *wd_get_instance;
 static APR_OPTIONAL_FN_TYPE(ap_watchdog_register_callback) *wd_register_callback;
@@ -67,12 +72,17 @@ struct md_renew_ctx_t {
     ap_watchdog_t *watchdog;
     
     apr_array_header_t *jobs;
+    int next_job;                  /* index of next job to check in a run */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;     /* protects next_job */
+#endif
 };
 
 static void process_drive_job(md_renew_ctx_t *dctx, md_job_t *job, apr_pool_t *ptemp)
 {
     const md_t *md;
     md_result_t *result = NULL;
+    apr_time_t paused_until;
     apr_status_t rv;
     
     md_job_load(job);
@@ -116,17 +126,34 @@ static void process_drive_job(md_renew_ctx_t *dctx, md_job_t *job, apr_pool_t *p
                 goto expiry;
         }
 
-        if (!md_reg_should_renew(dctx->mc->reg, md, dctx->p)) {
+        if (!md_reg_should_renew(dctx->mc->reg, md, ptemp)) {
             ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, dctx->s, APLOGNO(10053) 
                          "md(%s): no need to renew", job->mdomain);
             goto expiry;
         }
+        
+        paused_until = md_acme_budget_paused_until(md_acme_budget_get(md->ca_url));
+        if (paused_until) {
+            /* The CA told us to stay away, this applies to all MDs using it */
+            ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, dctx->s, 
+                         "md(%s): CA asked for a pause, next run in %s", job->mdomain, 
+                         md_duration_print(ptemp, paused_until - apr_time_now()));
+            md_job_retry_at(job, paused_until);
+            goto leave;
+        }
     
         md_job_start_run(job, result, md_reg_store_get(dctx->mc->reg)); 
         md_reg_renew(dctx->mc->reg, md, dctx->mc->env, 0, result, ptemp);
         md_job_end_run(job, result);
         
-        if (APR_SUCCESS == result->status) {
+        if (result->yielded && APR_STATUS_IS_EAGAIN(result->status)) {
+            /* Waiting on the CA, the job is woken again at the time it asked for */
+            ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, dctx->s,
+                         "md(%s): %s, next check in %s", job->mdomain, 
+                         result->detail? result->detail : "in progress",
+                         md_duration_print(ptemp, job->next_run - apr_time_now()));
+        }
+        else if (APR_SUCCESS == result->status) {
             /* Finished jobs might take a while before the results become valid.
              * If that is in the future, request to run then */
             if (apr_time_now() < result->ready_at) {
@@ -151,7 +178,7 @@ static void process_drive_job(md_renew_ctx_t *dctx, md_job_t *job, apr_pool_t *p
     }
 
 expiry:
-    if (!job->finished && md_reg_should_warn(dctx->mc->reg, md, dctx->p)) {
+    if (!job->finished && md_reg_should_warn(dctx->mc->reg, md, ptemp)) {
         ap_log_error( APLOG_MARK, APLOG_TRACE1, 0, dctx->s,
                      "md(%s): warn about expiration", md->name);
         md_job_start_run(job, result, md_reg_store_get(dctx->mc->reg));
@@ -177,16 +204,120 @@ int md_will_renew_cert(const md_t *md)
     return 1;
 }
 
+static md_job_t *next_due_job(md_renew_ctx_t *dctx)
+{
+    md_job_t *job = NULL;
+    
+#if APR_HAS_THREADS
+    if (dctx->mutex) apr_thread_mutex_lock(dctx->mutex);
+#endif
+    while (dctx->next_job < dctx->jobs->nelts) {
+        job = APR_ARRAY_IDX(dctx->jobs, dctx->next_job++, md_job_t *);
+        if (apr_time_now() >= job->next_run) break;
+        job = NULL;
+    }
+#if APR_HAS_THREADS
+    if (dctx->mutex) apr_thread_mutex_unlock(dctx->mutex);
+#endif
+    return job;
+}
+
+static void process_due_jobs(md_renew_ctx_t *dctx)
+{
+    md_job_t *job;
+    apr_pool_t *ptemp;
+    
+    /* Each job has its own pool (and allocator), so different jobs
+     * may be processed in different threads. */
+    while ((job = next_due_job(dctx))) {
+        if (APR_SUCCESS != apr_pool_create(&ptemp, job->p)) continue;
+        apr_pool_tag(ptemp, "md_renew_job");
+        process_drive_job(dctx, job, ptemp);
+        apr_pool_destroy(ptemp);
+    }
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC renew_worker(apr_thread_t *thread, void *data)
+{
+    md_renew_ctx_t *dctx = data;
+    
+    (void)thread;
+    process_due_jobs(dctx);
+    /* Not apr_thread_exit(), the thread's pool is cleaned up with the
+     * watchdog's ptemp in the watchdog thread. */
+    return NULL;
+}
+#endif
+
+static void run_due_jobs(md_renew_ctx_t *dctx, apr_pool_t *ptemp)
+{
+#if APR_HAS_THREADS
+    apr_thread_t **workers;
+    apr_status_t rv, wrv;
+    int i, due, nworkers;
+    
+    for (i = due = 0; i < dctx->jobs->nelts; ++i) {
+        if (apr_time_now() >= APR_ARRAY_IDX(dctx->jobs, i, md_job_t *)->next_run) ++due;
+    }
+    /* The watchdog thread itself is one of the workers */
+    nworkers = ((due < dctx->mc->renew_workers)? due : dctx->mc->renew_workers) - 1;
+    dctx->next_job = 0;
+    if (nworkers > 0 && dctx->mutex) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, dctx->s, 
+                     "processing %d due mds with %d workers", due, nworkers + 1);
+        workers = apr_pcalloc(ptemp, (apr_size_t)nworkers * sizeof(apr_thread_t *));
+        for (i = 0; i < nworkers; ++i) {
+            rv = apr_thread_create(&workers[i], NULL, renew_worker, dctx, ptemp);
+            if (APR_SUCCESS != rv) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, rv, dctx->s, 
+                             "creating md renew worker %d", i);
+                break;
+            }
+        }
+        nworkers = i;
+        process_due_jobs(dctx);
+        for (i = 0; i < nworkers; ++i) {
+            apr_thread_join(&wrv, workers[i]);
+        }
+        return;
+    }
+#else
+    (void)ptemp;
+    dctx->next_job = 0;
+#endif
+    process_due_jobs(dctx);
+}
+
 static apr_time_t next_run_default(void)
 {
     /* we'd like to run at least twice a day by default */
     return apr_time_now() + apr_time_from_sec(MD_SECS_PER_DAY / 2);
 }
 
+static apr_status_t own_pool_create(apr_pool_t **ppool, apr_pool_t *parent, const char *tag)
+{
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+    
+    /* A pool with own allocator, so it may be used independent of other threads */
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) return rv;
+    apr_allocator_max_free_set(allocator, 1);
+    rv = apr_pool_create_ex(ppool, parent, NULL, allocator);
+    if (rv != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, *ppool);
+    apr_pool_tag(*ppool, tag);
+    return APR_SUCCESS;
+}
+
 static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
 {
     md_renew_ctx_t *dctx = baton;
     md_job_t *job;
+    md_http_t *http;
     apr_time_t next_run, wait_time;
     int i;
     
@@ -198,24 +329,25 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
         case AP_WATCHDOG_STATE_STARTING:
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, dctx->s, APLOGNO(10054)
                          "md watchdog start, auto drive %d mds", dctx->jobs->nelts);
+            /* Have the http implementation initialized here, before renew 
+             * workers might race each other doing it. */
+            md_http_create(&http, ptemp, "", NULL);
             break;
             
         case AP_WATCHDOG_STATE_RUNNING:
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, dctx->s, APLOGNO(10055)
                          "md watchdog run, auto drive %d mds", dctx->jobs->nelts);
                          
-            /* Process all drive jobs. They will update their next_run property
+            /* Process all due drive jobs, up to mc->renew_workers of them
+             * concurrently. They will update their next_run property
              * and we schedule ourself at the earliest of all. A job may specify 0
              * as next_run to indicate that it wants to participate in the normal
              * regular runs. */
+            run_due_jobs(dctx, ptemp);
+            
             next_run = next_run_default();
             for (i = 0; i < dctx->jobs->nelts; ++i) {
                 job = APR_ARRAY_IDX(dctx->jobs, i, md_job_t *);
-                
-                if (apr_time_now() >= job->next_run) {
-                    process_drive_job(dctx, job, ptemp);
-                }
-                
                 if (job->next_run && job->next_run < next_run) {
                     next_run = job->next_run;
                 }
@@ -232,17 +364,109 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
         case AP_WATCHDOG_STATE_STOPPING:
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, dctx->s, APLOGNO(10058)
                          "md watchdog stopping");
+            md_helper_stop_all();
             break;
     }
     
     return APR_SUCCESS;
 }
 
+/**************************************************************************************************/
+/* private key pool */
+
+typedef struct {
+    apr_pool_t *p;
+    server_rec *s;
+    md_mod_conf_t *mc;
+    ap_watchdog_t *watchdog;
+    apr_array_header_t *specs;     /* distinct key specs of the watched MDs */
+} md_keypool_ctx_t;
+
+static apr_status_t run_keypool_watchdog(int state, void *baton, apr_pool_t *ptemp)
+{
+    md_keypool_ctx_t *kctx = baton;
+    md_store_t *store = md_reg_store_get(kctx->mc->reg);
+    md_pkey_spec_t *spec;
+    apr_time_t wait_time;
+    int i, n, added = 0, more = 0;
+    
+    if (AP_WATCHDOG_STATE_RUNNING != state) return APR_SUCCESS;
+    
+    /* Generating a key may take seconds. We make only one per run, so
+     * that we never keep the machine busy for long. */
+    for (i = 0; i < kctx->specs->nelts && !more; ++i) {
+        spec = APR_ARRAY_IDX(kctx->specs, i, md_pkey_spec_t*);
+        n = md_keypool_count(store, spec, ptemp);
+        if (n >= kctx->mc->key_pool_depth) continue;
+        if (added) {
+            more = 1;
+        }
+        else if (APR_SUCCESS == md_keypool_add(store, spec, ptemp)) {
+            added = 1;
+            more = (n + 1 < kctx->mc->key_pool_depth);
+        }
+        else {
+            /* try again on the next regular run */
+            break;
+        }
+    }
+    
+    wait_time = apr_time_from_sec(more? 1 : 60);
+    wd_set_interval(kctx->watchdog, wait_time, kctx, run_keypool_watchdog);
+    return APR_SUCCESS;
+}
+
+static apr_status_t keypool_start_watching(md_mod_conf_t *mc, server_rec *s, 
+                                           md_renew_ctx_t *dctx)
+{
+    md_keypool_ctx_t *kctx;
+    apr_hash_t *names;
+    md_pkey_spec_t *spec;
+    const char *name;
+    md_job_t *job;
+    md_t *md;
+    apr_status_t rv;
+    int i, j;
+    
+    if (mc->key_pool_depth <= 0) return APR_SUCCESS;
+    
+    kctx = apr_pcalloc(dctx->p, sizeof(*kctx));
+    kctx->p = dctx->p;
+    kctx->s = s;
+    kctx->mc = mc;
+    kctx->specs = apr_array_make(kctx->p, 5, sizeof(md_pkey_spec_t*));
+    names = apr_hash_make(kctx->p);
+    
+    for (i = 0; i < dctx->jobs->nelts; ++i) {
+        job = APR_ARRAY_IDX(dctx->jobs, i, md_job_t*);
+        md = md_get_by_name(mc->mds, job->mdomain);
+        if (!md) continue;
+        for (j = 0; j < md_pkeys_spec_count(md->pks); ++j) {
+            spec = md_pkeys_spec_is_empty(md->pks)? NULL : md_pkeys_spec_get(md->pks, j);
+            name = md_keypool_name(spec, kctx->p);
+            if (apr_hash_get(names, name, APR_HASH_KEY_STRING)) continue;
+            apr_hash_set(names, name, APR_HASH_KEY_STRING, name);
+            APR_ARRAY_PUSH(kctx->specs, md_pkey_spec_t*) = spec;
+        }
+    }
+    
+    if (APR_SUCCESS != (rv = wd_get_instance(&kctx->watchdog, MD_KEYPOOL_WATCHDOG_NAME, 
+                                             0, 1, kctx->p))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, 
+                     "create md keypool watchdog(%s)", MD_KEYPOOL_WATCHDOG_NAME);
+        return rv;
+    }
+    rv = wd_register_callback(kctx->watchdog, 0, kctx, run_keypool_watchdog);
+    ap_log_error(APLOG_MARK, rv? APLOG_WARNING : APLOG_DEBUG, rv, s, 
+                 "register md keypool watchdog(%s) for %d key types", 
+                 MD_KEYPOOL_WATCHDOG_NAME, kctx->specs->nelts);
+    return rv;
+}
+
 apr_status_t md_renew_start_watching(md_mod_conf_t *mc, server_rec *s, apr_pool_t *p)
 {
-    apr_allocator_t *allocator;
     md_renew_ctx_t *dctx;
-    apr_pool_t *dctxp;
+    apr_pool_t *dctxp, *jobp;
     apr_status_t rv;
     md_t *md;
     md_job_t *job;
@@ -281,27 +505,34 @@ apr_status_t md_renew_start_watching(md_mod_conf_t *mc, server_rec *s, apr_pool_
     /* We want our own pool with own allocator to keep data across watchdog invocations.
      * Since we'll run in a single watchdog thread, using our own allocator will prevent 
      * any confusion in the parent pool. */
-    apr_allocator_create(&allocator);
-    apr_allocator_max_free_set(allocator, 1);
-    rv = apr_pool_create_ex(&dctxp, p, NULL, allocator);
+    rv = own_pool_create(&dctxp, p, "md_renew_watchdog");
     if (rv != APR_SUCCESS) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10062) "md_renew_watchdog: create pool");
         return rv;
     }
-    apr_allocator_owner_set(allocator, dctxp);
-    apr_pool_tag(dctxp, "md_renew_watchdog");
 
     dctx = apr_pcalloc(dctxp, sizeof(*dctx));
     dctx->p = dctxp;
     dctx->s = s;
     dctx->mc = mc;
     
+    /* Renewals driven here must not sleep while the CA processes an order.
+     * They yield and their job is run again when the CA asks us to look. */
+    apr_table_setn(mc->env, MD_KEY_RENEW_NOWAIT, "on");
+    
     dctx->jobs = apr_array_make(dctx->p, mc->mds->nelts, sizeof(md_job_t *));
     for (i = 0; i < mc->mds->nelts; ++i) {
         md = APR_ARRAY_IDX(mc->mds, i, md_t*);
         if (!md || !md->watched) continue;
         
-        job = md_reg_job_make(mc->reg, md->name, p);
+        /* Jobs may be processed in parallel. Each gets its own pool and
+         * only writes to its own MD's areas in the store. */
+        rv = own_pool_create(&jobp, dctx->p, "md_renew_job");
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "md(%s): create job pool", md->name);
+            return rv;
+        }
+        job = md_reg_job_make(mc->reg, md->name, jobp);
         APR_ARRAY_PUSH(dctx->jobs, md_job_t*) = job;
         ap_log_error( APLOG_MARK, APLOG_TRACE1, 0, dctx->s,  
                      "md(%s): state=%d, created drive job", md->name, md->state);
@@ -330,6 +561,16 @@ apr_status_t md_renew_start_watching(md_mod_conf_t *mc, server_rec *s, apr_pool_
         return APR_SUCCESS;
     }
     
+#if APR_HAS_THREADS
+    if (mc->renew_workers > 1 && dctx->jobs->nelts > 1
+        && APR_SUCCESS != (rv = apr_thread_mutex_create(&dctx->mutex, 
+                                                        APR_THREAD_MUTEX_DEFAULT, dctx->p))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, 
+                     "md renew watchdog: create mutex, renewing one md at a time");
+        dctx->mutex = NULL;
+    }
+#endif
+    
     if (APR_SUCCESS != (rv = wd_get_instance(&dctx->watchdog, MD_RENEW_WATCHDOG_NAME, 0, 1, dctx->p))) {
         ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10066) 
                      "create md renew watchdog(%s)", MD_RENEW_WATCHDOG_NAME);
@@ -338,5 +579,9 @@ apr_status_t md_renew_start_watching(md_mod_conf_t *mc, server_rec *s, apr_pool_
     rv = wd_register_callback(dctx->watchdog, 0, dctx, run_watchdog);
     ap_log_error(APLOG_MARK, rv? APLOG_CRIT : APLOG_DEBUG, rv, s, APLOGNO(10067) 
                  "register md renew watchdog(%s)", MD_RENEW_WATCHDOG_NAME);
+    if (APR_SUCCESS == rv) {
+        /* renewals work without a key pool, just slower */
+        keypool_start_watching(mc, s, dctx);
+    }
     return rv;
 }
@@ -89,8 +89,7 @@ int md_ocsp_get_stapling_status(unsigned char **pder, int *pderlen,
           APR_ARRAY_IDX(sc->assigned, 0, const md_t*) : NULL);
     ap_log_cerror(APLOG_MARK, APLOG_TRACE2, 0, c, "get stapling for: %s", 
                   md? md->name : s->server_hostname);
-    rv = md_ocsp_get_status(pder, pderlen, sc->mc->ocsp, 
-                            md_cert_wrap(c->pool, cert), c->pool, md);
+    rv = md_ocsp_get_status(pder, pderlen, sc->mc->ocsp, cert, c->pool, md);
     if (APR_STATUS_IS_ENOENT(rv)) goto declined;
     return rv;
     
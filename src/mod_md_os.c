@@ -86,3 +86,12 @@ apr_status_t md_server_graceful(apr_pool_t *p, server_rec *s)
 
 #endif
 
+int md_cpu_count(void)
+{
+#if APR_HAVE_UNISTD_H && defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0)? (int)n : 1;
+#else
+    return 1;
+#endif
+}
@@ -76,7 +76,7 @@ int md_http_cert_status(request_rec *r)
     /* We are looking for information about a staged certificate */
     sc = ap_get_module_config(r->server->module_config, &md_module);
     if (!sc || !sc->mc || !sc->mc->reg || !sc->mc->certificate_status_enabled) return DECLINED;
-    md = md_get_by_domain(sc->mc->mds, r->hostname);
+    md = md_config_get_by_domain(sc->mc, r->hostname);
     if (!md) return DECLINED;
 
     if (r->method_number != M_GET) {
@@ -688,7 +688,7 @@ int md_status_handler(request_rec *r)
     if (r->path_info && r->path_info[0] == '/' && r->path_info[1] != '\0') {
         name = strrchr(r->path_info, '/') + 1;
         md = md_get_by_name(mc->mds, name);
-        if (!md) md = md_get_by_domain(mc->mds, name);
+        if (!md) md = md_config_get_by_domain(mc, name);
     }
     
     if (md) {
@@ -5,6 +5,7 @@ import sys
 
 curl = "curl"
 challtestsrv = "localhost:8055"
+logfile = None
 
 
 def run(args):
@@ -18,6 +19,13 @@ def run(args):
     return rv
 
 
+def log(args):
+    # record how we were called, for tests to check
+    if logfile:
+        with open(logfile, 'a') as fd:
+            fd.write("%s\n" % ' '.join(args))
+
+
 def teardown(domain):
     return run([curl, "-s", "-X", "POST",
                 "-d", "{\"host\":\"_acme-challenge.%s.\"}" % domain,
@@ -31,7 +39,38 @@ def setup(domain, challenge):
                 "%s/set-txt" % challtestsrv])
 
 
+def setup_batch(pairs):
+    # a domain may come twice, e.g. for 'a.org' and '*.a.org', both records must stay
+    domains = []
+    for domain, challenge in pairs:
+        if domain not in domains:
+            domains.append(domain)
+            rv = teardown(domain)
+            if rv != 0:
+                return rv
+    for domain, challenge in pairs:
+        rv = run([curl, "-s", "-X", "POST",
+                  "-d", "{\"host\":\"_acme-challenge.%s.\", \"value\":\"%s\"}" % (domain, challenge),
+                  "%s/set-txt" % challtestsrv])
+        if rv != 0:
+            return rv
+    return 0
+
+
+def teardown_batch(domains):
+    for domain in domains:
+        rv = teardown(domain)
+        if rv != 0:
+            return rv
+    return 0
+
+
 def main(argv):
+    global logfile
+    if len(argv) > 2 and argv[1] == '--log':
+        logfile = argv[2]
+        argv = argv[:1] + argv[3:]
+    log(argv[1:])
     if len(argv) > 1:
         if argv[1] == 'setup':
             if len(argv) != 4:
@@ -43,6 +82,16 @@ def main(argv):
                 sys.stderr.write("wrong number of arguments: dns01.py teardown <domain>")
                 sys.exit(1)
             rv = teardown(argv[2])
+        elif argv[1] == 'setup-batch':
+            if len(argv) < 4 or len(argv) % 2 != 0:
+                sys.stderr.write("wrong number of arguments: dns01.py setup-batch <domain> <challenge> ...")
+                sys.exit(1)
+            rv = setup_batch(list(zip(argv[2::2], argv[3::2])))
+        elif argv[1] == 'teardown-batch':
+            if len(argv) < 3:
+                sys.stderr.write("wrong number of arguments: dns01.py teardown-batch <domain> ...")
+                sys.exit(1)
+            rv = teardown_batch(argv[2:])
         else:
             sys.stderr.write("unknown option %s" % (argv[1]))
             rv = 2
@@ -0,0 +1,114 @@
+# test dns-01 challenges set up for all domains of an order at once
+
+import os
+
+from TestEnv import TestEnv
+from TestHttpdConf import HttpdConf
+
+
+def setup_module(module):
+    print("setup_module    module:%s" % module.__name__)
+    TestEnv.APACHE_CONF_SRC = "data/test_auto"
+    TestEnv.check_acme()
+    TestEnv.clear_store()
+    HttpdConf().install()
+    assert TestEnv.apache_start() == 0
+    
+
+def teardown_module(module):
+    print("teardown_module module:%s" % module.__name__)
+    assert TestEnv.apache_stop() == 0
+
+
+class TestDns01Batch:
+
+    def setup_method(self, method):
+        print("setup_method: %s" % method.__name__)
+        TestEnv.clear_store()
+        self.test_domain = TestEnv.get_method_domain(method)
+        self.dns01log = os.path.join(TestEnv.GEN_DIR, "dns01-%s.log" % method.__name__)
+        if os.path.exists(self.dns01log):
+            os.remove(self.dns01log)
+
+    def teardown_method(self, method):
+        print("teardown_method: %s" % method.__name__)
+
+    def dns01_calls(self):
+        with open(self.dns01log) as fd:
+            return [line.split() for line in fd.read().splitlines()]
+
+    # -----------------------------------------------------------------------------------------------
+    # test case: wildcard and base domain, the same name twice in one batch
+    #
+    def test_721_001(self):
+        dns01cmd = ("%s/dns01.py --log %s" % (TestEnv.TESTROOT, self.dns01log))
+
+        domain = self.test_domain
+        domains = [domain, "*." + domain]
+        
+        conf = HttpdConf()
+        conf.add_admin("admin@not-forbidden.org")
+        conf.add_ca_challenges(["dns-01"])
+        conf.add_dns01_cmd(dns01cmd)
+        conf.add_dns01_batch("on")
+        conf.add_md(domains)
+        conf.add_vhost(domains)
+        conf.install()
+
+        # restart, check that md is in store
+        assert TestEnv.apache_restart() == 0
+        TestEnv.check_md(domains)
+        # await drive completion
+        assert TestEnv.await_completion([domain])
+        TestEnv.check_md_complete(domain)
+        # check: SSL is running OK
+        cert_a = TestEnv.get_cert(domain)
+        altnames = cert_a.get_san_list()
+        for name in domains:
+            assert name in altnames
+        # one setup with both challenges for the name, one teardown of the name
+        calls = self.dns01_calls()
+        assert [c[0] for c in calls] == ["setup-batch", "teardown-batch"]
+        assert calls[0][1::2] == [domain, domain]
+        assert calls[0][2] != calls[0][4]
+        assert calls[1][1:] == [domain]
+
+    # -----------------------------------------------------------------------------------------------
+    # test case: dns-01 for the wildcard, http-01 for the others, torn down each their way
+    #
+    def test_721_002(self):
+        dns01cmd = ("%s/dns01.py --log %s" % (TestEnv.TESTROOT, self.dns01log))
+
+        domain = self.test_domain
+        domain2 = "www." + domain
+        dwild = "*." + domain
+        domains = [domain, dwild, domain2]
+        
+        conf = HttpdConf()
+        conf.add_admin("admin@not-forbidden.org")
+        conf.add_ca_challenges(["http-01", "dns-01"])
+        conf.add_dns01_cmd(dns01cmd)
+        conf.add_dns01_batch("on")
+        conf.add_md(domains)
+        conf.add_vhost(domain2)
+        conf.add_vhost([domain, dwild])
+        conf.install()
+
+        # restart, check that md is in store
+        assert TestEnv.apache_restart() == 0
+        TestEnv.check_md(domains)
+        # await drive completion
+        assert TestEnv.await_completion([domain])
+        TestEnv.check_md_complete(domain)
+        cert_a = TestEnv.get_cert(domain)
+        altnames = cert_a.get_san_list()
+        for name in domains:
+            assert name in altnames
+        # only the wildcard went through the command
+        calls = self.dns01_calls()
+        assert [c[0] for c in calls] == ["setup-batch", "teardown-batch"]
+        assert calls[0][1::2] == [domain]
+        assert calls[1][1:] == [domain]
+        # the http-01 challenges are gone from the store as well
+        for name in [domain, domain2]:
+            assert not os.path.exists(os.path.join(TestEnv.STORE_DIR, "challenges", name))
@@ -20,7 +20,12 @@ static Suite *main_test_suite(void)
 {
     Suite *suite = suite_create("main");
 
+    suite_add_tcase(suite, md_curl_test_case());
+    suite_add_tcase(suite, md_helper_test_case());
     suite_add_tcase(suite, md_json_test_case());
+    suite_add_tcase(suite, md_jws_test_case());
+    suite_add_tcase(suite, md_ocsp_test_case());
+    suite_add_tcase(suite, md_reg_test_case());
     suite_add_tcase(suite, md_util_test_case());
 
     return suite;
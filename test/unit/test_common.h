@@ -40,5 +40,10 @@
  * main_test_suite() in main.c.
  */
 
+TCase *md_curl_test_case(void);
+TCase *md_helper_test_case(void);
 TCase *md_json_test_case(void);
+TCase *md_jws_test_case(void);
+TCase *md_ocsp_test_case(void);
+TCase *md_reg_test_case(void);
 TCase *md_util_test_case(void);
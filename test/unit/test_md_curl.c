@@ -0,0 +1,290 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_buckets.h>
+#include <apr_env.h>
+#include <apr_network_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
+
+#include "test_common.h"
+#include "md_curl.h"
+#include "md_http.h"
+
+#define RESPONSE        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n" \
+                        "Content-Length: 2\r\n\r\nok"
+#define BENCH_REQUESTS  500
+
+/*
+ * A local HTTP stand-in: answers every request on a connection with "ok",
+ * one thread per connection.
+ */
+
+typedef struct {
+    apr_pool_t *p;
+    apr_socket_t *listener;
+    apr_port_t port;
+    volatile int stop;
+    apr_thread_t *thread;
+    apr_array_header_t *conns;  /* conn_t, only used by the server thread */
+} server_t;
+
+typedef struct {
+    apr_pool_t *p;
+    apr_thread_t *thread;
+} conn_t;
+
+static server_t g_server;
+
+static apr_status_t send_all(apr_socket_t *s, const char *data, apr_size_t len)
+{
+    apr_size_t n;
+    apr_status_t rv = APR_SUCCESS;
+
+    while (len > 0 && APR_SUCCESS == rv) {
+        n = len;
+        rv = apr_socket_send(s, data, &n);
+        data += n;
+        len -= n;
+    }
+    return rv;
+}
+
+static void * APR_THREAD_FUNC conn_run(apr_thread_t *thread, void *data)
+{
+    apr_socket_t *s = data;
+    char buf[4096], *end;
+    apr_size_t len, have = 0;
+    apr_status_t rv;
+
+    (void)thread;
+    while (!g_server.stop) {
+        len = sizeof(buf) - have - 1;
+        rv = apr_socket_recv(s, buf + have, &len);
+        if (APR_STATUS_IS_TIMEUP(rv) || APR_STATUS_IS_EAGAIN(rv)) continue;
+        if (len == 0) break;
+        have += len;
+        buf[have] = '\0';
+        while ((end = strstr(buf, "\r\n\r\n"))) {
+            /* requests have no body, so this is one complete request */
+            if (APR_SUCCESS != send_all(s, RESPONSE, sizeof(RESPONSE)-1)) goto leave;
+            have -= (apr_size_t)(end + 4 - buf);
+            memmove(buf, end + 4, have + 1);
+        }
+        if (APR_SUCCESS != rv || have >= sizeof(buf) - 1) break;
+    }
+leave:
+    apr_socket_close(s);
+    return NULL;
+}
+
+static void * APR_THREAD_FUNC server_run(apr_thread_t *thread, void *data)
+{
+    apr_socket_t *s;
+    apr_pool_t *p;
+    apr_thread_t *t;
+    apr_status_t rv;
+    conn_t *conn;
+    int i;
+
+    (void)thread;
+    (void)data;
+    while (!g_server.stop) {
+        if (APR_SUCCESS != apr_pool_create(&p, NULL)) break;
+        rv = apr_socket_accept(&s, g_server.listener, p);
+        if (APR_SUCCESS == rv) {
+            apr_socket_timeout_set(s, apr_time_from_msec(100));
+            if (APR_SUCCESS == apr_thread_create(&t, NULL, conn_run, s, p)) {
+                conn = apr_array_push(g_server.conns);
+                conn->p = p;
+                conn->thread = t;
+                continue;
+            }
+            apr_socket_close(s);
+        }
+        apr_pool_destroy(p);
+    }
+    for (i = 0; i < g_server.conns->nelts; ++i) {
+        conn = &APR_ARRAY_IDX(g_server.conns, i, conn_t);
+        apr_thread_join(&rv, conn->thread);
+        apr_pool_destroy(conn->p);
+    }
+    return NULL;
+}
+
+static void server_start(void)
+{
+    apr_sockaddr_t *sa;
+
+    memset(&g_server, 0, sizeof(g_server));
+    if (apr_pool_create(&g_server.p, NULL) != APR_SUCCESS
+        || apr_sockaddr_info_get(&sa, "127.0.0.1", APR_INET, 0, 0, g_server.p) != APR_SUCCESS
+        || apr_socket_create(&g_server.listener, APR_INET, SOCK_STREAM, APR_PROTO_TCP,
+                             g_server.p) != APR_SUCCESS
+        || apr_socket_opt_set(g_server.listener, APR_SO_REUSEADDR, 1) != APR_SUCCESS
+        || apr_socket_bind(g_server.listener, sa) != APR_SUCCESS
+        || apr_socket_listen(g_server.listener, 64) != APR_SUCCESS
+        || apr_socket_addr_get(&sa, APR_LOCAL, g_server.listener) != APR_SUCCESS
+        /* wake up now and then to see if we are done */
+        || apr_socket_timeout_set(g_server.listener, apr_time_from_msec(100)) != APR_SUCCESS) {
+        exit(1);
+    }
+    g_server.port = sa->port;
+    g_server.conns = apr_array_make(g_server.p, 10, sizeof(conn_t));
+    if (apr_thread_create(&g_server.thread, NULL, server_run, NULL, g_server.p) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void server_stop(void)
+{
+    apr_status_t rv;
+
+    g_server.stop = 1;
+    apr_thread_join(&rv, g_server.thread);
+    apr_socket_close(g_server.listener);
+    apr_pool_destroy(g_server.p);
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static const char *g_url;
+
+static void md_curl_setup(void)
+{
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+    /* talk to the stand-in directly, whatever the environment says */
+    apr_env_set("no_proxy", "127.0.0.1", g_pool);
+    md_http_use_implementation(md_curl_get_impl(g_pool));
+    server_start();
+    g_url = apr_psprintf(g_pool, "http://127.0.0.1:%d/ocsp", (int)g_server.port);
+}
+
+static void md_curl_teardown(void)
+{
+    /* curl may keep connections open, the server ends them when it stops */
+    apr_pool_destroy(g_pool);
+    server_stop();
+}
+
+/*
+ * Helpers
+ */
+
+typedef struct {
+    const char *url;
+    int total;
+    int max_parallel;
+    int started;
+    int ok;
+    int failed;
+} fetch_ctx_t;
+
+static apr_status_t fetch_on_response(const md_http_response_t *res, void *data)
+{
+    fetch_ctx_t *ctx = data;
+    apr_off_t len = 0;
+
+    if (res->status == 200 && res->body
+        && APR_SUCCESS == apr_brigade_length(res->body, 1, &len) && len == 2) {
+        ++ctx->ok;
+    }
+    else {
+        ++ctx->failed;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t fetch_next(md_http_request_t **preq, void *baton,
+                               md_http_t *http, int in_flight)
+{
+    fetch_ctx_t *ctx = baton;
+    apr_status_t rv;
+
+    *preq = NULL;
+    if (ctx->started >= ctx->total || in_flight >= ctx->max_parallel) return APR_ENOENT;
+    if (APR_SUCCESS != (rv = md_http_GET_create(preq, http, ctx->url, NULL))) return rv;
+    md_http_set_on_response_cb(*preq, fetch_on_response, ctx);
+    ++ctx->started;
+    return APR_SUCCESS;
+}
+
+static apr_time_t fetch(int total, int max_parallel)
+{
+    fetch_ctx_t ctx;
+    md_http_t *http;
+    apr_time_t start;
+    apr_status_t rv;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.url = g_url;
+    ctx.total = total;
+    ctx.max_parallel = max_parallel;
+    ck_assert_int_eq(APR_SUCCESS, md_http_create(&http, g_pool, "md-test", NULL));
+    start = apr_time_now();
+    rv = md_http_multi_perform(http, fetch_next, &ctx);
+    /* the loop ends when fetch_next() runs out of requests */
+    ck_assert(APR_SUCCESS == rv || APR_STATUS_IS_ENOENT(rv));
+    ck_assert_int_eq(0, ctx.failed);
+    ck_assert_int_eq(total, ctx.ok);
+    return apr_time_now() - start;
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(curl_multi_perform_all)
+{
+    fetch(1, 1);
+    fetch(50, 6);
+}
+END_TEST
+
+START_TEST(curl_multi_perform_bench)
+{
+    apr_time_t t_serial, t_parallel;
+
+    t_serial = fetch(BENCH_REQUESTS, 1);
+    t_parallel = fetch(BENCH_REQUESTS, 6);
+    fprintf(stdout, "# curl: %.3f ms per request one at a time, %.0f requests/s 6 in parallel\n",
+            (double)t_serial / BENCH_REQUESTS / 1000.0,
+            (double)BENCH_REQUESTS * APR_USEC_PER_SEC / (double)(t_parallel? t_parallel : 1));
+    fflush(stdout);
+}
+END_TEST
+
+TCase *md_curl_test_case(void)
+{
+    TCase *testcase = tcase_create("md_curl");
+
+    tcase_add_checked_fixture(testcase, md_curl_setup, md_curl_teardown);
+    tcase_set_timeout(testcase, 60);
+
+    tcase_add_test(testcase, curl_multi_perform_all);
+    tcase_add_test(testcase, curl_multi_perform_bench);
+
+    return testcase;
+}
@@ -0,0 +1,203 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_file_info.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
+
+#include "test_common.h"
+#include "md_helper.h"
+#include "md_util.h"
+
+/* A scripted helper: answers each request line as its first word says. */
+static const char *HELPER_SCRIPT =
+    "#!/bin/sh\n"
+    "while read cmd arg; do\n"
+    "  case \"$cmd\" in\n"
+    "    pid)   echo \"ok $$\" ;;\n"
+    "    fail)  echo \"error $arg\" ;;\n"
+    "    die)   exit 1 ;;\n"
+    "    long)  i=0; while [ $i -lt 1000 ]; do printf xxxxxxxxxx; i=$((i+1)); done; echo ;;\n"
+    "    sleep) sleep $arg; echo \"ok slept\" ;;\n"
+    "    *)     echo \"what?\" ;;\n"
+    "  esac\n"
+    "done\n";
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static const char *g_dir;
+static const char *g_cmd;
+static apr_array_header_t *g_env;
+
+static void md_helper_setup(void)
+{
+    const char *tmp;
+    apr_file_t *f;
+
+    /* like httpd, we want EPIPE from writes to a helper that went away */
+    signal(SIGPIPE, SIG_IGN);
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS
+        || apr_temp_dir_get(&tmp, g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+    g_dir = apr_psprintf(g_pool, "%s/md-test-helper-%" APR_TIME_T_FMT, tmp, apr_time_now());
+    g_cmd = apr_psprintf(g_pool, "%s/helper.sh", g_dir);
+    if (apr_dir_make_recursive(g_dir, APR_FPROT_OS_DEFAULT, g_pool) != APR_SUCCESS
+        || apr_file_open(&f, g_cmd, APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_TRUNCATE,
+                         APR_FPROT_UREAD|APR_FPROT_UWRITE|APR_FPROT_UEXECUTE, g_pool) != APR_SUCCESS
+        || apr_file_write_full(f, HELPER_SCRIPT, strlen(HELPER_SCRIPT), NULL) != APR_SUCCESS
+        || apr_file_close(f) != APR_SUCCESS) {
+        exit(1);
+    }
+    g_env = apr_array_make(g_pool, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(g_env, const char *) = "PATH=/usr/bin:/bin";
+    md_helper_init();
+}
+
+static void md_helper_teardown(void)
+{
+    md_helper_stop_all();
+    md_helper_set_timeout(MD_HELPER_TIMEOUT);
+    md_util_rm_recursive(g_dir, g_pool, 5);
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Helpers
+ */
+
+static apr_status_t call(const char **presponse, const char *request)
+{
+    return md_helper_call(presponse, g_cmd, g_env, request, g_pool);
+}
+
+static long helper_pid(void)
+{
+    const char *response;
+
+    ck_assert_int_eq(APR_SUCCESS, call(&response, "pid"));
+    ck_assert_ptr_nonnull(response);
+    ck_assert_int_gt(atol(response), 0);
+    return atol(response);
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(helper_keeps_running)
+{
+    long pid;
+
+    pid = helper_pid();
+    ck_assert_int_eq(pid, helper_pid());
+}
+END_TEST
+
+START_TEST(helper_error_answer)
+{
+    const char *response;
+    long pid;
+
+    pid = helper_pid();
+    ck_assert_int_eq(APR_EGENERAL, call(&response, "fail no such zone"));
+    ck_assert_str_eq("no such zone", response);
+    /* an error is an answer, the helper stays */
+    ck_assert_int_eq(pid, helper_pid());
+
+    ck_assert_int_eq(APR_EINVAL, call(&response, "gibberish"));
+    ck_assert_ptr_eq(NULL, response);
+    ck_assert_int_ne(pid, helper_pid());
+}
+END_TEST
+
+START_TEST(helper_restart_after_death)
+{
+    const char *response;
+    apr_proc_t proc;
+    long pid, pid2;
+
+    pid = helper_pid();
+    memset(&proc, 0, sizeof(proc));
+    proc.pid = (pid_t)pid;
+    ck_assert_int_eq(APR_SUCCESS, apr_proc_kill(&proc, SIGKILL));
+    apr_sleep(apr_time_from_msec(100));
+    /* the request goes to a new helper */
+    pid2 = helper_pid();
+    ck_assert_int_ne(pid, pid2);
+
+    /* one dying on the request itself is retried once, then given up */
+    ck_assert_int_ne(APR_SUCCESS, call(&response, "die"));
+    ck_assert_ptr_eq(NULL, response);
+    ck_assert_int_ne(pid2, helper_pid());
+}
+END_TEST
+
+START_TEST(helper_overlong_answer)
+{
+    const char *response;
+    long pid;
+
+    pid = helper_pid();
+    ck_assert_int_eq(APR_ENOSPC, call(&response, "long"));
+    ck_assert_ptr_eq(NULL, response);
+    /* the rest of the line is not taken as the answer to the next request */
+    ck_assert_int_ne(pid, helper_pid());
+}
+END_TEST
+
+START_TEST(helper_timeout)
+{
+    const char *response;
+    apr_time_t start;
+    long pid;
+
+    md_helper_set_timeout(apr_time_from_sec(1));
+    start = apr_time_now();
+    ck_assert_int_eq(APR_TIMEUP, call(&response, "sleep 5"));
+    ck_assert_ptr_eq(NULL, response);
+    ck_assert_int_lt(apr_time_now() - start, apr_time_from_sec(5));
+
+    pid = helper_pid();
+    ck_assert_int_eq(APR_SUCCESS, call(&response, "sleep 0"));
+    ck_assert_str_eq("slept", response);
+    ck_assert_int_eq(pid, helper_pid());
+}
+END_TEST
+
+TCase *md_helper_test_case(void)
+{
+    TCase *testcase = tcase_create("md_helper");
+
+    tcase_add_checked_fixture(testcase, md_helper_setup, md_helper_teardown);
+    tcase_set_timeout(testcase, 30);
+
+    tcase_add_test(testcase, helper_keeps_running);
+    tcase_add_test(testcase, helper_error_answer);
+    tcase_add_test(testcase, helper_restart_after_death);
+    tcase_add_test(testcase, helper_overlong_answer);
+    tcase_add_test(testcase, helper_timeout);
+
+    return testcase;
+}
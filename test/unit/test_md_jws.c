@@ -0,0 +1,202 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_time.h>
+
+#include "test_common.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_jws.h"
+#include "md_util.h"
+
+#define KID         "https://ca.example.org/acme/acct/4711"
+#define SIGN_ROUNDS 200
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static md_pkey_t *g_pkey;
+
+static void md_jws_setup(void)
+{
+    md_pkey_spec_t spec;
+
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS
+        || md_crypt_init(g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+    spec.type = MD_PKEY_TYPE_RSA;
+    spec.params.rsa.bits = 2048;
+    if (md_pkey_gen(&g_pkey, g_pool, &spec) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_jws_teardown(void)
+{
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Helpers
+ */
+
+static apr_table_t *make_headers(apr_pool_t *p, const char *nonce, const char *url)
+{
+    apr_table_t *headers = apr_table_make(p, 5);
+
+    apr_table_set(headers, "nonce", nonce);
+    apr_table_set(headers, "url", url);
+    return headers;
+}
+
+static md_json_t *decode_json(const char *s64)
+{
+    md_data_t data;
+    md_json_t *json;
+
+    md_util_base64url_decode(&data, s64, g_pool);
+    ck_assert(data.len > 0);
+    ck_assert_int_eq(APR_SUCCESS, md_json_readd(&json, g_pool, data.data, data.len));
+    return json;
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(jws_ctx_sign_kid)
+{
+    md_jws_ctx_t *ctx;
+    md_json_t *msg, *prot;
+    md_data_t payload;
+    const char *prot64, *pay64, *sign64, *signed_data, *expected;
+
+    ck_assert_int_eq(APR_SUCCESS, md_jws_ctx_create(&ctx, g_pool, g_pkey, KID));
+    ck_assert(md_jws_ctx_is_for(ctx, g_pkey, KID));
+    ck_assert(!md_jws_ctx_is_for(ctx, g_pkey, NULL));
+    ck_assert(!md_jws_ctx_is_for(ctx, g_pkey, "https://ca.example.org/acme/acct/1"));
+
+    MD_DATA_SET_STR(&payload, "{\"status\":\"valid\"}");
+    ck_assert_int_eq(APR_SUCCESS, md_jws_ctx_sign(&msg, ctx, g_pool, &payload,
+                     make_headers(g_pool, "n0nce", "https://ca.example.org/acme/new-order")));
+
+    prot64 = md_json_gets(msg, "protected", NULL);
+    pay64 = md_json_gets(msg, "payload", NULL);
+    sign64 = md_json_gets(msg, "signature", NULL);
+    ck_assert_ptr_nonnull(prot64);
+    ck_assert_ptr_nonnull(pay64);
+    ck_assert_ptr_nonnull(sign64);
+
+    prot = decode_json(prot64);
+    ck_assert_str_eq("RS256", md_json_gets(prot, "alg", NULL));
+    ck_assert_str_eq(KID, md_json_gets(prot, "kid", NULL));
+    ck_assert_str_eq("n0nce", md_json_gets(prot, "nonce", NULL));
+    ck_assert_str_eq("https://ca.example.org/acme/new-order", md_json_gets(prot, "url", NULL));
+    ck_assert(!md_json_has_key(prot, "jwk", NULL));
+
+    /* RS256 signatures are deterministic, the plain signing must agree */
+    signed_data = apr_psprintf(g_pool, "%s.%s", prot64, pay64);
+    ck_assert_int_eq(APR_SUCCESS, md_crypt_sign64(&expected, g_pkey, g_pool,
+                                                  signed_data, strlen(signed_data)));
+    ck_assert_str_eq(expected, sign64);
+}
+END_TEST
+
+START_TEST(jws_ctx_sign_jwk)
+{
+    md_jws_ctx_t *ctx;
+    md_json_t *msg, *prot;
+    md_data_t payload;
+    const char *thumb64;
+
+    ck_assert_int_eq(APR_SUCCESS, md_jws_ctx_create(&ctx, g_pool, g_pkey, NULL));
+    ck_assert(md_jws_ctx_is_for(ctx, g_pkey, NULL));
+
+    MD_DATA_SET_STR(&payload, "");
+    ck_assert_int_eq(APR_SUCCESS, md_jws_ctx_sign(&msg, ctx, g_pool, &payload,
+                     make_headers(g_pool, "a\"b\\c\n", "https://ca.example.org/acme/new-acct")));
+    prot = decode_json(md_json_gets(msg, "protected", NULL));
+    ck_assert_str_eq("RSA", md_json_gets(prot, "jwk", "kty", NULL));
+    ck_assert_str_eq(md_pkey_get_rsa_e64(g_pkey, g_pool), md_json_gets(prot, "jwk", "e", NULL));
+    ck_assert_str_eq(md_pkey_get_rsa_n64(g_pkey, g_pool), md_json_gets(prot, "jwk", "n", NULL));
+    ck_assert(!md_json_has_key(prot, "kid", NULL));
+    /* header values are escaped properly */
+    ck_assert_str_eq("a\"b\\c\n", md_json_gets(prot, "nonce", NULL));
+
+    ck_assert_int_eq(APR_SUCCESS, md_jws_pkey_thumb(&thumb64, g_pool, g_pkey));
+    ck_assert_str_eq(thumb64, md_jws_ctx_thumb(ctx));
+}
+END_TEST
+
+START_TEST(jws_sign_bench)
+{
+    md_jws_ctx_t *ctx;
+    md_json_t *msg;
+    md_data_t payload;
+    apr_pool_t *ptemp;
+    apr_time_t start, t_ctx, t_plain;
+    const char *nonce;
+    int i;
+
+    MD_DATA_SET_STR(&payload, "{\"identifiers\":[{\"type\":\"dns\",\"value\":\"example.org\"}]}");
+    ck_assert_int_eq(APR_SUCCESS, md_jws_ctx_create(&ctx, g_pool, g_pkey, KID));
+    ck_assert_int_eq(APR_SUCCESS, apr_pool_create(&ptemp, g_pool));
+
+    start = apr_time_now();
+    for (i = 0; i < SIGN_ROUNDS; ++i) {
+        nonce = apr_psprintf(ptemp, "nonce-%d", i);
+        ck_assert_int_eq(APR_SUCCESS, md_jws_ctx_sign(&msg, ctx, ptemp, &payload,
+                         make_headers(ptemp, nonce, "https://ca.example.org/acme/new-order")));
+        apr_pool_clear(ptemp);
+    }
+    t_ctx = apr_time_now() - start;
+
+    start = apr_time_now();
+    for (i = 0; i < SIGN_ROUNDS; ++i) {
+        nonce = apr_psprintf(ptemp, "nonce-%d", i);
+        ck_assert_int_eq(APR_SUCCESS, md_jws_sign(&msg, ptemp, &payload,
+                         make_headers(ptemp, nonce, "https://ca.example.org/acme/new-order"),
+                         g_pkey, KID));
+        apr_pool_clear(ptemp);
+    }
+    t_plain = apr_time_now() - start;
+
+    fprintf(stdout, "# jws: %.0f signed requests/s with context, %.0f/s without\n",
+            (double)SIGN_ROUNDS * APR_USEC_PER_SEC / (double)(t_ctx? t_ctx : 1),
+            (double)SIGN_ROUNDS * APR_USEC_PER_SEC / (double)(t_plain? t_plain : 1));
+    fflush(stdout);
+}
+END_TEST
+
+TCase *md_jws_test_case(void)
+{
+    TCase *testcase = tcase_create("md_jws");
+
+    tcase_add_checked_fixture(testcase, md_jws_setup, md_jws_teardown);
+    tcase_set_timeout(testcase, 60);
+
+    tcase_add_test(testcase, jws_ctx_sign_kid);
+    tcase_add_test(testcase, jws_ctx_sign_jwk);
+    tcase_add_test(testcase, jws_sign_bench);
+
+    return testcase;
+}
@@ -0,0 +1,358 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_ocsp.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_time.h"
+#include "md_util.h"
+
+#define RESPONDER       "http://ocsp.example.org"
+#define RESPONSE        "not really DER, but the registry does not look inside"
+#define LOOKUP_ROUNDS   200000
+#define LOOKUP_THREADS  4
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static const char *g_dir;
+static md_store_t *g_store;
+static md_ocsp_reg_t *g_reg;
+static md_cert_t *g_issuer;
+static md_cert_t *g_cert;
+
+static X509 *make_x509(EVP_PKEY *pkey, const char *cn, long serial,
+                       X509 *issuer, EVP_PKEY *issuer_pkey)
+{
+    X509 *x;
+    X509_NAME *n;
+    X509_EXTENSION *ext;
+    X509V3_CTX ctx;
+
+    if (!(x = X509_new())) return NULL;
+    X509_set_version(x, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x), serial);
+    X509_gmtime_adj(X509_get_notBefore(x), 0);
+    X509_gmtime_adj(X509_get_notAfter(x), 24 * 60 * 60);
+    X509_set_pubkey(x, pkey);
+    n = X509_get_subject_name(x);
+    X509_NAME_add_entry_by_txt(n, "CN", MBSTRING_ASC, (const unsigned char*)cn, -1, -1, 0);
+    X509_set_issuer_name(x, issuer? X509_get_subject_name(issuer) : n);
+    if (issuer) {
+        X509V3_set_ctx_nodb(&ctx);
+        X509V3_set_ctx(&ctx, issuer, x, NULL, NULL, 0);
+        ext = X509V3_EXT_conf_nid(NULL, &ctx, NID_info_access, (char*)"OCSP;URI:"RESPONDER);
+        if (ext) {
+            X509_add_ext(x, ext, -1);
+            X509_EXTENSION_free(ext);
+        }
+    }
+    if (!X509_sign(x, issuer_pkey? issuer_pkey : pkey, EVP_sha256())) {
+        X509_free(x);
+        return NULL;
+    }
+    return x;
+}
+
+static void md_ocsp_setup(void)
+{
+    const char *tmp;
+    md_timeslice_t *window;
+    md_pkey_spec_t spec;
+    md_pkey_t *ca_key, *key;
+    X509 *ca;
+
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS
+        || md_crypt_init(g_pool) != APR_SUCCESS
+        || apr_temp_dir_get(&tmp, g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+    g_dir = apr_psprintf(g_pool, "%s/md-test-ocsp-%" APR_TIME_T_FMT, tmp, apr_time_now());
+    spec.type = MD_PKEY_TYPE_RSA;
+    spec.params.rsa.bits = 2048;
+    if (apr_dir_make_recursive(g_dir, APR_FPROT_OS_DEFAULT, g_pool) != APR_SUCCESS
+        || md_store_fs_init(&g_store, g_pool, g_dir) != APR_SUCCESS
+        || md_timeslice_create(&window, g_pool, 0, apr_time_from_sec(60 * 60)) != APR_SUCCESS
+        || md_ocsp_reg_make(&g_reg, g_pool, g_store, window, "md-test", NULL) != APR_SUCCESS
+        || md_pkey_gen(&ca_key, g_pool, &spec) != APR_SUCCESS
+        || md_pkey_gen(&key, g_pool, &spec) != APR_SUCCESS) {
+        exit(1);
+    }
+    ca = make_x509(md_pkey_get_EVP_PKEY(ca_key), "Test CA", 1, NULL, NULL);
+    if (!ca) exit(1);
+    g_issuer = md_cert_make(g_pool, ca);
+    g_cert = md_cert_make(g_pool, make_x509(md_pkey_get_EVP_PKEY(key), "a.example.org", 2,
+                                            ca, md_pkey_get_EVP_PKEY(ca_key)));
+    if (!md_cert_get_X509(g_cert)) exit(1);
+}
+
+static void md_ocsp_teardown(void)
+{
+    md_util_rm_recursive(g_dir, g_pool, 5);
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Helpers
+ */
+
+/* Save a response for cert where the registry looks for it when priming. */
+static void save_response(md_cert_t *cert, const char *der, md_ocsp_cert_stat_t stat,
+                          const md_timeperiod_t *valid)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int dlen = 0;
+    const char *hexid;
+    md_data_t id, resp;
+    md_json_t *json;
+
+    ck_assert(X509_digest(md_cert_get_X509(cert), EVP_sha1(), digest, &dlen) == 1);
+    id.data = (const char*)digest;
+    id.len = dlen;
+    ck_assert_int_eq(APR_SUCCESS, md_data_to_hex(&hexid, 0, g_pool, &id));
+    MD_DATA_SET_STR(&resp, der);
+
+    json = md_json_create(g_pool);
+    md_json_sets(md_util_base64url_encode(&resp, g_pool), json, MD_KEY_RESPONSE, NULL);
+    md_json_sets(md_ocsp_cert_stat_name(stat), json, MD_KEY_STATUS, NULL);
+    md_json_set_timeperiod(valid, json, MD_KEY_VALID, NULL);
+    ck_assert_int_eq(APR_SUCCESS, md_store_save_json(g_store, g_pool, MD_SG_OCSP, MD_OTHER,
+                     apr_psprintf(g_pool, "ocsp-%s.json", hexid), json, 0));
+}
+
+static void save_good_response(void)
+{
+    md_timeperiod_t valid;
+
+    valid.start = apr_time_now() - apr_time_from_sec(60);
+    valid.end = apr_time_now() + apr_time_from_sec(7 * MD_SECS_PER_DAY);
+    save_response(g_cert, RESPONSE, MD_OCSP_CERT_ST_GOOD, &valid);
+}
+
+static void assert_response(X509 *x)
+{
+    unsigned char *der;
+    int der_len;
+
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_get_status(&der, &der_len, g_reg, x, g_pool, NULL));
+    ck_assert_int_eq((int)strlen(RESPONSE), der_len);
+    ck_assert(der != NULL && !memcmp(RESPONSE, der, (size_t)der_len));
+    OPENSSL_free(der);
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(ocsp_get_status_stored)
+{
+    md_ocsp_cert_stat_t stat;
+    md_timeperiod_t valid;
+
+    save_good_response();
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_prime(g_reg, g_cert, g_issuer, NULL));
+    ck_assert_int_eq(1, (int)md_ocsp_count(g_reg));
+    assert_response(md_cert_get_X509(g_cert));
+
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_get_meta(&stat, &valid, g_reg, g_cert,
+                                                    g_pool, NULL));
+    ck_assert_int_eq(MD_OCSP_CERT_ST_GOOD, stat);
+    ck_assert(valid.end > apr_time_now());
+}
+END_TEST
+
+START_TEST(ocsp_get_status_none)
+{
+    unsigned char *der;
+    int der_len;
+
+    /* known certificate, but no response yet: nothing to staple */
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_prime(g_reg, g_cert, g_issuer, NULL));
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_get_status(&der, &der_len, g_reg,
+                     md_cert_get_X509(g_cert), g_pool, NULL));
+    ck_assert(der == NULL);
+    ck_assert_int_eq(0, der_len);
+
+    /* the certificate of the issuer was never primed */
+    ck_assert(APR_STATUS_IS_ENOENT(md_ocsp_get_status(&der, &der_len, g_reg,
+              md_cert_get_X509(g_issuer), g_pool, NULL)));
+}
+END_TEST
+
+START_TEST(ocsp_get_status_shm)
+{
+    save_good_response();
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_prime(g_reg, g_cert, g_issuer, NULL));
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_shm_init(g_reg, g_pool));
+    /* now answered from the shared memory slot */
+    assert_response(md_cert_get_X509(g_cert));
+}
+END_TEST
+
+START_TEST(ocsp_get_status_unprimed)
+{
+    X509 *copy;
+
+    save_good_response();
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_prime(g_reg, g_cert, g_issuer, NULL));
+    /* another X509 instance of the same certificate is found by its digest */
+    copy = X509_dup(md_cert_get_X509(g_cert));
+    ck_assert_ptr_nonnull(copy);
+    assert_response(copy);
+    /* priming it again attaches the existing status */
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_prime(g_reg, md_cert_wrap(g_pool, copy),
+                                                g_issuer, NULL));
+    ck_assert_int_eq(1, (int)md_ocsp_count(g_reg));
+    assert_response(copy);
+    X509_free(copy);
+}
+END_TEST
+
+START_TEST(ocsp_get_status_reg_gone)
+{
+    md_ocsp_reg_t *reg;
+    md_timeslice_t *window;
+    apr_pool_t *p;
+    unsigned char *der;
+    int der_len;
+
+    /* a registry that goes away must not leave its status at the X509 */
+    ck_assert_int_eq(APR_SUCCESS, apr_pool_create(&p, g_pool));
+    ck_assert_int_eq(APR_SUCCESS, md_timeslice_create(&window, p, 0, apr_time_from_sec(60)));
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_reg_make(&reg, p, g_store, window, "md-test", NULL));
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_prime(reg, g_cert, g_issuer, NULL));
+    apr_pool_destroy(p);
+    ck_assert(APR_STATUS_IS_ENOENT(md_ocsp_get_status(&der, &der_len, g_reg,
+              md_cert_get_X509(g_cert), g_pool, NULL)));
+}
+END_TEST
+
+typedef struct {
+    apr_pool_t *p;
+    X509 *x;
+    int rounds;
+    int failed;
+} lookup_ctx_t;
+
+static void * APR_THREAD_FUNC lookup_run(apr_thread_t *thread, void *data)
+{
+    lookup_ctx_t *ctx = data;
+    unsigned char *der;
+    int i, der_len;
+
+    (void)thread;
+    for (i = 0; i < ctx->rounds; ++i) {
+        if (APR_SUCCESS != md_ocsp_get_status(&der, &der_len, g_reg, ctx->x, ctx->p, NULL)
+            || der_len != (int)strlen(RESPONSE)) {
+            ++ctx->failed;
+        }
+        OPENSSL_free(der);
+    }
+    return NULL;
+}
+
+static double lookup_bench(X509 *x, int nthreads)
+{
+    apr_thread_t *threads[LOOKUP_THREADS];
+    lookup_ctx_t ctx[LOOKUP_THREADS];
+    apr_status_t rv;
+    apr_time_t start, duration;
+    int i;
+
+    start = apr_time_now();
+    for (i = 0; i < nthreads; ++i) {
+        ctx[i].x = x;
+        ctx[i].rounds = LOOKUP_ROUNDS / nthreads;
+        ctx[i].failed = 0;
+        ck_assert_int_eq(APR_SUCCESS, apr_pool_create(&ctx[i].p, g_pool));
+        ck_assert_int_eq(APR_SUCCESS, apr_thread_create(&threads[i], NULL, lookup_run,
+                                                        &ctx[i], g_pool));
+    }
+    for (i = 0; i < nthreads; ++i) {
+        apr_thread_join(&rv, threads[i]);
+        ck_assert_int_eq(0, ctx[i].failed);
+    }
+    duration = apr_time_now() - start;
+    return (double)LOOKUP_ROUNDS * APR_USEC_PER_SEC / (double)(duration? duration : 1);
+}
+
+START_TEST(ocsp_get_status_bench)
+{
+    X509 *x = md_cert_get_X509(g_cert);
+    double single, multi;
+
+    save_good_response();
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_prime(g_reg, g_cert, g_issuer, NULL));
+    single = lookup_bench(x, 1);
+    multi = lookup_bench(x, LOOKUP_THREADS);
+    fprintf(stdout, "# ocsp: %.0f stapling lookups/s in 1 thread, %.0f/s in %d threads\n",
+            single, multi, LOOKUP_THREADS);
+    fflush(stdout);
+}
+END_TEST
+
+START_TEST(ocsp_find_bench)
+{
+    X509 *copy;
+    double primed, digested;
+
+    save_good_response();
+    ck_assert_int_eq(APR_SUCCESS, md_ocsp_prime(g_reg, g_cert, g_issuer, NULL));
+    copy = X509_dup(md_cert_get_X509(g_cert));
+    ck_assert_ptr_nonnull(copy);
+    primed = lookup_bench(md_cert_get_X509(g_cert), 1);
+    digested = lookup_bench(copy, 1);
+    fprintf(stdout, "# ocsp: %.0f lookups/s of a primed X509, %.0f/s via its digest\n",
+            primed, digested);
+    fflush(stdout);
+    X509_free(copy);
+}
+END_TEST
+
+TCase *md_ocsp_test_case(void)
+{
+    TCase *testcase = tcase_create("md_ocsp");
+
+    tcase_add_checked_fixture(testcase, md_ocsp_setup, md_ocsp_teardown);
+    tcase_set_timeout(testcase, 60);
+
+    tcase_add_test(testcase, ocsp_get_status_stored);
+    tcase_add_test(testcase, ocsp_get_status_none);
+    tcase_add_test(testcase, ocsp_get_status_shm);
+    tcase_add_test(testcase, ocsp_get_status_unprimed);
+    tcase_add_test(testcase, ocsp_get_status_reg_gone);
+    tcase_add_test(testcase, ocsp_get_status_bench);
+    tcase_add_test(testcase, ocsp_find_bench);
+
+    return testcase;
+}
@@ -0,0 +1,285 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <apr_file_info.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_time.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_crypt.h"
+#include "md_reg.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_util.h"
+
+#define DOMAINS_PER_MD  10
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static const char *g_dir;
+static md_store_t *g_store;
+static md_reg_t *g_reg;
+
+static void md_reg_setup(void)
+{
+    const char *tmp;
+
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS
+        || md_crypt_init(g_pool) != APR_SUCCESS
+        || apr_temp_dir_get(&tmp, g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+    g_dir = apr_psprintf(g_pool, "%s/md-test-reg-%" APR_TIME_T_FMT, tmp, apr_time_now());
+    if (apr_dir_make_recursive(g_dir, APR_FPROT_OS_DEFAULT, g_pool) != APR_SUCCESS
+        || md_store_fs_init(&g_store, g_pool, g_dir) != APR_SUCCESS
+        || md_reg_create(&g_reg, g_pool, g_store, NULL, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_reg_teardown(void)
+{
+    md_util_rm_recursive(g_dir, g_pool, 5);
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Helpers
+ */
+
+static md_t *make_md(apr_pool_t *p, const char *name, const char *domains)
+{
+    apr_array_header_t *names;
+    char *s, *tok, *last;
+    md_t *md;
+
+    names = apr_array_make(p, 5, sizeof(const char*));
+    s = apr_pstrdup(p, domains);
+    for (tok = apr_strtok(s, " ", &last); tok; tok = apr_strtok(NULL, " ", &last)) {
+        APR_ARRAY_PUSH(names, const char*) = tok;
+    }
+    md = md_create(p, names);
+    md->name = name;
+    return md;
+}
+
+static int store_has(const char *name)
+{
+    md_t *md;
+    return md_load(g_store, MD_SG_DOMAINS, name, &md, g_pool) == APR_SUCCESS;
+}
+
+static md_t *make_numbered_md(apr_pool_t *p, const char *prefix, int n)
+{
+    apr_array_header_t *names;
+    md_t *md;
+    int i;
+
+    names = apr_array_make(p, DOMAINS_PER_MD, sizeof(const char*));
+    APR_ARRAY_PUSH(names, const char*) = apr_psprintf(p, "site%d.example.org", n);
+    for (i = 1; i < DOMAINS_PER_MD; ++i) {
+        APR_ARRAY_PUSH(names, const char*) = apr_psprintf(p, "w%d.site%d.example.org", i, n);
+    }
+    md = md_create(p, names);
+    md->name = apr_psprintf(p, "%s%d", prefix, n);
+    return md;
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(reg_sync_renames)
+{
+    apr_array_header_t *master;
+
+    ck_assert_int_eq(APR_SUCCESS, md_save(g_store, g_pool, MD_SG_DOMAINS,
+                     make_md(g_pool, "a", "a.org www.a.org"), 1));
+    ck_assert_int_eq(APR_SUCCESS, md_save(g_store, g_pool, MD_SG_DOMAINS,
+                     make_md(g_pool, "b", "b.org www.b.org"), 1));
+    ck_assert_int_eq(APR_SUCCESS, md_save(g_store, g_pool, MD_SG_DOMAINS,
+                     make_md(g_pool, "c", "c.org x.org"), 1));
+    ck_assert_int_eq(APR_SUCCESS, md_save(g_store, g_pool, MD_SG_DOMAINS,
+                     make_md(g_pool, "d", "d.org e.org"), 1));
+
+    master = apr_array_make(g_pool, 5, sizeof(md_t*));
+    /* unchanged */
+    APR_ARRAY_PUSH(master, md_t*) = make_md(g_pool, "a", "a.org www.a.org");
+    /* renamed, all domains in the old one (case does not matter) */
+    APR_ARRAY_PUSH(master, md_t*) = make_md(g_pool, "b2", "WWW.b.org");
+    /* renamed, most domains in common with 'c' */
+    APR_ARRAY_PUSH(master, md_t*) = make_md(g_pool, "c2", "c.org x.org y.org");
+    /* new */
+    APR_ARRAY_PUSH(master, md_t*) = make_md(g_pool, "n", "n.org www.n.org");
+
+    ck_assert_int_eq(APR_SUCCESS, md_reg_sync_start(g_reg, master, g_pool));
+    ck_assert(store_has("a"));
+    ck_assert(store_has("b2"));
+    ck_assert(!store_has("b"));
+    ck_assert(store_has("c2"));
+    ck_assert(!store_has("c"));
+    ck_assert(store_has("d"));
+    ck_assert(!store_has("n"));
+}
+END_TEST
+
+static void sync_bench(int count)
+{
+    apr_array_header_t *master;
+    apr_pool_t *ptemp;
+    apr_time_t start;
+    int i, renamed = 0;
+
+    ck_assert_int_eq(APR_SUCCESS, apr_pool_create(&ptemp, g_pool));
+    master = apr_array_make(g_pool, count, sizeof(md_t*));
+    for (i = 0; i < count; ++i) {
+        ck_assert_int_eq(APR_SUCCESS, md_save(g_store, ptemp, MD_SG_DOMAINS,
+                         make_numbered_md(ptemp, "md", i), 1));
+        apr_pool_clear(ptemp);
+        /* every 100th MD got a new name, every 100th after that is new */
+        if (i % 100 == 0) {
+            APR_ARRAY_PUSH(master, md_t*) = make_numbered_md(g_pool, "renamed", i);
+            ++renamed;
+        }
+        else {
+            APR_ARRAY_PUSH(master, md_t*) = make_numbered_md(g_pool, "md", i);
+        }
+        if (i % 100 == 1) {
+            APR_ARRAY_PUSH(master, md_t*) = make_numbered_md(g_pool, "new", i + count);
+        }
+    }
+
+    start = apr_time_now();
+    ck_assert_int_eq(APR_SUCCESS, md_reg_sync_start(g_reg, master, ptemp));
+    fprintf(stdout, "# reg sync: %d MDs, %d renamed, in %ld ms\n", count, renamed,
+            (long)apr_time_as_msec(apr_time_now() - start));
+    fflush(stdout);
+    ck_assert(store_has("renamed0"));
+    ck_assert(!store_has("md0"));
+    apr_pool_destroy(ptemp);
+}
+
+static apr_array_header_t *save_self_signed(md_t *md)
+{
+    apr_array_header_t *chain;
+    md_pkey_spec_t spec;
+    md_pkey_t *pkey;
+    md_cert_t *cert;
+
+    spec.type = MD_PKEY_TYPE_RSA;
+    spec.params.rsa.bits = 2048;
+    ck_assert_int_eq(APR_SUCCESS, md_pkey_gen(&pkey, g_pool, &spec));
+    ck_assert_int_eq(APR_SUCCESS, md_cert_self_sign(&cert, md->name, md->domains, pkey,
+                                                    apr_time_from_sec(86400), g_pool));
+    chain = apr_array_make(g_pool, 1, sizeof(md_cert_t*));
+    APR_ARRAY_PUSH(chain, md_cert_t*) = cert;
+    ck_assert_int_eq(APR_SUCCESS, md_pubcert_save(g_store, g_pool, MD_SG_DOMAINS, md->name,
+                                                  NULL, chain, 1));
+    return chain;
+}
+
+START_TEST(reg_snapshot)
+{
+    apr_array_header_t *mds, *chain, *certs;
+    const md_pubcert_t *pub;
+    const md_cert_t *cert;
+    md_reg_t *reg;
+    md_t *md;
+
+    md = make_md(g_pool, "a.org", "a.org www.a.org");
+    ck_assert_int_eq(APR_SUCCESS, md_save(g_store, g_pool, MD_SG_DOMAINS, md, 1));
+    mds = apr_array_make(g_pool, 1, sizeof(md_t*));
+    APR_ARRAY_PUSH(mds, md_t*) = md;
+    chain = save_self_signed(md);
+    cert = APR_ARRAY_IDX(chain, 0, const md_cert_t*);
+
+    /* without a snapshot, the chain is parsed and a snapshot is written */
+    ck_assert(APR_STATUS_IS_ENOENT(md_reg_snapshot_load(g_reg, mds, g_pool)));
+    ck_assert_int_eq(APR_SUCCESS, md_reg_get_pubcert(&pub, g_reg, md, NULL, g_pool));
+    ck_assert_ptr_nonnull(pub->certs);
+    ck_assert_int_eq(APR_SUCCESS, md_reg_snapshot_save(g_reg, mds, g_pool));
+
+    /* the next registry takes the unchanged chain from the snapshot */
+    ck_assert_int_eq(APR_SUCCESS, md_reg_create(&reg, g_pool, g_store, NULL, NULL));
+    ck_assert_int_eq(APR_SUCCESS, md_reg_snapshot_load(reg, mds, g_pool));
+    ck_assert_int_eq(APR_SUCCESS, md_reg_get_pubcert(&pub, reg, md, NULL, g_pool));
+    ck_assert(pub->certs == NULL);
+    ck_assert(md_is_covered_by_alt_names(md, pub->alt_names));
+    ck_assert(md_cert_get_not_before(cert) == pub->not_before);
+    ck_assert(md_cert_get_not_after(cert) == pub->not_after);
+    ck_assert_int_eq(md_cert_must_staple(cert), pub->must_staple);
+    ck_assert_int_eq(APR_SUCCESS, md_reg_get_pubcert_chain(&certs, reg, md, NULL, g_pool));
+    ck_assert_int_eq(1, certs->nelts);
+    ck_assert_int_eq(md_reg_valid_until(g_reg, md, g_pool), md_reg_valid_until(reg, md, g_pool));
+    /* a frozen registry has the chain parsed, children can not read it */
+    ck_assert_int_eq(APR_SUCCESS, md_reg_freeze_domains(reg, mds));
+    ck_assert_int_eq(APR_SUCCESS, md_reg_get_pubcert(&pub, reg, md, NULL, g_pool));
+    ck_assert_ptr_nonnull(pub->certs);
+    ck_assert_int_eq(1, pub->certs->nelts);
+
+    /* a replaced chain is parsed again */
+    apr_sleep(apr_time_from_msec(10));
+    save_self_signed(md);
+    ck_assert_int_eq(APR_SUCCESS, md_reg_create(&reg, g_pool, g_store, NULL, NULL));
+    ck_assert_int_eq(APR_SUCCESS, md_reg_snapshot_load(reg, mds, g_pool));
+    ck_assert_int_eq(APR_SUCCESS, md_reg_get_pubcert(&pub, reg, md, NULL, g_pool));
+    ck_assert_ptr_nonnull(pub->certs);
+}
+END_TEST
+
+START_TEST(reg_sync_bench_1k)
+{
+    sync_bench(1000);
+}
+END_TEST
+
+START_TEST(reg_sync_bench_10k)
+{
+    sync_bench(10000);
+}
+END_TEST
+
+START_TEST(reg_sync_bench_50k)
+{
+    /* takes a while to generate the store, only run on demand */
+    if (getenv("MD_TEST_BENCH_LARGE")) {
+        sync_bench(50000);
+    }
+}
+END_TEST
+
+TCase *md_reg_test_case(void)
+{
+    TCase *testcase = tcase_create("md_reg");
+
+    tcase_add_checked_fixture(testcase, md_reg_setup, md_reg_teardown);
+    tcase_set_timeout(testcase, 600);
+
+    tcase_add_test(testcase, reg_sync_renames);
+    tcase_add_test(testcase, reg_snapshot);
+    tcase_add_test(testcase, reg_sync_bench_1k);
+    tcase_add_test(testcase, reg_sync_bench_10k);
+    tcase_add_test(testcase, reg_sync_bench_50k);
+
+    return testcase;
+}
@@ -12,8 +12,11 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 
+#include <apr_time.h>
+
 #include "test_common.h"
 #include "md_util.h"
 
@@ -99,6 +102,149 @@ START_TEST(base64_md_util_largetrip)
 }
 END_TEST
 
+typedef struct {
+    int key;
+    int idx;
+} heap_elem_t;
+
+static int heap_elem_less(const void *a, const void *b)
+{
+    return ((const heap_elem_t*)a)->key < ((const heap_elem_t*)b)->key;
+}
+
+static void heap_elem_set_idx(void *elem, int idx)
+{
+    ((heap_elem_t*)elem)->idx = idx;
+}
+
+static void heap_check_sorted(md_heap_t *heap, int count)
+{
+    heap_elem_t *e;
+    int last = -1;
+    
+    ck_assert_int_eq(count, md_heap_count(heap));
+    while ((e = md_heap_pop(heap))) {
+        ck_assert_int_le(last, e->key);
+        ck_assert_int_eq(-1, e->idx);
+        last = e->key;
+        --count;
+    }
+    ck_assert_int_eq(0, count);
+}
+
+START_TEST(heap_md_util_order)
+{
+    heap_elem_t elems[1000];
+    md_heap_t *heap;
+    int i;
+    
+    heap = md_heap_make(g_pool, 10, heap_elem_less, heap_elem_set_idx);
+    ck_assert(md_heap_peek(heap) == NULL);
+    ck_assert(md_heap_pop(heap) == NULL);
+    srand(4711);
+    for (i = 0; i < 1000; ++i) {
+        elems[i].key = rand() % 500;
+        md_heap_push(heap, &elems[i]);
+        ck_assert_int_eq(0, ((heap_elem_t*)md_heap_peek(heap))->idx);
+    }
+    heap_check_sorted(heap, 1000);
+}
+END_TEST
+
+START_TEST(heap_md_util_update)
+{
+    heap_elem_t elems[500];
+    md_heap_t *heap;
+    int i, n = 500;
+    
+    heap = md_heap_make(g_pool, 10, heap_elem_less, heap_elem_set_idx);
+    srand(815);
+    for (i = 0; i < n; ++i) {
+        elems[i].key = rand() % 1000;
+        md_heap_push(heap, &elems[i]);
+    }
+    /* change keys of elements in place, in both directions */
+    for (i = 0; i < n; i += 3) {
+        elems[i].key = rand() % 1000;
+        md_heap_update(heap, elems[i].idx);
+    }
+    /* remove some from the middle */
+    for (i = 1; i < n; i += 7) {
+        ck_assert(md_heap_remove_at(heap, elems[i].idx) == &elems[i]);
+        ck_assert_int_eq(-1, elems[i].idx);
+    }
+    ck_assert(md_heap_remove_at(heap, md_heap_count(heap)) == NULL);
+    heap_check_sorted(heap, n - (n + 5) / 7);
+}
+END_TEST
+
+#define HEAP_BENCH_ROUNDS   1000
+
+/* Time one renewal step - take the entry due next and schedule it again later -
+ * with the heap and with a scan over all entries, as the OCSP renewal did before. */
+static void heap_bench(int count)
+{
+    heap_elem_t *elems, *e;
+    md_heap_t *heap;
+    apr_time_t start, t_heap, t_scan;
+    int i, j, min;
+
+    elems = apr_pcalloc(g_pool, (apr_size_t)count * sizeof(*elems));
+    heap = md_heap_make(g_pool, count, heap_elem_less, heap_elem_set_idx);
+    srand(4711);
+    for (i = 0; i < count; ++i) {
+        elems[i].key = rand() % 100000;
+        md_heap_push(heap, &elems[i]);
+    }
+    start = apr_time_now();
+    for (i = 0; i < HEAP_BENCH_ROUNDS; ++i) {
+        e = md_heap_peek(heap);
+        e->key += rand() % 100000;
+        md_heap_update(heap, e->idx);
+    }
+    t_heap = apr_time_now() - start;
+    
+    start = apr_time_now();
+    for (i = 0; i < HEAP_BENCH_ROUNDS; ++i) {
+        for (j = 1, min = 0; j < count; ++j) {
+            if (elems[j].key < elems[min].key) min = j;
+        }
+        elems[min].key += rand() % 100000;
+    }
+    t_scan = apr_time_now() - start;
+    
+    fprintf(stdout, "# heap: %d entries, %.3f us per step, %.3f us scanning\n", count,
+            (double)t_heap / HEAP_BENCH_ROUNDS, (double)t_scan / HEAP_BENCH_ROUNDS);
+    fflush(stdout);
+    ck_assert_int_eq(count, md_heap_count(heap));
+}
+
+START_TEST(heap_md_util_bench)
+{
+    heap_bench(1000);
+    heap_bench(10000);
+    heap_bench(100000);
+}
+END_TEST
+
+START_TEST(retry_after_md_util_parse)
+{
+    apr_time_t now = apr_time_from_sec(1000000);
+    
+    ck_assert(md_util_parse_retry_after(NULL, now) == 0);
+    ck_assert(md_util_parse_retry_after("", now) == 0);
+    ck_assert(md_util_parse_retry_after("abc", now) == 0);
+    ck_assert(md_util_parse_retry_after("-5", now) == 0);
+    ck_assert(md_util_parse_retry_after("3x", now) == 0);
+    ck_assert(md_util_parse_retry_after("0", now) == now);
+    ck_assert(md_util_parse_retry_after(" 120", now) == now + apr_time_from_sec(120));
+    ck_assert(md_util_parse_retry_after("9999999", now) 
+              == now + apr_time_from_sec(24 * 60 * 60));
+    ck_assert(md_util_parse_retry_after("Wed, 21 Oct 2015 07:28:00 GMT", now) 
+              == apr_time_from_sec(1445412480));
+}
+END_TEST
+
 TCase *md_util_test_case(void)
 {
     TCase *testcase = tcase_create("md_util");
@@ -107,6 +253,10 @@ TCase *md_util_test_case(void)
 
     tcase_add_test(testcase, base64_md_util_roundtrip);
     tcase_add_test(testcase, base64_md_util_largetrip);
+    tcase_add_test(testcase, heap_md_util_order);
+    tcase_add_test(testcase, heap_md_util_update);
+    tcase_add_test(testcase, heap_md_util_bench);
+    tcase_add_test(testcase, retry_after_md_util_parse);
 
     return testcase;
 }